@@ -0,0 +1,310 @@
+#include "av_clip_exporter.h"
+#include "av_decoder.h"
+#include "av_log.h"
+
+#include <chrono>
+#include <vector>
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+AVClipExporter::AVClipExporter()
+{
+
+}
+
+AVClipExporter::~AVClipExporter()
+{
+	Cancel();
+	Wait();
+}
+
+bool AVClipExporter::Start(std::string input, std::string output, int64_t start_ms, int64_t end_ms, CutMode mode)
+{
+	if (running_) {
+		LOG("AVClipExporter is running.");
+		return false;
+	}
+
+	if (worker_.joinable()) {
+		worker_.join();
+	}
+
+	if (end_ms <= start_ms) {
+		LOG("invalid clip range %lld - %lld ms.", (long long)start_ms, (long long)end_ms);
+		return false;
+	}
+
+	input_ = input;
+	output_ = output;
+	start_ms_ = start_ms;
+	end_ms_ = end_ms;
+	mode_ = mode;
+	cancel_ = false;
+	progress_ = 0.0;
+	stats_ = AVClipExportStats();
+	result_ = false;
+	running_ = true;
+
+	worker_ = std::thread([this]() {
+		bool result = Export();
+		demuxer_.Close();
+
+		std::lock_guard<std::mutex> locker(mutex_);
+		result_ = result;
+		running_ = false;
+	});
+
+	return true;
+}
+
+void AVClipExporter::Cancel()
+{
+	cancel_ = true;
+}
+
+bool AVClipExporter::Wait()
+{
+	if (worker_.joinable()) {
+		worker_.join();
+	}
+
+	std::lock_guard<std::mutex> locker(mutex_);
+	return result_;
+}
+
+AVClipExportStats AVClipExporter::GetStats()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+	return stats_;
+}
+
+bool AVClipExporter::Export()
+{
+	auto begin = std::chrono::steady_clock::now();
+
+	if (!demuxer_.Open(input_)) {
+		return false;
+	}
+
+	AVFormatContext* input_context = demuxer_.GetFormatContext();
+	AVStream* video_stream = demuxer_.GetVideoStream();
+	AVStream* audio_stream = demuxer_.GetAudioStream();
+
+	AVFormatContext* output_context = nullptr;
+	avformat_alloc_output_context2(&output_context, NULL, NULL, output_.c_str());
+	if (!output_context) {
+		LOG("could not deduce output format from %s.", output_.c_str());
+		return false;
+	}
+
+	bool exact = mode_ == CUT_EXACT && (!strcmp(output_context->oformat->name, "mp4") || !strcmp(output_context->oformat->name, "mov"));
+
+	std::vector<int> stream_map(input_context->nb_streams, -1);
+	AVStream* input_streams[] = { video_stream, audio_stream };
+	for (AVStream* stream : input_streams) {
+		if (!stream) {
+			continue;
+		}
+
+		AVStream* out = avformat_new_stream(output_context, NULL);
+		if (!out || avcodec_parameters_copy(out->codecpar, stream->codecpar) < 0) {
+			avformat_free_context(output_context);
+			return false;
+		}
+
+		out->codecpar->codec_tag = 0;
+		out->time_base = stream->time_base;
+		stream_map[stream->index] = out->index;
+	}
+
+	if (!(output_context->oformat->flags & AVFMT_NOFILE)) {
+		if (avio_open(&output_context->pb, output_.c_str(), AVIO_FLAG_WRITE) < 0) {
+			LOG("open %s failed.", output_.c_str());
+			avformat_free_context(output_context);
+			return false;
+		}
+	}
+
+	AVDictionary* options = nullptr;
+	if (exact) {
+		av_dict_set(&options, "use_editlist", "1", 0);
+	}
+	int ret = avformat_write_header(output_context, &options);
+	av_dict_free(&options);
+	if (ret < 0) {
+		LOG("write header to %s failed. %d", output_.c_str(), ret);
+		avio_closep(&output_context->pb);
+		avformat_free_context(output_context);
+		return false;
+	}
+
+	// requested range in the absolute timestamp domain
+	int64_t origin_ms = input_context->start_time != AV_NOPTS_VALUE ? av_rescale(input_context->start_time, 1000, AV_TIME_BASE) : 0;
+	int64_t start_ms = origin_ms + start_ms_;
+	int64_t end_ms = origin_ms + end_ms_;
+
+	demuxer_.Seek(start_ms);
+
+	AVPacket* packet = av_packet_alloc();
+	int64_t keyframe_ms = AV_NOPTS_VALUE;
+	int64_t cut_ms = AV_NOPTS_VALUE; // becomes t=0 in the clip
+	int64_t last_ms = AV_NOPTS_VALUE;
+	AVClipExportStats stats;
+
+	while (!cancel_) {
+		ret = demuxer_.ReadRaw(packet);
+		if (ret < 0) {
+			if (demuxer_.IsEOF() || ret == -2) {
+				break;
+			}
+			continue;
+		}
+
+		int out_index = packet->stream_index < (int)stream_map.size() ? stream_map[packet->stream_index] : -1;
+		int64_t ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+		if (out_index < 0 || ts == AV_NOPTS_VALUE) {
+			av_packet_unref(packet);
+			continue;
+		}
+
+		AVStream* in = input_context->streams[packet->stream_index];
+		AVStream* out = output_context->streams[out_index];
+		bool is_video = video_stream && packet->stream_index == video_stream->index;
+		int64_t pts_ms = av_rescale_q(ts, in->time_base, { 1, 1000 });
+		int64_t dts_ms = packet->dts != AV_NOPTS_VALUE ? av_rescale_q(packet->dts, in->time_base, { 1, 1000 }) : pts_ms;
+
+		if (cut_ms == AV_NOPTS_VALUE) {
+			// the clip starts on a video keyframe
+			if (video_stream && !(is_video && (packet->flags & AV_PKT_FLAG_KEY))) {
+				av_packet_unref(packet);
+				continue;
+			}
+
+			keyframe_ms = video_stream ? pts_ms : start_ms;
+			cut_ms = exact ? FFMAX(start_ms, keyframe_ms) : keyframe_ms;
+		}
+
+		if ((is_video || !video_stream) && dts_ms > end_ms) {
+			av_packet_unref(packet);
+			break;
+		}
+
+		// audio needs no lead-in
+		if (!is_video && (pts_ms < cut_ms || pts_ms > end_ms)) {
+			av_packet_unref(packet);
+			continue;
+		}
+
+		int64_t offset = av_rescale_q(cut_ms, { 1, 1000 }, in->time_base);
+		if (packet->pts != AV_NOPTS_VALUE) {
+			packet->pts -= offset;
+		}
+		if (packet->dts != AV_NOPTS_VALUE) {
+			packet->dts -= offset;
+		}
+		av_packet_rescale_ts(packet, in->time_base, out->time_base);
+		packet->stream_index = out_index;
+		packet->pos = -1;
+
+		stats.packets++;
+		stats.bytes += packet->size;
+		if (is_video) {
+			stats.video_frames++;
+		}
+		last_ms = FFMAX(last_ms, pts_ms);
+		progress_ = FFMIN(1.0, FFMAX(0.0, (double)(dts_ms - cut_ms) / (end_ms - cut_ms)));
+
+		ret = av_interleaved_write_frame(output_context, packet);
+		if (ret < 0) {
+			LOG("write packet failed. %d", ret);
+			break;
+		}
+	}
+
+	av_packet_free(&packet);
+	av_write_trailer(output_context);
+	if (!(output_context->oformat->flags & AVFMT_NOFILE)) {
+		avio_closep(&output_context->pb);
+	}
+	avformat_free_context(output_context);
+
+	if (cancel_ || cut_ms == AV_NOPTS_VALUE) {
+		return false;
+	}
+
+	stats.elapsed = seconds_since(begin);
+	stats.clip_duration = (last_ms - cut_ms) / 1000.0;
+	stats.realtime_factor = stats.elapsed > 0.0 ? stats.clip_duration / stats.elapsed : 0.0;
+
+	if (measure_speedup_ && video_stream && stats.video_frames > 0) {
+		stats.transcode_estimate = EstimateDecodeTime(video_stream, keyframe_ms, stats.video_frames);
+		stats.speedup = stats.elapsed > 0.0 ? stats.transcode_estimate / stats.elapsed : 0.0;
+	}
+
+	LOG("exported %s: %lld packets, %.2f s clip in %.3f s (%.1fx realtime, ~%.1fx faster than transcode)\n",
+		output_.c_str(), (long long)stats.packets, stats.clip_duration, stats.elapsed,
+		stats.realtime_factor, stats.speedup);
+
+	progress_ = 1.0;
+	std::lock_guard<std::mutex> locker(mutex_);
+	stats_ = stats;
+	return true;
+}
+
+// Decodes the first GOP of the clip and extrapolates to the whole clip. Encoding
+// is not included, so this is a lower bound of a transcode.
+double AVClipExporter::EstimateDecodeTime(AVStream* video_stream, int64_t keyframe_ms, int64_t frames)
+{
+	AVDecoder decoder;
+	if (!decoder.Init(video_stream, nullptr, false) || !demuxer_.Seek(keyframe_ms)) {
+		return 0.0;
+	}
+
+	AVPacket* packet = av_packet_alloc();
+	AVFrame* frame = av_frame_alloc();
+	int64_t decoded = 0;
+	int keyframes = 0;
+
+	auto begin = std::chrono::steady_clock::now();
+
+	while (!cancel_ && decoded < frames) {
+		int ret = demuxer_.Read(packet);
+		if (ret < 0) {
+			if (demuxer_.IsEOF() || ret == -2) {
+				break;
+			}
+			continue;
+		}
+
+		if (packet->stream_index == video_stream->index) {
+			if ((packet->flags & AV_PKT_FLAG_KEY) && ++keyframes > 1) {
+				av_packet_unref(packet);
+				break;
+			}
+
+			decoder.Send(packet);
+			while (decoder.Recv(frame) >= 0) {
+				decoded++;
+				av_frame_unref(frame);
+			}
+		}
+
+		av_packet_unref(packet);
+	}
+
+	decoder.Send(nullptr);
+	while (decoder.Recv(frame) >= 0) {
+		decoded++;
+		av_frame_unref(frame);
+	}
+
+	double elapsed = seconds_since(begin);
+
+	av_frame_free(&frame);
+	av_packet_free(&packet);
+
+	return decoded > 0 ? elapsed / decoded * frames : 0.0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+#include "av_demuxer.h"
+
+struct AVClipExportStats
+{
+	int64_t packets = 0;
+	int64_t bytes = 0;
+	int64_t video_frames = 0;
+	double  clip_duration = 0.0;     // s
+	double  elapsed = 0.0;           // s
+	double  realtime_factor = 0.0;   // clip duration / elapsed
+	double  transcode_estimate = 0.0; // s, decode-only lower bound
+	double  speedup = 0.0;           // transcode_estimate / elapsed
+};
+
+// Stream-copy export of a time range into MP4/MKV (container from the output
+// extension), no decoding. Runs on its own thread.
+class AVClipExporter
+{
+public:
+	enum CutMode {
+		// start at the keyframe before start_ms, the clip begins slightly early
+		CUT_KEYFRAME,
+		// keep the GOP from that keyframe but put start_ms at t=0, the lead-in is
+		// hidden by an MP4 edit list; falls back to CUT_KEYFRAME for other containers
+		CUT_EXACT,
+	};
+
+	AVClipExporter& operator=(const AVClipExporter&) = delete;
+	AVClipExporter(const AVClipExporter&) = delete;
+	AVClipExporter();
+	virtual ~AVClipExporter();
+
+	// start_ms/end_ms are relative to the start of the input.
+	virtual bool Start(std::string input, std::string output, int64_t start_ms, int64_t end_ms, CutMode mode = CUT_KEYFRAME);
+	virtual void Cancel();
+	virtual bool Wait();
+
+	bool IsRunning() { return running_; }
+	double GetProgress() { return progress_; }
+	AVClipExportStats GetStats();
+
+	// Decode the first GOP after exporting to estimate the transcode time.
+	void SetMeasureSpeedup(bool measure) { measure_speedup_ = measure; }
+
+private:
+	bool Export();
+	double EstimateDecodeTime(AVStream* video_stream, int64_t keyframe_ms, int64_t frames);
+
+private:
+	std::mutex mutex_;
+	std::thread worker_;
+
+	std::string input_;
+	std::string output_;
+	int64_t start_ms_ = 0;
+	int64_t end_ms_ = 0;
+	CutMode mode_ = CUT_KEYFRAME;
+	bool measure_speedup_ = true;
+
+	AVDemuxer demuxer_;
+
+	std::atomic<bool> running_{ false };
+	std::atomic<bool> cancel_{ false };
+	std::atomic<double> progress_{ 0.0 };
+	bool result_ = false;
+	AVClipExportStats stats_;
+};
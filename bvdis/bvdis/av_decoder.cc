@@ -1,48 +1,60 @@
 #include "av_decoder.h"
+#include "av_nal_parser.h"
 #include "av_log.h"
 
+#include <thread>
+#include <chrono>
+#include <new>
 
-static enum AVPixelFormat get_d3d11va_hw_format(AVCodecContext* avctx, const enum AVPixelFormat* pix_fmts)
-{
-	while (*pix_fmts != AV_PIX_FMT_NONE) {
-		if (*pix_fmts == AV_PIX_FMT_D3D11) {
-			AVBufferRef* hw_device_ref = (AVBufferRef*)avctx->opaque;
-			AVHWFramesContext* frames_ctx = nullptr;
-			AVD3D11VAFramesContext* frames_hwctx = nullptr;
-			avctx->hw_frames_ctx = av_hwframe_ctx_alloc(hw_device_ref);
-			if (!avctx->hw_frames_ctx) {
-				return AV_PIX_FMT_NONE;
-			}
+// auto mode never goes beyond this many threads per decoder
+static const int kMaxAutoThreads = 16;
 
-			//AVHWDeviceContext* device_context = reinterpret_cast<AVHWDeviceContext*>(avctx->hw_frames_ctx->data);
-			//AVD3D11VADeviceContext* d3d11va_device_context = reinterpret_cast<AVD3D11VADeviceContext*>(device_context->hwctx);
+// consecutive surface allocation failures on a hardware device before falling back
+static const int kMaxHwErrors = 3;
 
-			frames_ctx = (AVHWFramesContext*)avctx->hw_frames_ctx->data;
-			frames_hwctx = (AVD3D11VAFramesContext*)frames_ctx->hwctx;
+// working surfaces on top of DPB, frame threads and the caller's queue, as in
+// libavcodec's own d3d11va/dxva2 pool sizing
+static const int kHwPoolMargin = 4;
 
-			frames_ctx->format = AV_PIX_FMT_D3D11;
-			frames_ctx->sw_format = AV_PIX_FMT_NV12;
-			frames_ctx->width = FFALIGN(avctx->coded_width, 32);
-			frames_ctx->height = FFALIGN(avctx->coded_height, 32);
-			frames_ctx->initial_pool_size = 10;
+// send times kept for latency, packets that never produce a frame age out
+static const size_t kMaxPending = 64;
 
-			frames_hwctx->BindFlags |= D3D11_BIND_DECODER;
-			frames_hwctx->MiscFlags |= D3D11_RESOURCE_MISC_SHARED;
-			//frames_hwctx->BindFlags D3D11_BIND_SHADER_RESOURCE;
+static const AVHWDeviceType kHwDeviceTypes[] = {
+#if defined(_WIN32)
+	AV_HWDEVICE_TYPE_D3D11VA,
+	AV_HWDEVICE_TYPE_DXVA2,
+#elif defined(__APPLE__)
+	AV_HWDEVICE_TYPE_VIDEOTOOLBOX,
+#else
+	AV_HWDEVICE_TYPE_VAAPI,
+	AV_HWDEVICE_TYPE_VDPAU,
+	AV_HWDEVICE_TYPE_CUDA,
+#endif
+};
 
-			int ret = av_hwframe_ctx_init(avctx->hw_frames_ctx);
-			if (ret < 0) {
-				return AV_PIX_FMT_NONE;
-			}
+std::atomic<int> AVDecoder::active_decoders_{ 0 };
+std::atomic<int> AVDecoder::expected_decoders_{ 0 };
 
-			return AV_PIX_FMT_D3D11;
-		}
+struct HwPoolUsage
+{
+	std::atomic<int> outstanding;
+	std::atomic<int> peak;
+};
 
-		pix_fmts++;
-	}
+// opaque_ref of a tracked hw frame, freed with its last reference
+static void release_hw_frame(void* opaque, uint8_t* data)
+{
+	HwPoolUsage* usage = (HwPoolUsage*)data;
+	usage->outstanding--;
 
-	LOG("Failed to get HW surface format.");
-	return AV_PIX_FMT_NONE;
+	AVBufferRef* usage_ref = (AVBufferRef*)opaque;
+	av_buffer_unref(&usage_ref);
+}
+
+static int64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 AVDecoder::AVDecoder()
@@ -57,97 +69,417 @@ AVDecoder::~AVDecoder()
 
 
 bool AVDecoder::Init(AVStream* stream, void* d3d11_device, bool hw)
+{
+	if (!stream) {
+		return false;
+	}
+
+	if (!Init(stream->codecpar, stream->time_base, d3d11_device, hw)) {
+		return false;
+	}
+
+	stream->discard = AVDISCARD_DEFAULT;
+	start_pts_ = stream->start_time;
+	next_pts_ = start_pts_;
+	stream_ = stream;
+
+	return true;
+}
+
+bool AVDecoder::Init(const AVCodecParameters* codecpar, AVRational time_base, void* d3d11_device, bool hw)
 {
 	if (codec_context_ != nullptr) {
 		LOG("codec was opened.");
 		return false;
 	}
 
-	if (!stream) {
+	if (!codecpar) {
+		return false;
+	}
+
+	if (codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+		return false;
+	}
+
+	switch_begin_ = now_us();
+	switch_latency_ = -1.0;
+
+	if (!avcodec_find_decoder(codecpar->codec_id)) {
+		LOG("decoder(%s) not found.", avcodec_get_name(codecpar->codec_id));
 		return false;
 	}
 
-	if (stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+	codecpar_ = avcodec_parameters_alloc();
+	if (!codecpar_ || avcodec_parameters_copy(codecpar_, codecpar) < 0) {
+		avcodec_parameters_free(&codecpar_);
 		return false;
 	}
+	time_base_ = time_base;
+	d3d11_device_ = d3d11_device;
 
-	AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+	chain_.clear();
+	if (hw) {
+		if (hw_device_types_.empty()) {
+			chain_.assign(kHwDeviceTypes, kHwDeviceTypes + sizeof(kHwDeviceTypes) / sizeof(kHwDeviceTypes[0]));
+		}
+		else {
+			chain_ = hw_device_types_;
+		}
+	}
+	chain_.push_back(AV_HWDEVICE_TYPE_NONE);
+
+	fallbacks_ = 0;
+	abort_ = false;
+	ResetStats();
+	if (!OpenChain(0)) {
+		LOG("Open decoder(%s) failed.", avcodec_get_name(codecpar->codec_id));
+		avcodec_parameters_free(&codecpar_);
+		return false;
+	}
+
+	active_decoders_++;
+
+	start_pts_ = AV_NOPTS_VALUE;
+	next_pts_ = AV_NOPTS_VALUE;
+	start_pts_tb_ = time_base;
+
+	finished_ = 0;
+	next_pts_ = start_pts_;
+	next_pts_tb_ = start_pts_tb_;
+
+	return true;
+}
+
+// First entry of the chain from first on that opens.
+bool AVDecoder::OpenChain(size_t first)
+{
+	for (size_t i = first; i < chain_.size(); i++) {
+		if (OpenCodec(chain_[i])) {
+			chain_index_ = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool AVDecoder::OpenCodec(AVHWDeviceType type)
+{
+	AVCodec* codec = avcodec_find_decoder(codecpar_->codec_id);
 	if (!codec) {
-		LOG("decoder(%s) not found.", avcodec_get_name(stream->codecpar->codec_id));
 		return false;
 	}
 
-	AVHWDeviceType hw_type = AV_HWDEVICE_TYPE_D3D11VA;
+	// capability probe, the codec needs a hwaccel for this device type
+	AVPixelFormat hw_format = AV_PIX_FMT_NONE;
+	if (type != AV_HWDEVICE_TYPE_NONE) {
+		for (int i = 0;; i++) {
+			const AVCodecHWConfig* config = avcodec_get_hw_config(codec, i);
+			if (!config) {
+				return false;
+			}
+			if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
+				config->device_type == type) {
+				hw_format = config->pix_fmt;
+				break;
+			}
+		}
+	}
 
 	codec_context_ = avcodec_alloc_context3(codec);
-	if (avcodec_parameters_to_context(codec_context_, stream->codecpar) < 0) {
+	if (!codec_context_) {
+		return false;
+	}
+
+	if (avcodec_parameters_to_context(codec_context_, codecpar_) < 0) {
 		LOG("avcodec_parameters_to_context() failed.");
 		goto failed;
 	}
 
-	for (int i = 0;; i++) {
-		const AVCodecHWConfig* config = avcodec_get_hw_config(codec, i);
-		if (!config) {
-			LOG("Decoder %s does not support device type %s.\n",
-				codec->name, av_hwdevice_get_type_name(hw_type));
+	if (type != AV_HWDEVICE_TYPE_NONE) {
+		if (!CreateDevice(type)) {
 			goto failed;
 		}
-		if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
-			config->device_type == hw_type) {
-			break;
+
+		hw_format_ = hw_format;
+		dpb_frames_ = AVNalParser::GetMaxDpbFrames(codecpar_);
+		hw_pool_size_ = 0;
+		codec_context_->extra_hw_frames = hw_queue_depth_;
+		codec_context_->hw_device_ctx = av_buffer_ref(device_buffer_);
+		codec_context_->opaque = this;
+		codec_context_->get_format = GetHwFormat;
+		codec_context_->get_buffer2 = GetHwBuffer;
+		codec_context_->pkt_timebase = time_base_;
+	}
+
+	ConfigureThreads(type != AV_HWDEVICE_TYPE_NONE);
+
+	wait_keyframe_ = false;
+	codec_context_->skip_frame = (AVDiscard)(int)skip_frame_;
+
+	if (avcodec_open2(codec_context_, codec, NULL) != 0) {
+		goto failed;
+	}
+
+	hw_type_ = type;
+	hw_errors_ = 0;
+	hw_failures_ = 0;
+	if (type != AV_HWDEVICE_TYPE_NONE) {
+		LOG("decoder %s uses %s.\n", codec->name, av_hwdevice_get_type_name(type));
+	}
+	return true;
+
+failed:
+	avcodec_free_context(&codec_context_);
+	av_buffer_unref(&device_buffer_);
+	hw_format_ = AV_PIX_FMT_NONE;
+	return false;
+}
+
+bool AVDecoder::CreateDevice(AVHWDeviceType type)
+{
+#ifdef _WIN32
+	// share the renderer's device, its textures can be copied without readback
+	if (type == AV_HWDEVICE_TYPE_D3D11VA && d3d11_device_) {
+		device_buffer_ = av_hwdevice_ctx_alloc(type);
+		if (!device_buffer_) {
+			return false;
+		}
+
+		AVHWDeviceContext* device_context = (AVHWDeviceContext*)device_buffer_->data;
+		AVD3D11VADeviceContext* d3d11_device_context = (AVD3D11VADeviceContext*)device_context->hwctx;
+
+		d3d11_device_context->device = (ID3D11Device*)d3d11_device_;
+		d3d11_device_context->device->AddRef();
+		if (av_hwdevice_ctx_init(device_buffer_) < 0) {
+			av_buffer_unref(&device_buffer_);
+			return false;
 		}
+
+		return true;
 	}
+#endif
 
-	if (hw)
-	{
-		if (d3d11_device) {
-			AVHWDeviceContext* device_context = nullptr;
-			AVD3D11VADeviceContext* d3d11_device_context = nullptr;
+	return av_hwdevice_ctx_create(&device_buffer_, type, NULL, NULL, 0) >= 0;
+}
+
+#ifdef _WIN32
+bool AVDecoder::InitD3D11Frames(AVCodecContext* avctx)
+{
+	AVHWFramesContext* frames_ctx = nullptr;
+	AVD3D11VAFramesContext* frames_hwctx = nullptr;
+	avctx->hw_frames_ctx = av_hwframe_ctx_alloc(avctx->hw_device_ctx);
+	if (!avctx->hw_frames_ctx) {
+		return false;
+	}
 
-			device_buffer_ = av_hwdevice_ctx_alloc(hw_type);
-			device_context = (AVHWDeviceContext*)device_buffer_->data;
-			d3d11_device_context = (AVD3D11VADeviceContext*)device_context->hwctx;
+	frames_ctx = (AVHWFramesContext*)avctx->hw_frames_ctx->data;
+	frames_hwctx = (AVD3D11VAFramesContext*)frames_ctx->hwctx;
 
-			d3d11_device_context->device = (ID3D11Device*)d3d11_device;
-			d3d11_device_context->device->AddRef();
-			av_hwdevice_ctx_init(device_buffer_);
+	frames_ctx->format = AV_PIX_FMT_D3D11;
+	frames_ctx->sw_format = AV_PIX_FMT_NV12;
+	frames_ctx->width = FFALIGN(avctx->coded_width, 32);
+	frames_ctx->height = FFALIGN(avctx->coded_height, 32);
+	// a texture array cannot grow: working surfaces (the picture being decoded
+	// among them) + DPB + frame threads + frames held downstream
+	frames_ctx->initial_pool_size = kHwPoolMargin + dpb_frames_ + FFMAX(avctx->thread_count - 1, 0) + hw_queue_depth_;
+	hw_pool_size_ = frames_ctx->initial_pool_size;
 
-			codec_context_->hw_device_ctx = av_buffer_ref(device_buffer_);
-			codec_context_->opaque = device_buffer_;
+	frames_hwctx->BindFlags |= D3D11_BIND_DECODER;
+	frames_hwctx->MiscFlags |= D3D11_RESOURCE_MISC_SHARED;
+	//frames_hwctx->BindFlags D3D11_BIND_SHADER_RESOURCE;
+
+	if (av_hwframe_ctx_init(avctx->hw_frames_ctx) < 0) {
+		av_buffer_unref(&avctx->hw_frames_ctx);
+		return false;
+	}
+
+	return true;
+}
+#else
+bool AVDecoder::InitD3D11Frames(AVCodecContext* /*avctx*/)
+{
+	return false;
+}
+#endif
+
+// get_format: the device's surface format, or software decode when the
+// hwaccel does not take this stream (profile, size). Surfaces that cannot be
+// allocated fail the decode, HandleError() moves down the chain.
+enum AVPixelFormat AVDecoder::GetHwFormat(AVCodecContext* avctx, const enum AVPixelFormat* pix_fmts)
+{
+	AVDecoder* decoder = (AVDecoder*)avctx->opaque;
+
+	for (const enum AVPixelFormat* p = pix_fmts; *p != AV_PIX_FMT_NONE; p++) {
+		if (*p != decoder->hw_format_) {
+			continue;
 		}
-		else {
-			av_hwdevice_ctx_create(&device_buffer_, hw_type, NULL, NULL, 0);
-			codec_context_->hw_device_ctx = av_buffer_ref(device_buffer_);
+
+		// D3D11 textures handed to the renderer need shareable decoder surfaces
+		if (*p == AV_PIX_FMT_D3D11 && decoder->d3d11_device_) {
+			av_buffer_unref(&avctx->hw_frames_ctx);
+			if (!decoder->InitD3D11Frames(avctx)) {
+				LOG("Failed to allocate D3D11 decoder surfaces.\n");
+				decoder->hw_failures_ += kMaxHwErrors;
+				return AV_PIX_FMT_NONE;
+			}
 		}
 
-		codec_context_->get_format = get_d3d11va_hw_format;
-		codec_context_->thread_count = 1;
-		codec_context_->pkt_timebase = stream->time_base;
+		return *p;
 	}
 
-	if (avcodec_open2(codec_context_, codec, NULL) != 0) {
-		LOG("Open decoder(%d) failed.", (int)stream->codecpar->codec_id);
-		goto failed;
+	for (const enum AVPixelFormat* p = pix_fmts; *p != AV_PIX_FMT_NONE; p++) {
+		const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(*p);
+		if (desc && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+			LOG("Failed to get HW surface format, %s decodes in software.\n", avctx->codec->name);
+			decoder->fallbacks_++;
+			return *p;
+		}
 	}
 
-	stream->discard = AVDISCARD_DEFAULT;
-	start_pts_ = stream->start_time;
-	next_pts_ = AV_NOPTS_VALUE;
-	start_pts_tb_ = stream->time_base;
+	return AV_PIX_FMT_NONE;
+}
 
-	finished_ = 0;
-	next_pts_ = start_pts_;
-	next_pts_tb_ = start_pts_tb_;
-	stream_ = stream;
+// get_buffer2: counts hw surfaces that could not be allocated, e.g. an
+// exhausted fixed-size D3D11 texture array.
+int AVDecoder::GetHwBuffer(AVCodecContext* avctx, AVFrame* frame, int flags)
+{
+	AVDecoder* decoder = (AVDecoder*)avctx->opaque;
+
+	int ret = avcodec_default_get_buffer2(avctx, frame, flags);
+	if (ret < 0 && avctx->hw_frames_ctx) {
+		decoder->hw_failures_++;
+
+		// called with mutex_ held, by Send()/Recv() or for frame threads
+		if (decoder->hw_pool_size_ > 0) {
+			int outstanding = decoder->hw_usage_ ? ((HwPoolUsage*)decoder->hw_usage_->data)->outstanding.load() : 0;
+			LOG("hw surface pool of %d exhausted (DPB %d, queue depth %d), %d frames held downstream. Raise SetHwQueueDepth().\n",
+				(int)decoder->hw_pool_size_, decoder->dpb_frames_, decoder->hw_queue_depth_, outstanding);
+		}
+	}
+	return ret;
+}
+
+// Moves to the next entry of the chain after repeated hardware failures,
+// mutex_ held. Only surface allocation and hwaccel setup count, bitstream
+// errors go to the caller as they are. Returns true when the caller should go
+// on with the new decoder.
+bool AVDecoder::HandleError(int ret)
+{
+	if (ret >= 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF || hw_type_ == AV_HWDEVICE_TYPE_NONE) {
+		return false;
+	}
+
+	int failures = hw_failures_.exchange(0);
+	if (failures == 0) {
+		return false;
+	}
+
+	hw_errors_ += failures;
+	if (hw_errors_ < kMaxHwErrors) {
+		return false;
+	}
+
+	LOG("%s decoding failed (%d), falling back.\n", av_hwdevice_get_type_name(hw_type_), ret);
+
+	avcodec_free_context(&codec_context_);
+	av_buffer_unref(&device_buffer_);
+	hw_format_ = AV_PIX_FMT_NONE;
+	fallbacks_++;
+
+	if (!OpenChain(chain_index_ + 1)) {
+		LOG("no decoder left for %s.", avcodec_get_name(codecpar_->codec_id));
+		active_decoders_--;
+		return false;
+	}
+
+	// the new decoder has no reference frames
+	need_keyframe_ = true;
+	ClearPending();
 
+	// wakes both waiters: a feeder in SendWait() retries against the new,
+	// empty decoder instead of waiting for a frame the old one never returns
+	send_seq_++;
+	recv_seq_++;
 	return true;
-failed:
-	if (codec_context_) {
-		avcodec_free_context(&codec_context_);
-		codec_context_ = nullptr;
+}
+
+// Counts the surface as outstanding until the last reference to the frame goes.
+void AVDecoder::TrackHwFrame(AVFrame* frame)
+{
+	if (frame->opaque_ref) {
+		return;
 	}
 
-	return false;
+	if (!hw_usage_) {
+		hw_usage_ = av_buffer_allocz(sizeof(HwPoolUsage));
+		if (!hw_usage_) {
+			return;
+		}
+		new (hw_usage_->data) HwPoolUsage();
+	}
+
+	AVBufferRef* usage_ref = av_buffer_ref(hw_usage_);
+	if (!usage_ref) {
+		return;
+	}
+
+	HwPoolUsage* usage = (HwPoolUsage*)hw_usage_->data;
+	frame->opaque_ref = av_buffer_create(hw_usage_->data, 0, release_hw_frame, usage_ref, 0);
+	if (!frame->opaque_ref) {
+		av_buffer_unref(&usage_ref);
+		return;
+	}
+
+	int outstanding = ++usage->outstanding;
+	int peak = usage->peak;
+	while (outstanding > peak && !usage->peak.compare_exchange_weak(peak, outstanding)) {
+	}
+
+	// the pool budgets hw_queue_depth_ frames downstream, this one included
+	if (outstanding > hw_queue_depth_ && hw_pool_size_ > 0 && !hw_usage_warned_) {
+		LOG("%d hw frames held downstream, pool of %d sized for %d. Raise SetHwQueueDepth().\n",
+			outstanding, (int)hw_pool_size_, hw_queue_depth_);
+		hw_usage_warned_ = true;
+	}
+}
+
+AVHwPoolStats AVDecoder::GetHwPoolStats()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	AVHwPoolStats stats;
+	stats.pool_size = hw_pool_size_;
+	stats.dpb_frames = dpb_frames_;
+	stats.queue_depth = hw_queue_depth_;
+	if (hw_usage_) {
+		HwPoolUsage* usage = (HwPoolUsage*)hw_usage_->data;
+		stats.outstanding = usage->outstanding;
+		stats.peak_outstanding = usage->peak;
+	}
+	return stats;
+}
+
+// Hardware frames that are not D3D11 textures on the caller's device go to
+// system memory.
+int AVDecoder::DownloadFrame(AVFrame* frame)
+{
+	AVFrame* sw_frame = av_frame_alloc();
+	if (!sw_frame) {
+		return AVERROR(ENOMEM);
+	}
+
+	int ret = av_hwframe_transfer_data(sw_frame, frame, 0);
+	if (ret >= 0) {
+		ret = av_frame_copy_props(sw_frame, frame);
+	}
+	if (ret >= 0) {
+		av_frame_unref(frame);
+		av_frame_move_ref(frame, sw_frame);
+	}
+
+	av_frame_free(&sw_frame);
+	return ret;
 }
 
 void AVDecoder::Destroy()
@@ -157,6 +489,7 @@ void AVDecoder::Destroy()
 		avcodec_free_context(&codec_context_);
 		codec_context_ = nullptr;
 		stream_ = nullptr;
+		active_decoders_--;
 	}
 
 	if (device_buffer_) {
@@ -164,52 +497,514 @@ void AVDecoder::Destroy()
 		device_buffer_ = nullptr;
 	}
 
+	avcodec_parameters_free(&codecpar_);
+	av_buffer_unref(&hw_usage_);
+	hw_pool_size_ = 0;
+	hw_type_ = AV_HWDEVICE_TYPE_NONE;
+	hw_format_ = AV_PIX_FMT_NONE;
+	need_keyframe_ = false;
+
+	av_freep(&new_extradata_);
+	new_extradata_size_ = 0;
+	ClearPending();
+
 	start_pts_ = AV_NOPTS_VALUE;
 	next_pts_ = AV_NOPTS_VALUE;
 }
 
-int AVDecoder::Send(AVPacket* packet)
+// mutex_ held
+int AVDecoder::SendLocked(AVPacket* packet)
 {
-	std::lock_guard<std::mutex> locker(mutex_);
-
 	if (codec_context_ == NULL) {
 		return -1;
 	}
 
+	if (new_extradata_ && packet && packet->size > 0) {
+		if (!av_packet_get_side_data(packet, AV_PKT_DATA_NEW_EXTRADATA, NULL)) {
+			av_packet_add_side_data(packet, AV_PKT_DATA_NEW_EXTRADATA, new_extradata_, new_extradata_size_);
+		}
+		else {
+			av_free(new_extradata_);
+		}
+		new_extradata_ = nullptr;
+		new_extradata_size_ = 0;
+	}
+
+	if (need_keyframe_ && packet) {
+		if (!(packet->flags & AV_PKT_FLAG_KEY)) {
+			return 0;
+		}
+		need_keyframe_ = false;
+	}
+
+	if (wait_keyframe_ && packet && (packet->flags & AV_PKT_FLAG_KEY)) {
+		codec_context_->skip_frame = (AVDiscard)(int)skip_frame_;
+		wait_keyframe_ = false;
+	}
+
+	send_calls_++;
+
 	int ret = avcodec_send_packet(codec_context_, packet);
+	if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+		errors_++;
+	}
+	if (HandleError(ret)) {
+		if (packet && (packet->flags & AV_PKT_FLAG_KEY)) {
+			need_keyframe_ = false;
+			ret = avcodec_send_packet(codec_context_, packet);
+		}
+		else {
+			ret = 0;
+		}
+	}
+
+	if (ret == AVERROR(EAGAIN)) {
+		send_eagain_++;
+	}
+	else {
+		if (ret >= 0 && packet && packet->size > 0) {
+			TrackSend(packet);
+		}
+		send_seq_++;
+	}
+
+	return ret;
+}
+
+int AVDecoder::Send(AVPacket* packet)
+{
+	int ret = 0;
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+		ret = SendLocked(packet);
+	}
+
+	cond_.notify_all();
+	return ret;
+}
+
+int AVDecoder::SendWait(AVPacket* packet, int timeout_ms)
+{
+	std::unique_lock<std::mutex> locker(mutex_);
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	while (!abort_) {
+		uint64_t recv_seq = recv_seq_;
+		int ret = SendLocked(packet);
+		if (ret != AVERROR(EAGAIN)) {
+			locker.unlock();
+			cond_.notify_all();
+			return ret;
+		}
+
+		// frames are pending, wait for the drain thread to take one
+		auto ready = [&]() { return abort_ || recv_seq_ != recv_seq; };
+		if (timeout_ms < 0) {
+			cond_.wait(locker, ready);
+		}
+		else if (!cond_.wait_until(locker, deadline, ready)) {
+			return AVERROR(EAGAIN);
+		}
+	}
+
+	return AVERROR_EXIT;
+}
+
+// mutex_ held. download is set for hw frames that go to system memory, done
+// by the caller without the lock.
+int AVDecoder::RecvLocked(AVFrame* frame, bool* download)
+{
+	*download = false;
+
+	if (codec_context_ == NULL || codec_context_->codec_type != AVMEDIA_TYPE_VIDEO) {
+		return -1;
+	}
+
+	recv_calls_++;
+
+	int ret = avcodec_receive_frame(codec_context_, frame);
+	if (ret >= 0) {
+		hw_errors_ = 0;
+		recv_seq_++;
+		TrackRecv(frame);
+
+		if (frame->hw_frames_ctx) {
+			if (hw_type_ == AV_HWDEVICE_TYPE_D3D11VA && d3d11_device_) {
+				TrackHwFrame(frame);
+			}
+			else {
+				*download = true;
+			}
+		}
+
+		if (switch_latency_ < 0.0) {
+			switch_latency_ = (now_us() - switch_begin_) / 1000.0;
+		}
+
+		if (decoder_reorder_pts_ == -1) {
+			frame->pts = frame->best_effort_timestamp;
+		}
+		else if (!decoder_reorder_pts_) {
+			frame->pts = frame->pkt_dts;
+		}
+	}
+	else if (ret == AVERROR(EAGAIN)) {
+		recv_eagain_++;
+	}
+	else if (ret == AVERROR_EOF) {
+		// drained, the decoder takes packets again
+		avcodec_flush_buffers(codec_context_);
+		ClearPending();
+		flushes_++;
+		recv_seq_++;
+	}
+	else {
+		errors_++;
+		if (HandleError(ret)) {
+			ret = AVERROR(EAGAIN);
+		}
+	}
+
 	return ret;
 }
 
 int AVDecoder::Recv(AVFrame* frame)
 {
-	int ret = -1;
+	bool download = false;
+	int ret = 0;
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+		ret = RecvLocked(frame, &download);
+	}
 
-	if (codec_context_ == NULL) {
-		return ret;
+	// readback without the lock, Send() goes on meanwhile
+	if (ret >= 0 && download) {
+		ret = DownloadFrame(frame);
+		if (ret < 0) {
+			av_frame_unref(frame);
+			errors_++;
+			hw_failures_++;
+
+			std::lock_guard<std::mutex> locker(mutex_);
+			if (HandleError(ret)) {
+				ret = AVERROR(EAGAIN);
+			}
+		}
+	}
+
+	cond_.notify_all();
+	return ret;
+}
+
+int AVDecoder::RecvWait(AVFrame* frame, int timeout_ms)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	while (true) {
+		uint64_t send_seq = 0;
+		{
+			std::lock_guard<std::mutex> locker(mutex_);
+			if (abort_) {
+				return AVERROR_EXIT;
+			}
+			send_seq = send_seq_;
+		}
+
+		int ret = Recv(frame);
+		if (ret != AVERROR(EAGAIN)) {
+			return ret;
+		}
+
+		// needs more input, wait for the feeder thread
+		std::unique_lock<std::mutex> locker(mutex_);
+		auto ready = [&]() { return abort_ || send_seq_ != send_seq; };
+		if (timeout_ms < 0) {
+			cond_.wait(locker, ready);
+		}
+		else if (!cond_.wait_until(locker, deadline, ready)) {
+			return AVERROR(EAGAIN);
+		}
 	}
+}
 
-	switch (codec_context_->codec_type)
+void AVDecoder::Abort()
+{
 	{
-	case AVMEDIA_TYPE_VIDEO:
-		ret = avcodec_receive_frame(codec_context_, frame);
-		if (ret >= 0) {
-			if (decoder_reorder_pts_ == -1) {
-				frame->pts = frame->best_effort_timestamp;
+		std::lock_guard<std::mutex> locker(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_all();
+}
+
+// mutex_ held
+void AVDecoder::TrackSend(const AVPacket* packet)
+{
+	pending_.emplace_back(packet->pts, now_us());
+	if (pending_.size() > kMaxPending) {
+		pending_.pop_front();
+	}
+
+	packets_in_++;
+	reorder_depth_ = (int)pending_.size();
+	if (reorder_depth_ > peak_reorder_depth_) {
+		peak_reorder_depth_ = (int)reorder_depth_;
+	}
+}
+
+// mutex_ held. frame->pts is still the packet pts here. Frames leave in pts
+// order, so pending packets below it were skipped or lost and never show up.
+void AVDecoder::TrackRecv(const AVFrame* frame)
+{
+	frames_out_++;
+
+	int64_t send_time = -1;
+	if (frame->pts == AV_NOPTS_VALUE) {
+		if (!pending_.empty()) {
+			send_time = pending_.front().second;
+			pending_.pop_front();
+		}
+	}
+	else {
+		for (auto it = pending_.begin(); it != pending_.end();) {
+			if (it->first == frame->pts && send_time < 0) {
+				send_time = it->second;
+				it = pending_.erase(it);
 			}
-			else if (!decoder_reorder_pts_) {
-				frame->pts = frame->pkt_dts;
+			else if (it->first != AV_NOPTS_VALUE && it->first < frame->pts) {
+				it = pending_.erase(it);
+			}
+			else {
+				++it;
 			}
 		}
-		break;
+	}
+	reorder_depth_ = (int)pending_.size();
+
+	if (send_time >= 0) {
+		int64_t latency = now_us() - send_time;
+		latency_us_ = latency;
+		latency_sum_us_ += latency;
+		latency_count_++;
+		if (latency > latency_max_us_) {
+			latency_max_us_ = latency;
+		}
+	}
+}
 
-	default:
-		break;
+void AVDecoder::ClearPending()
+{
+	pending_.clear();
+	reorder_depth_ = 0;
+}
+
+AVDecoderStats AVDecoder::GetStats()
+{
+	AVDecoderStats stats;
+	stats.packets_in = packets_in_;
+	stats.frames_out = frames_out_;
+	stats.send_calls = send_calls_;
+	stats.recv_calls = recv_calls_;
+	stats.send_eagain = send_eagain_;
+	stats.recv_eagain = recv_eagain_;
+	stats.errors = errors_;
+	stats.flushes = flushes_;
+	stats.reorder_depth = reorder_depth_;
+	stats.peak_reorder_depth = peak_reorder_depth_;
+	stats.last_latency_ms = latency_us_ / 1000.0;
+	stats.max_latency_ms = latency_max_us_ / 1000.0;
+
+	int64_t count = latency_count_;
+	if (count > 0) {
+		stats.avg_latency_ms = latency_sum_us_ / 1000.0 / count;
 	}
+	return stats;
+}
 
-	if (ret == AVERROR_EOF) {
-		avcodec_flush_buffers(codec_context_);
+void AVDecoder::ResetStats()
+{
+	packets_in_ = 0;
+	frames_out_ = 0;
+	send_calls_ = 0;
+	recv_calls_ = 0;
+	send_eagain_ = 0;
+	recv_eagain_ = 0;
+	errors_ = 0;
+	flushes_ = 0;
+	peak_reorder_depth_ = (int)reorder_depth_;
+	latency_us_ = 0;
+	latency_sum_us_ = 0;
+	latency_count_ = 0;
+	latency_max_us_ = 0;
+}
+
+void AVDecoder::Flush()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (codec_context_ == nullptr) {
+		return;
 	}
 
-	return ret;
+	avcodec_flush_buffers(codec_context_);
+	ClearPending();
+	flushes_++;
+	next_pts_ = start_pts_;
+	next_pts_tb_ = start_pts_tb_;
+	finished_ = 0;
+	abort_ = false;
+}
+
+bool AVDecoder::Rebind(AVStream* stream)
+{
+	if (!stream) {
+		return false;
+	}
+
+	if (!Rebind(stream->codecpar, stream->time_base)) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	stream->discard = AVDISCARD_DEFAULT;
+	start_pts_ = stream->start_time;
+	next_pts_ = start_pts_;
+	stream_ = stream;
+	return true;
+}
+
+bool AVDecoder::IsLengthPrefixed(const AVCodecParameters* codecpar)
+{
+	return (codecpar->codec_id == AV_CODEC_ID_H264 || codecpar->codec_id == AV_CODEC_ID_HEVC) &&
+		codecpar->extradata_size > 0 && codecpar->extradata[0] == 1;
+}
+
+bool AVDecoder::Rebind(const AVCodecParameters* codecpar, AVRational time_base)
+{
+	if (!codecpar) {
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+
+		if (codec_context_ == nullptr || codec_context_->codec_id != codecpar->codec_id) {
+			return false;
+		}
+
+		// extradata without avcC/hvcC does not switch libavcodec back to
+		// Annex-B, nor the other way round without extradata
+		if (IsLengthPrefixed(codecpar) != IsLengthPrefixed(codecpar_)) {
+			return false;
+		}
+
+		switch_begin_ = now_us();
+		switch_latency_ = -1.0;
+	}
+
+	Flush();
+
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	av_freep(&new_extradata_);
+	new_extradata_size_ = 0;
+
+	// SPS/PPS out of band (avcC/hvcC) differ between cameras. Always resent,
+	// codec_context_->extradata is not updated by the side data; identical
+	// parameter sets do not reinitialize the decoder.
+	if (codecpar->extradata_size > 0) {
+		new_extradata_ = (uint8_t*)av_mallocz(codecpar->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+		if (!new_extradata_) {
+			return false;
+		}
+		memcpy(new_extradata_, codecpar->extradata, codecpar->extradata_size);
+		new_extradata_size_ = codecpar->extradata_size;
+	}
+
+	avcodec_parameters_copy(codecpar_, codecpar);
+	time_base_ = time_base;
+	need_keyframe_ = false;
+
+	codec_context_->pkt_timebase = time_base;
+	stream_ = nullptr;
+	start_pts_ = AV_NOPTS_VALUE;
+	next_pts_ = AV_NOPTS_VALUE;
+	start_pts_tb_ = time_base;
+	next_pts_tb_ = time_base;
+	return true;
+}
+
+void AVDecoder::SetKeyframeOnly(bool keyframe_only)
+{
+	SetSkipFrame(keyframe_only ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT);
+}
+
+void AVDecoder::SetSkipFrame(AVDiscard skip_frame)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (skip_frame_ == skip_frame) {
+		return;
+	}
+
+	bool was_keyframe_only = skip_frame_ >= AVDISCARD_NONKEY;
+	skip_frame_ = skip_frame;
+	if (codec_context_ == nullptr) {
+		return;
+	}
+
+	// the codec keeps skipping non-key frames until Send() sees a key packet
+	if (was_keyframe_only && skip_frame < AVDISCARD_NONKEY) {
+		wait_keyframe_ = true;
+	}
+	else {
+		codec_context_->skip_frame = skip_frame;
+		wait_keyframe_ = false;
+	}
+}
+
+void AVDecoder::SetThreading(ThreadType type, int count)
+{
+	thread_type_ = type;
+	thread_count_ = count > 0 ? count : 0;
+}
+
+int AVDecoder::GetThreadCount()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	return codec_context_ ? codec_context_->thread_count : 0;
 }
 
+void AVDecoder::ConfigureThreads(bool hw)
+{
+	int count = thread_count_;
+	if (thread_type_ == THREAD_NONE) {
+		count = 1;
+	}
+	else if (count == 0) {
+		if (hw) {
+			count = 1;
+		}
+		else {
+			// this decoder is not counted yet
+			int cores = (int)std::thread::hardware_concurrency();
+			int decoders = FFMAX(active_decoders_ + 1, expected_decoders_.load());
+			count = FFMAX(1, FFMIN(cores / decoders, kMaxAutoThreads));
+		}
+	}
+
+	switch (thread_type_)
+	{
+	case THREAD_FRAME:
+		codec_context_->thread_type = FF_THREAD_FRAME;
+		break;
+	case THREAD_SLICE:
+		codec_context_->thread_type = FF_THREAD_SLICE;
+		break;
+	default:
+		codec_context_->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+		break;
+	}
+
+	codec_context_->thread_count = count;
+}
\ No newline at end of file
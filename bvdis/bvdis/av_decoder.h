@@ -2,7 +2,11 @@
 
 #include <string>
 #include <mutex>
+#include <condition_variable>
 #include <memory>
+#include <atomic>
+#include <vector>
+#include <deque>
 
 extern "C" {
 #include "libavformat/avformat.h"
@@ -14,33 +18,221 @@ extern "C" {
 
 //  extern "C" 
 #include "libavutil/hwcontext.h"
+#ifdef _WIN32
 #include "libavutil/hwcontext_d3d11va.h"
+#endif
 
 
+struct AVHwPoolStats
+{
+	int pool_size = 0;        // D3D11 surfaces allocated, 0 when libavcodec sizes the pool
+	int dpb_frames = 0;       // reference/reorder frames the stream may hold
+	int queue_depth = 0;      // frames the caller keeps downstream
+	int outstanding = 0;      // decoded surfaces still referenced outside the decoder
+	int peak_outstanding = 0;
+};
+
+// Counters since Init() or ResetStats(), see AVDecoder::GetStats().
+struct AVDecoderStats
+{
+	int64_t packets_in = 0;     // accepted by the decoder
+	int64_t frames_out = 0;
+	int64_t send_calls = 0;
+	int64_t recv_calls = 0;
+	int64_t send_eagain = 0;    // decoder full, frames to receive first
+	int64_t recv_eagain = 0;    // needs more packets
+	int64_t errors = 0;         // decode errors, including those recovered by fallback
+	int64_t flushes = 0;        // Flush(), Rebind() and drains to EOF
+	int     reorder_depth = 0;  // packets sent whose frame is not out yet
+	int     peak_reorder_depth = 0;
+	double  last_latency_ms = 0.0; // Send() of a packet to Recv() of its frame
+	double  avg_latency_ms = 0.0;
+	double  max_latency_ms = 0.0;
+};
+
 class AVDecoder
 {
 public:
+	enum ThreadType {
+		// frame and slice threading where the codec supports them
+		THREAD_AUTO,
+		THREAD_NONE,
+		// throughput, adds thread_count - 1 frames of latency
+		THREAD_FRAME,
+		// no added latency, only helps streams with several slices per picture
+		THREAD_SLICE,
+	};
+
 	AVDecoder& operator=(const AVDecoder&) = delete;
 	AVDecoder(const AVDecoder&) = delete;
 	AVDecoder();
 	virtual ~AVDecoder();
 
+	// hw tries the device types of SetHwDeviceTypes() in order and ends with
+	// software decode. Frames stay in D3D11 textures only for D3D11VA on the
+	// caller's d3d11_device, other hardware frames are copied to system memory.
 	virtual bool Init(AVStream* stream, void* d3d11_device, bool hw);
+	// For sources without an AVStream, e.g. AVElementarySource.
+	virtual bool Init(const AVCodecParameters* codecpar, AVRational time_base, void* d3d11_device, bool hw);
 	virtual void Destroy();
 
+	// Send() and Recv() may run on different threads, a feeder and a drain.
 	virtual int  Send(AVPacket* packet);
 	virtual int  Recv(AVFrame* frame);
 
+	// Blocking variants: on EAGAIN wait for the other thread to receive a frame
+	// (SendWait) or send a packet (RecvWait) instead of polling. timeout_ms < 0
+	// waits forever, expiry returns AVERROR(EAGAIN), Abort() AVERROR_EXIT.
+	// RecvWait returns AVERROR_EOF once after Send(nullptr) is drained.
+	virtual int  SendWait(AVPacket* packet, int timeout_ms = -1);
+	virtual int  RecvWait(AVFrame* frame, int timeout_ms = -1);
+	// Wakes both waiters, cleared by Flush() and Init().
+	virtual void Abort();
+
+	// Drops buffered packets and frames, the decoder stays open.
+	virtual void Flush();
+	// Flushes and hands the open decoder to another stream of the same codec.
+	// Changed extradata goes to the decoder as AV_PKT_DATA_NEW_EXTRADATA with
+	// the next packet.
+	virtual bool Rebind(AVStream* stream);
+	virtual bool Rebind(const AVCodecParameters* codecpar, AVRational time_base);
+	// H.264/HEVC with avcC/hvcC extradata. Rebind() refuses streams framed
+	// differently from the current one.
+	static bool IsLengthPrefixed(const AVCodecParameters* codecpar);
+
+	// skip_frame = AVDISCARD_NONKEY, switchable while decoding. Turning it off
+	// takes effect at the next key packet, frames in between would reference
+	// pictures that were never decoded.
+	void SetKeyframeOnly(bool keyframe_only);
+	bool IsKeyframeOnly() { return skip_frame_ >= AVDISCARD_NONKEY; }
+
+	// Any skip_frame level, e.g. AVDISCARD_NONREF for trick play. Same rule:
+	// leaving AVDISCARD_NONKEY or above waits for the next key packet.
+	void SetSkipFrame(AVDiscard skip_frame);
+
+	// ms from the last Init()/Rebind() to its first decoded frame, -1 until then.
+	double GetSwitchLatency() { return switch_latency_; }
+
+	// Applied by the next Init(). count 0 is auto: software decoders share the
+	// cores with the other active decoders, hardware decoders use one thread.
+	// The count is fixed once the codec is open, so decoders opened one after
+	// another get fewer threads each and the first ones are never resized; set
+	// SetExpectedDecoders() before opening several channels.
+	void SetThreading(ThreadType type, int count = 0);
+	int  GetThreadCount();
+	// Channels the auto mode divides the cores by when more than are active,
+	// 0 counts only the active decoders.
+	static void SetExpectedDecoders(int count) { expected_decoders_ = count > 0 ? count : 0; }
+
+	// Fallback chain for the next Init(), empty restores the platform default
+	// (D3D11VA, DXVA2 / VideoToolbox / VAAPI, VDPAU, CUDA).
+	void SetHwDeviceTypes(const std::vector<AVHWDeviceType>& types) { hw_device_types_ = types; }
+	// AV_HWDEVICE_TYPE_NONE when decoding in software.
+	AVHWDeviceType GetHwDeviceType() { return hw_type_; }
+	// Steps taken down the chain after Init(), e.g. on hw surface allocation failures.
+	int  GetFallbacks() { return fallbacks_; }
+
+	// Decoded frames the caller holds at once (render queue, caches), sizes the
+	// hw surface pool together with the stream's DPB. Set before Init().
+	void SetHwQueueDepth(int frames) { hw_queue_depth_ = frames > 0 ? frames : 0; }
+	AVHwPoolStats GetHwPoolStats();
+
+	// Lock-free snapshot, callable from any thread while decoding.
+	AVDecoderStats GetStats();
+	void ResetStats();
+
+	// Decoders currently initialized in the process.
+	static int GetActiveDecoders() { return active_decoders_; }
+
+private:
+	static enum AVPixelFormat GetHwFormat(AVCodecContext* avctx, const enum AVPixelFormat* pix_fmts);
+	static int GetHwBuffer(AVCodecContext* avctx, AVFrame* frame, int flags);
+
+	int  SendLocked(AVPacket* packet);
+	int  RecvLocked(AVFrame* frame, bool* download);
+
+	bool OpenChain(size_t first);
+	bool OpenCodec(AVHWDeviceType type);
+	bool CreateDevice(AVHWDeviceType type);
+	bool InitD3D11Frames(AVCodecContext* avctx);
+	void TrackHwFrame(AVFrame* frame);
+	bool HandleError(int ret);
+	int  DownloadFrame(AVFrame* frame);
+	void ConfigureThreads(bool hw);
+	void TrackSend(const AVPacket* packet);
+	void TrackRecv(const AVFrame* frame);
+	void ClearPending();
+
 private:
+	static std::atomic<int> active_decoders_;
+	static std::atomic<int> expected_decoders_;
+
+	// guards codec_context_, Send() and Recv() never call into it at once
 	std::mutex mutex_;
+	std::condition_variable cond_;
+	uint64_t send_seq_ = 0; // packets accepted
+	uint64_t recv_seq_ = 0; // frames returned
+	bool abort_ = false;
+
+	ThreadType thread_type_ = THREAD_AUTO;
+	int thread_count_ = 0;
 
 	AVStream* stream_ = nullptr;
+	AVCodecParameters* codecpar_ = nullptr;
+	AVRational time_base_ = { 1, 1000 };
+	void* d3d11_device_ = nullptr;
+
+	std::vector<AVHWDeviceType> hw_device_types_;
+	std::vector<AVHWDeviceType> chain_;
+	size_t chain_index_ = 0;
+	AVHWDeviceType hw_type_ = AV_HWDEVICE_TYPE_NONE;
+	AVPixelFormat hw_format_ = AV_PIX_FMT_NONE;
+	int hw_errors_ = 0;
+	// surface allocation / hwaccel setup failures since the last HandleError(),
+	// set from libavcodec's callbacks
+	std::atomic<int> hw_failures_{ 0 };
+	bool need_keyframe_ = false;
+	std::atomic<int> fallbacks_{ 0 };
+
+	int hw_queue_depth_ = 2;
+	int dpb_frames_ = 0;
+	std::atomic<int> hw_pool_size_{ 0 };
+	AVBufferRef* hw_usage_ = nullptr; // HwPoolUsage, outlives the decoder while frames do
+	bool hw_usage_warned_ = false;
+
 	AVCodecContext* codec_context_ = nullptr;
 	AVDictionary* options_ = nullptr;
 	AVBufferRef* device_buffer_ = nullptr;
 
 	int decoder_reorder_pts_ = -1;
 
+	std::atomic<int> skip_frame_{ AVDISCARD_DEFAULT };
+	bool wait_keyframe_ = false;
+
+	uint8_t* new_extradata_ = nullptr;
+	int new_extradata_size_ = 0;
+
+	int64_t switch_begin_ = 0; // us
+	std::atomic<double> switch_latency_{ -1.0 };
+
+	// packets in the decoder by pts, send time in us, mutex_ held
+	std::deque<std::pair<int64_t, int64_t>> pending_;
+
+	std::atomic<int64_t> packets_in_{ 0 };
+	std::atomic<int64_t> frames_out_{ 0 };
+	std::atomic<int64_t> send_calls_{ 0 };
+	std::atomic<int64_t> recv_calls_{ 0 };
+	std::atomic<int64_t> send_eagain_{ 0 };
+	std::atomic<int64_t> recv_eagain_{ 0 };
+	std::atomic<int64_t> errors_{ 0 };
+	std::atomic<int64_t> flushes_{ 0 };
+	std::atomic<int> reorder_depth_{ 0 };
+	std::atomic<int> peak_reorder_depth_{ 0 };
+	std::atomic<int64_t> latency_us_{ 0 };      // last
+	std::atomic<int64_t> latency_sum_us_{ 0 };
+	std::atomic<int64_t> latency_count_{ 0 };
+	std::atomic<int64_t> latency_max_us_{ 0 };
+
 	int64_t next_pts_ = AV_NOPTS_VALUE;
 	int64_t start_pts_ = AV_NOPTS_VALUE;
 	int finished_ = -1;
@@ -0,0 +1,212 @@
+#include "av_decoder_pool.h"
+#include "av_log.h"
+
+bool AVDecoderKey::operator==(const AVDecoderKey& other) const
+{
+	return codec_id == other.codec_id && profile == other.profile
+		&& width == other.width && height == other.height && hw == other.hw
+		&& length_prefixed == other.length_prefixed;
+}
+
+AVDecoderPool::AVDecoderPool()
+{
+
+}
+
+AVDecoderPool::~AVDecoderPool()
+{
+	Destroy();
+}
+
+AVDecoderKey AVDecoderPool::GetKey(const AVCodecParameters* codecpar, bool hw)
+{
+	AVDecoderKey key;
+	key.codec_id = codecpar->codec_id;
+	key.profile = codecpar->profile;
+	key.width = codecpar->width;
+	key.height = codecpar->height;
+	key.hw = hw;
+	key.length_prefixed = AVDecoder::IsLengthPrefixed(codecpar);
+	return key;
+}
+
+bool AVDecoderPool::Init(void* d3d11_device, int max_idle)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (is_initialized_) {
+		LOG("AVDecoderPool was initialized.");
+		return false;
+	}
+
+	d3d11_device_ = d3d11_device;
+	max_idle_ = max_idle > 0 ? max_idle : 1;
+	stats_ = AVDecoderPoolStats();
+	warm_switches_ = 0;
+	cold_switches_ = 0;
+	is_initialized_ = true;
+	return true;
+}
+
+void AVDecoderPool::Destroy()
+{
+	std::list<Entry> idle;
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+
+		idle.swap(idle_);
+		leased_.clear();
+		stats_.idle = 0;
+		is_initialized_ = false;
+	}
+
+	// decoders close outside the lock
+	idle.clear();
+}
+
+std::unique_ptr<AVDecoder> AVDecoderPool::OpenDecoder(AVStream* stream, bool hw)
+{
+	std::unique_ptr<AVDecoder> decoder(new AVDecoder());
+	if (!decoder->Init(stream, d3d11_device_, hw)) {
+		return nullptr;
+	}
+
+	return decoder;
+}
+
+void AVDecoderPool::Park(const AVDecoderKey& key, std::unique_ptr<AVDecoder> decoder)
+{
+	std::unique_ptr<AVDecoder> evicted;
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+
+		Entry entry;
+		entry.key = key;
+		entry.decoder = std::move(decoder);
+		idle_.push_front(std::move(entry));
+
+		if ((int)idle_.size() > max_idle_) {
+			evicted = std::move(idle_.back().decoder);
+			idle_.pop_back();
+			stats_.evictions++;
+		}
+
+		stats_.idle = (int)idle_.size();
+	}
+}
+
+bool AVDecoderPool::Prewarm(AVStream* stream, bool hw)
+{
+	if (!is_initialized_ || !stream) {
+		return false;
+	}
+
+	std::unique_ptr<AVDecoder> decoder = OpenDecoder(stream, hw);
+	if (!decoder) {
+		return false;
+	}
+
+	Park(GetKey(stream->codecpar, hw), std::move(decoder));
+	return true;
+}
+
+std::unique_ptr<AVDecoder> AVDecoderPool::Acquire(AVStream* stream, bool hw)
+{
+	if (!is_initialized_ || !stream) {
+		return nullptr;
+	}
+
+	AVDecoderKey key = GetKey(stream->codecpar, hw);
+	std::unique_ptr<AVDecoder> decoder;
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+
+		for (auto iter = idle_.begin(); iter != idle_.end(); iter++) {
+			if (iter->key == key) {
+				decoder = std::move(iter->decoder);
+				idle_.erase(iter);
+				break;
+			}
+		}
+
+		stats_.idle = (int)idle_.size();
+	}
+
+	bool warm = decoder && decoder->Rebind(stream);
+	if (!warm) {
+		decoder = OpenDecoder(stream, hw);
+		if (!decoder) {
+			return nullptr;
+		}
+	}
+
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (warm) {
+		stats_.hits++;
+	}
+	else {
+		stats_.misses++;
+	}
+
+	Lease lease;
+	lease.key = key;
+	lease.warm = warm;
+	leased_[decoder.get()] = lease;
+	return decoder;
+}
+
+void AVDecoderPool::Release(std::unique_ptr<AVDecoder> decoder)
+{
+	if (!decoder) {
+		return;
+	}
+
+	Lease lease;
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+
+		auto iter = leased_.find(decoder.get());
+		if (iter == leased_.end()) {
+			return;
+		}
+
+		lease = iter->second;
+		leased_.erase(iter);
+
+		RecordLatency(decoder.get(), &lease);
+	}
+
+	decoder->Flush();
+	Park(lease.key, std::move(decoder));
+}
+
+void AVDecoderPool::RecordLatency(AVDecoder* decoder, Lease* lease)
+{
+	double latency = decoder->GetSwitchLatency();
+	if (lease->recorded || latency < 0.0) {
+		return;
+	}
+
+	lease->recorded = true;
+	stats_.last_switch_latency = latency;
+	if (lease->warm) {
+		warm_switches_++;
+		stats_.warm_switch_latency += (latency - stats_.warm_switch_latency) / warm_switches_;
+	}
+	else {
+		cold_switches_++;
+		stats_.cold_switch_latency += (latency - stats_.cold_switch_latency) / cold_switches_;
+	}
+}
+
+AVDecoderPoolStats AVDecoderPool::GetStats()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	for (auto& lease : leased_) {
+		RecordLatency(lease.first, &lease.second);
+	}
+
+	return stats_;
+}
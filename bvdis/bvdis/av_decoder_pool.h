@@ -0,0 +1,95 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <list>
+#include <map>
+
+#include "av_decoder.h"
+
+// What an open decoder can be reused for without avcodec_open2 / hw setup.
+struct AVDecoderKey
+{
+	AVCodecID codec_id = AV_CODEC_ID_NONE;
+	int profile = FF_PROFILE_UNKNOWN;
+	int width = 0;
+	int height = 0;
+	bool hw = false;
+	// H.264/HEVC from avcC/hvcC extradata (MP4, MKV) instead of Annex-B, the
+	// decoder keeps parsing NAL units the way it was opened
+	bool length_prefixed = false;
+
+	bool operator==(const AVDecoderKey& other) const;
+};
+
+struct AVDecoderPoolStats
+{
+	int64_t hits = 0;      // served by a warm decoder
+	int64_t misses = 0;    // opened on demand
+	int64_t evictions = 0;
+	int     idle = 0;
+
+	// request to first frame, ms
+	double last_switch_latency = -1.0;
+	double warm_switch_latency = 0.0; // average
+	double cold_switch_latency = 0.0; // average
+};
+
+// Pre-opened decoders for channel switching. A released decoder is flushed
+// and parked; Acquire() for a stream with the same codec, profile and size
+// rebinds it instead of opening a new one.
+class AVDecoderPool
+{
+public:
+	AVDecoderPool& operator=(const AVDecoderPool&) = delete;
+	AVDecoderPool(const AVDecoderPool&) = delete;
+	AVDecoderPool();
+	virtual ~AVDecoderPool();
+
+	// max_idle decoders are kept open, least recently used ones are closed.
+	virtual bool Init(void* d3d11_device, int max_idle = 4);
+	virtual void Destroy();
+
+	// Opens a decoder for this kind of stream ahead of the switch.
+	bool Prewarm(AVStream* stream, bool hw);
+
+	std::unique_ptr<AVDecoder> Acquire(AVStream* stream, bool hw);
+	void Release(std::unique_ptr<AVDecoder> decoder);
+
+	// Switch latencies are picked up once the leased decoder has its first frame.
+	AVDecoderPoolStats GetStats();
+
+	static AVDecoderKey GetKey(const AVCodecParameters* codecpar, bool hw);
+
+private:
+	struct Entry {
+		AVDecoderKey key;
+		std::unique_ptr<AVDecoder> decoder;
+	};
+
+	struct Lease {
+		AVDecoderKey key;
+		bool warm = false;
+		bool recorded = false;
+	};
+
+	std::unique_ptr<AVDecoder> OpenDecoder(AVStream* stream, bool hw);
+	void Park(const AVDecoderKey& key, std::unique_ptr<AVDecoder> decoder);
+	void RecordLatency(AVDecoder* decoder, Lease* lease);
+
+private:
+	std::mutex mutex_;
+
+	void* d3d11_device_ = nullptr;
+	int max_idle_ = 4;
+	std::atomic<bool> is_initialized_{ false };
+
+	// most recently used first
+	std::list<Entry> idle_;
+	std::map<AVDecoder*, Lease> leased_;
+
+	AVDecoderPoolStats stats_;
+	int64_t warm_switches_ = 0;
+	int64_t cold_switches_ = 0;
+};
@@ -1,6 +1,14 @@
 #include "av_demuxer.h"
 #include "av_log.h"
 
+#include <chrono>
+
+static int64_t monotonic_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 static int is_realtime(AVFormatContext* s)
 {
 	if (!strcmp(s->iformat->name, "rtp")
@@ -17,6 +25,14 @@ static int is_realtime(AVFormatContext* s)
 AVDemuxer::AVDemuxer()
 {
 	memset(st_index_, -1, sizeof(st_index_));
+
+	for (int i = 0; i < OPERATION_NB; i++) {
+		timeouts_[i] = 0;
+	}
+	timeout_ms_[OPERATION_NONE] = 0;
+	timeout_ms_[OPERATION_OPEN] = 10000;
+	timeout_ms_[OPERATION_PROBE] = 10000;
+	timeout_ms_[OPERATION_READ] = 5000;
 }
 
 AVDemuxer::~AVDemuxer()
@@ -27,18 +43,68 @@ AVDemuxer::~AVDemuxer()
 static int demux_interrupt_cb(void* opaque)
 {
 	AVDemuxer* demuxer = (AVDemuxer*)opaque;
-	return demuxer->IsOpened() ? 0 : 1;
+	return demuxer->CheckInterrupt();
 }
 
-bool AVDemuxer::Open(std::string url)
+int AVDemuxer::CheckInterrupt()
 {
-	std::lock_guard<std::mutex> locker(mutex_);
+	if (abort_request_ || !is_opened_) {
+		return 1;
+	}
 
-	if (format_context_ != nullptr) {
-		LOG("AVDemuxer was opened.");
-		return false;
+	int64_t deadline = deadline_;
+	if (deadline != 0 && monotonic_ns() > deadline) {
+		timed_out_ = true;
+		return 1;
 	}
 
+	return 0;
+}
+
+void AVDemuxer::SetTimeouts(int open_ms, int probe_ms, int read_ms)
+{
+	timeout_ms_[OPERATION_OPEN] = open_ms;
+	timeout_ms_[OPERATION_PROBE] = probe_ms;
+	timeout_ms_[OPERATION_READ] = read_ms;
+}
+
+AVDemuxerStats AVDemuxer::GetStats()
+{
+	AVDemuxerStats stats;
+	stats.open_timeouts = timeouts_[OPERATION_OPEN];
+	stats.probe_timeouts = timeouts_[OPERATION_PROBE];
+	stats.read_timeouts = timeouts_[OPERATION_READ];
+	stats.aborts = aborts_;
+	stats.dropped_packets = dropped_packets_;
+	return stats;
+}
+
+void AVDemuxer::BeginOperation(Operation operation)
+{
+	int timeout_ms = timeout_ms_[operation];
+
+	timed_out_ = false;
+	deadline_ = timeout_ms > 0 ? monotonic_ns() + (int64_t)timeout_ms * 1000000 : 0;
+	operation_ = operation;
+}
+
+// returns true when the operation was cut by its deadline
+bool AVDemuxer::EndOperation()
+{
+	int operation = operation_.exchange(OPERATION_NONE);
+	deadline_ = 0;
+
+	if (timed_out_.exchange(false)) {
+		timeouts_[operation]++;
+		return true;
+	}
+
+	return false;
+}
+
+// Allocates the context and runs avformat_open_input under the open deadline.
+AVFormatContext* AVDemuxer::OpenInput(const std::string& url)
+{
 	AVDictionary* options = nullptr;
 	//av_dict_set(&options, "buffer_size", "1024000", 0);
 	//av_dict_set(&options, "max_delay", "0", 0);
@@ -46,65 +112,207 @@ bool AVDemuxer::Open(std::string url)
 	//av_dict_set(&options, "rtsp_transport", "tcp", 0);
 	av_dict_set(&options, "scan_all_pmts", "1", AV_DICT_DONT_OVERWRITE);
 
-	format_context_ = avformat_alloc_context();
-	if (!format_context_) {
+	AVFormatContext* format_context = avformat_alloc_context();
+	if (!format_context) {
 		LOG("Could not allocate context.");
-		return false;
+		av_dict_free(&options);
+		return nullptr;
 	}
 
-	format_context_->interrupt_callback.callback = demux_interrupt_cb;
-	format_context_->interrupt_callback.opaque = this;
-	is_opened_ = true;
+	format_context->interrupt_callback.callback = demux_interrupt_cb;
+	format_context->interrupt_callback.opaque = this;
 
-	int ret = avformat_open_input(&format_context_, url.c_str(), 0, &options);
+	BeginOperation(OPERATION_OPEN);
+	int ret = avformat_open_input(&format_context, url.c_str(), 0, &options);
+	if (EndOperation()) {
+		LOG("open %s timed out.", url.c_str());
+	}
+	av_dict_free(&options);
 	if (ret != 0) {
 		LOG("open %s failed.", url.c_str());
-		avformat_free_context(format_context_);
+		return nullptr;
+	}
+
+	return format_context;
+}
+
+static void collect_programs(AVFormatContext* format_context, std::vector<AVProgramInfo>* programs)
+{
+	programs->clear();
+
+	for (unsigned int i = 0; i < format_context->nb_programs; i++) {
+		AVProgram* program = format_context->programs[i];
+		AVProgramInfo info;
+
+		info.id = program->id;
+		info.pmt_pid = program->pmt_pid;
+		info.pcr_pid = program->pcr_pid;
+
+		AVDictionaryEntry* entry = av_dict_get(program->metadata, "service_name", NULL, 0);
+		if (entry) {
+			info.service_name = entry->value;
+		}
+		entry = av_dict_get(program->metadata, "service_provider", NULL, 0);
+		if (entry) {
+			info.service_provider = entry->value;
+		}
+
+		for (unsigned int j = 0; j < program->nb_stream_indexes; j++) {
+			info.stream_indexes.push_back((int)program->stream_index[j]);
+		}
+
+		programs->push_back(info);
+	}
+}
+
+bool AVDemuxer::ProbePrograms(std::string url, std::vector<AVProgramInfo>* programs)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (format_context_ != nullptr) {
+		LOG("AVDemuxer was opened.");
+		return false;
+	}
+
+	// lets the interrupt callback run, Close() still aborts the probe
+	abort_request_ = false;
+	is_opened_ = true;
+
+	AVFormatContext* format_context = OpenInput(url);
+	is_opened_ = false;
+	if (!format_context) {
+		return false;
+	}
+
+	collect_programs(format_context, programs);
+	avformat_close_input(&format_context);
+	return true;
+}
+
+// Discards every program but program_id_. The mpegts demuxer drops the PIDs
+// of a program with AVDISCARD_ALL before PES parsing, streams belonging only
+// to discarded programs never produce packets.
+bool AVDemuxer::SelectProgram(AVFormatContext* format_context)
+{
+	program_stream_ = -1;
+
+	int program_id = program_id_;
+	if (program_id < 0) {
+		return true;
+	}
+
+	AVProgram* selected = nullptr;
+	for (unsigned int i = 0; i < format_context->nb_programs; i++) {
+		if (format_context->programs[i]->id == program_id) {
+			selected = format_context->programs[i];
+			break;
+		}
+	}
+
+	if (!selected || selected->nb_stream_indexes == 0) {
+		LOG("program %d not found in %s.", program_id, format_context->url);
+		return false;
+	}
+
+	std::vector<bool> keep(format_context->nb_streams, false);
+	for (unsigned int i = 0; i < selected->nb_stream_indexes; i++) {
+		if (selected->stream_index[i] < format_context->nb_streams) {
+			keep[selected->stream_index[i]] = true;
+		}
+	}
+
+	for (unsigned int i = 0; i < format_context->nb_programs; i++) {
+		AVProgram* program = format_context->programs[i];
+		program->discard = program == selected ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+	}
+
+	for (unsigned int i = 0; i < format_context->nb_streams; i++) {
+		if (!keep[i]) {
+			format_context->streams[i]->discard = AVDISCARD_ALL;
+		}
+	}
+
+	program_stream_ = (int)selected->stream_index[0];
+	return true;
+}
+
+// With a selected program, related_stream keeps av_find_best_stream inside it.
+int AVDemuxer::FindBestStream(AVFormatContext* format_context, AVMediaType type, int related_stream)
+{
+	if (program_stream_ < 0) {
+		related_stream = -1;
+	}
+	else if (related_stream < 0) {
+		related_stream = program_stream_;
+	}
+
+	int index = av_find_best_stream(format_context, type, -1, related_stream, NULL, 0);
+	if (index >= 0 && format_context->streams[index]->discard == AVDISCARD_ALL) {
+		return AVERROR_STREAM_NOT_FOUND;
+	}
+
+	return index;
+}
+
+bool AVDemuxer::Open(std::string url)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (format_context_ != nullptr) {
+		LOG("AVDemuxer was opened.");
+		return false;
+	}
+
+	abort_request_ = false;
+	is_opened_ = true;
+
+	// built privately, published to the lock-free getters only once complete
+	AVFormatContext* format_context = OpenInput(url);
+	if (!format_context) {
+		is_opened_ = false;
+		return false;
+	}
+
+	if (!SelectProgram(format_context)) {
+		avformat_close_input(&format_context);
 		is_opened_ = false;
 		return false;
 	}
 
 	if (genpts_) {
-		format_context_->flags |= AVFMT_FLAG_GENPTS;
+		format_context->flags |= AVFMT_FLAG_GENPTS;
 	}
 
-	av_format_inject_global_side_data(format_context_);
+	av_format_inject_global_side_data(format_context);
 
-	if (format_context_->pb) {
+	if (format_context->pb) {
 		// FIXME hack, ffplay maybe should not use avio_feof() to test for the end
-		format_context_->pb->eof_reached = 0;
+		format_context->pb->eof_reached = 0;
 	}
 
-	is_realtime_ = is_realtime(format_context_);
-	max_frame_duration_ = (format_context_->iformat->flags & AVFMT_TS_DISCONT) ? 10.0 : 3600.0;
+	is_realtime_ = is_realtime(format_context);
+	max_frame_duration_ = (format_context->iformat->flags & AVFMT_TS_DISCONT) ? 10.0 : 3600.0;
 
-	ret = avformat_find_stream_info(format_context_, 0);
+	BeginOperation(OPERATION_PROBE);
+	int ret = avformat_find_stream_info(format_context, 0);
+	if (EndOperation()) {
+		LOG("find stream info %s timed out.", url.c_str());
+	}
 	if (ret < 0) {
 		LOG("find stream info failed. %d", ret);
-		avformat_close_input(&format_context_);
-		avformat_free_context(format_context_);
+		avformat_close_input(&format_context);
+		is_opened_ = false;
 		return false;
 	}
 
-	if (format_context_->pb) {
-		format_context_->pb->eof_reached = 0; // FIXME hack, ffplay maybe should not use avio_feof() to test for the end
+	if (format_context->pb) {
+		format_context->pb->eof_reached = 0; // FIXME hack, ffplay maybe should not use avio_feof() to test for the end
 	}
 
-	st_index_[AVMEDIA_TYPE_VIDEO] = av_find_best_stream(format_context_, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	st_index_[AVMEDIA_TYPE_VIDEO] = FindBestStream(format_context, AVMEDIA_TYPE_VIDEO, -1);
+	st_index_[AVMEDIA_TYPE_AUDIO] = FindBestStream(format_context, AVMEDIA_TYPE_AUDIO, st_index_[AVMEDIA_TYPE_VIDEO]);
 	if (st_index_[AVMEDIA_TYPE_VIDEO] >= 0) {
-		video_stream_ = format_context_->streams[st_index_[AVMEDIA_TYPE_VIDEO]];
-	}
-
-	st_index_[AVMEDIA_TYPE_AUDIO] = av_find_best_stream(format_context_, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-	if (st_index_[AVMEDIA_TYPE_AUDIO] >= 0) {
-		audio_stream_ = format_context_->streams[st_index_[AVMEDIA_TYPE_AUDIO]];
-	}
-
-	if (video_stream_) {
-		st_index_[AVMEDIA_TYPE_SUBTITLE] = av_find_best_stream(format_context_, AVMEDIA_TYPE_SUBTITLE, -1, -1, NULL, 0);
-		if (st_index_[AVMEDIA_TYPE_SUBTITLE] >= 0) {
-			subtitle_stream_ = format_context_->streams[st_index_[AVMEDIA_TYPE_SUBTITLE]];
-		}
+		st_index_[AVMEDIA_TYPE_SUBTITLE] = FindBestStream(format_context, AVMEDIA_TYPE_SUBTITLE, st_index_[AVMEDIA_TYPE_VIDEO]);
 	}
 
 	if (infinite_buffer_ < 0 && is_realtime_) {
@@ -113,19 +321,80 @@ bool AVDemuxer::Open(std::string url)
 
 	eof_ = 0;
 	url_ = url;
+
+	PublishMediaInfo(format_context);
+
+	if (st_index_[AVMEDIA_TYPE_VIDEO] >= 0) {
+		video_stream_ = format_context->streams[st_index_[AVMEDIA_TYPE_VIDEO]];
+	}
+	if (st_index_[AVMEDIA_TYPE_AUDIO] >= 0) {
+		audio_stream_ = format_context->streams[st_index_[AVMEDIA_TYPE_AUDIO]];
+	}
+	if (st_index_[AVMEDIA_TYPE_SUBTITLE] >= 0) {
+		subtitle_stream_ = format_context->streams[st_index_[AVMEDIA_TYPE_SUBTITLE]];
+	}
+	format_context_ = format_context;
+
 	return true;
 }
 
+void AVDemuxer::PublishMediaInfo(AVFormatContext* format_context)
+{
+	std::shared_ptr<AVMediaInfo> info = std::make_shared<AVMediaInfo>();
+
+	info->url = url_;
+	info->format_name = format_context->iformat->name;
+	if (format_context->duration != AV_NOPTS_VALUE) {
+		info->duration = av_rescale(format_context->duration, 1000, AV_TIME_BASE);
+	}
+	info->is_realtime = is_realtime_ ? true : false;
+	info->video_index = st_index_[AVMEDIA_TYPE_VIDEO];
+	info->audio_index = st_index_[AVMEDIA_TYPE_AUDIO];
+	info->subtitle_index = st_index_[AVMEDIA_TYPE_SUBTITLE];
+	info->program_id = program_stream_ >= 0 ? (int)program_id_ : -1;
+	collect_programs(format_context, &info->programs);
+
+	for (unsigned int i = 0; i < format_context->nb_streams; i++) {
+		AVStream* stream = format_context->streams[i];
+		AVStreamInfo stream_info;
+
+		stream_info.index = stream->index;
+		stream_info.codec_type = stream->codecpar->codec_type;
+		stream_info.codec_id = stream->codecpar->codec_id;
+		stream_info.width = stream->codecpar->width;
+		stream_info.height = stream->codecpar->height;
+		stream_info.sample_rate = stream->codecpar->sample_rate;
+		stream_info.channels = stream->codecpar->channels;
+		stream_info.bit_rate = stream->codecpar->bit_rate;
+		stream_info.time_base = stream->time_base;
+		stream_info.frame_rate = stream->avg_frame_rate.num > 0 ? stream->avg_frame_rate : stream->r_frame_rate;
+
+		info->streams.push_back(stream_info);
+	}
+
+	std::atomic_store(&media_info_, std::shared_ptr<const AVMediaInfo>(info));
+}
+
 void AVDemuxer::Close()
 {
-	std::lock_guard<std::mutex> locker(mutex_);
+	// abort an in-flight read, the interrupt callback is polled while it blocks
+	if (operation_ != OPERATION_NONE) {
+		aborts_++;
+	}
+	abort_request_ = true;
 
+	// readers see the cleared state before the context goes away
 	is_opened_ = false;
+	video_stream_ = nullptr;
+	audio_stream_ = nullptr;
+	subtitle_stream_ = nullptr;
+	std::atomic_store(&media_info_, std::shared_ptr<const AVMediaInfo>());
 
-	if (format_context_ != nullptr) {
-		avformat_close_input(&format_context_);
-		avformat_free_context(format_context_);
-		format_context_ = nullptr;
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	AVFormatContext* format_context = format_context_.exchange(nullptr);
+	if (format_context != nullptr) {
+		avformat_close_input(&format_context);
 	}
 
 	if (options_) {
@@ -133,11 +402,10 @@ void AVDemuxer::Close()
 		options_ = nullptr;
 	}
 
-	video_stream_ = nullptr;
-	audio_stream_ = nullptr;
-	subtitle_stream_ = nullptr;
 	eof_ = 0;
 	memset(st_index_, -1, sizeof(st_index_));
+	program_stream_ = -1;
+	abort_request_ = false;
 }
 
 bool AVDemuxer::IsOpened()
@@ -146,31 +414,60 @@ bool AVDemuxer::IsOpened()
 }
 
 int AVDemuxer::Read(AVPacket* pkt)
+{
+	return ReadPacket(pkt, true);
+}
+
+int AVDemuxer::ReadRaw(AVPacket* pkt)
+{
+	return ReadPacket(pkt, false);
+}
+
+int AVDemuxer::ReadPacket(AVPacket* pkt, bool rescale)
 {
 	std::lock_guard<std::mutex> locker(mutex_);
 
-	if (!format_context_) {
+	AVFormatContext* format_context = format_context_;
+	if (!format_context) {
 		return -1;
 	}
 
-	int ret = av_read_frame(format_context_, pkt);
+	// the read deadline covers the packets dropped on the way
+	BeginOperation(OPERATION_READ);
+	int ret = av_read_frame(format_context, pkt);
+	while (ret >= 0 && DropPacket(pkt)) {
+		dropped_packets_++;
+		av_packet_unref(pkt);
+		ret = av_read_frame(format_context, pkt);
+	}
+	bool timed_out = EndOperation();
 	if (ret < 0) {
-		if ((ret == AVERROR_EOF || avio_feof(format_context_->pb)) && !eof_) {
+		if (timed_out || abort_request_) {
+			return -3;
+		}
+
+		if (ret == AVERROR_EOF || avio_feof(format_context->pb)) {
 			eof_ = 1;
 			return -1;
 		}
 
-		if (format_context_->pb && format_context_->pb->error) {
+		if (format_context->pb && format_context->pb->error) {
 			return -2;
 		}
+
+		return -1;
 	}
 	else {
 		eof_ = 0;
 	}
 
+	if (!rescale) {
+		return 0;
+	}
+
 	if (pkt->pts != AV_NOPTS_VALUE) {
-		pkt->pts = (int64_t)(pkt->pts * (1000 * (av_q2d(format_context_->streams[pkt->stream_index]->time_base))));
-		pkt->dts = (int64_t)(pkt->dts * (1000 * (av_q2d(format_context_->streams[pkt->stream_index]->time_base))));
+		pkt->pts = (int64_t)(pkt->pts * (1000 * (av_q2d(format_context->streams[pkt->stream_index]->time_base))));
+		pkt->dts = (int64_t)(pkt->dts * (1000 * (av_q2d(format_context->streams[pkt->stream_index]->time_base))));
 	}
 	else {
 		pkt->pts = (int64_t)NAN;
@@ -180,31 +477,62 @@ int AVDemuxer::Read(AVPacket* pkt)
 	return 0;
 }
 
+bool AVDemuxer::DropPacket(const AVPacket* pkt)
+{
+	if (!keyframe_only_ || (pkt->flags & AV_PKT_FLAG_KEY)) {
+		return false;
+	}
+
+	return pkt->stream_index == st_index_[AVMEDIA_TYPE_VIDEO];
+}
+
 bool AVDemuxer::IsEOF()
 {
 	return eof_ ? true : false;
 }
 
-AVFormatContext* AVDemuxer::GetFormatContext()
+bool AVDemuxer::Seek(int64_t ms)
 {
 	std::lock_guard<std::mutex> locker(mutex_);
+
+	AVFormatContext* format_context = format_context_;
+	if (!format_context) {
+		return false;
+	}
+
+	BeginOperation(OPERATION_READ);
+	int ret = av_seek_frame(format_context, -1, av_rescale(ms, AV_TIME_BASE, 1000), AVSEEK_FLAG_BACKWARD);
+	EndOperation();
+	if (ret < 0) {
+		LOG("seek to %lld ms failed. %d\n", (long long)ms, ret);
+		return false;
+	}
+
+	eof_ = 0;
+	return true;
+}
+
+AVFormatContext* AVDemuxer::GetFormatContext()
+{
 	return format_context_;
 }
 
 AVStream* AVDemuxer::GetVideoStream()
 {
-	std::lock_guard<std::mutex> locker(mutex_);
 	return video_stream_;
 }
 
 AVStream* AVDemuxer::GetAudioStream()
 {
-	std::lock_guard<std::mutex> locker(mutex_);
 	return audio_stream_;
 }
 
 AVStream* AVDemuxer::GetSubtitleStream()
 {
-	std::lock_guard<std::mutex> locker(mutex_);
 	return subtitle_stream_;
 }
+
+std::shared_ptr<const AVMediaInfo> AVDemuxer::GetMediaInfo()
+{
+	return std::atomic_load(&media_info_);
+}
\ No newline at end of file
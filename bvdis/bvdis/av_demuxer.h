@@ -3,12 +3,65 @@
 #include <string>
 #include <mutex>
 #include <memory>
+#include <atomic>
+#include <vector>
 
 extern "C" {
 #include "libavutil/imgutils.h"
 #include "libavformat/avformat.h"
 }
 
+// Immutable copy of the stream metadata, published once Open() succeeds.
+struct AVStreamInfo
+{
+	int index = -1;
+	AVMediaType codec_type = AVMEDIA_TYPE_UNKNOWN;
+	AVCodecID codec_id = AV_CODEC_ID_NONE;
+	int width = 0;
+	int height = 0;
+	int sample_rate = 0;
+	int channels = 0;
+	int64_t bit_rate = 0;
+	AVRational time_base = { 0, 1 };
+	AVRational frame_rate = { 0, 1 };
+};
+
+// MPEG-TS program from the PAT/PMT, known right after avformat_open_input.
+struct AVProgramInfo
+{
+	int id = 0;          // program_number
+	int pmt_pid = -1;
+	int pcr_pid = -1;
+	std::string service_name;
+	std::string service_provider;
+	std::vector<int> stream_indexes;
+};
+
+struct AVMediaInfo
+{
+	std::string url;
+	std::string format_name;
+	int64_t duration = AV_NOPTS_VALUE; // ms
+	bool is_realtime = false;
+
+	int video_index = -1;
+	int audio_index = -1;
+	int subtitle_index = -1;
+	std::vector<AVStreamInfo> streams;
+
+	int program_id = -1; // selected program, -1 for all
+	std::vector<AVProgramInfo> programs;
+};
+
+struct AVDemuxerStats
+{
+	int64_t open_timeouts = 0;
+	int64_t probe_timeouts = 0;
+	int64_t read_timeouts = 0;
+	int64_t aborts = 0;
+	int64_t dropped_packets = 0; // non-key video packets, keyframe-only mode
+};
+
 class AVDemuxer
 {
 public:
@@ -21,33 +74,97 @@ public:
 	virtual void Close();
 	virtual bool IsOpened();
 
+	// 0 on success, -1 end of file, -2 I/O error, -3 deadline expired or aborted by Close().
 	virtual int  Read(AVPacket* pkt);
 	virtual bool IsEOF();
 
+	// Same as Read() but timestamps stay in the stream time base, for remuxing.
+	virtual int  ReadRaw(AVPacket* pkt);
+
+	// Seeks to the keyframe at or before ms, in the timestamp domain of Read().
+	virtual bool Seek(int64_t ms);
+
+	// Demux only this MPEG-TS program (program_number), -1 for all. Set before
+	// Open(); the PIDs of the other programs are discarded inside the demuxer.
+	void SetProgram(int program_id) { program_id_ = program_id; }
+	int  GetProgram() { return program_id_; }
+
+	// Drops non-key packets of the video stream inside Read()/ReadRaw(), for
+	// scrubbing and hidden channels. Pair with AVDecoder::SetKeyframeOnly().
+	void SetKeyframeOnly(bool keyframe_only) { keyframe_only_ = keyframe_only; }
+	bool IsKeyframeOnly() { return keyframe_only_; }
+
+	// PAT/PMT only, no avformat_find_stream_info. Not while opened.
+	bool ProbePrograms(std::string url, std::vector<AVProgramInfo>* programs);
+
+	// Deadlines in ms for avformat_open_input, avformat_find_stream_info and
+	// av_read_frame, 0 disables. Enforced through the interrupt callback.
+	void SetTimeouts(int open_ms, int probe_ms, int read_ms);
+	AVDemuxerStats GetStats();
+
+	// Polled by the avformat interrupt callback, non-zero aborts the blocking call.
+	int  CheckInterrupt();
+
+	// Lock-free, safe to call while another thread is blocked in Read().
 	AVFormatContext* GetFormatContext();
 	AVStream* GetVideoStream();
 	AVStream* GetAudioStream();
 	AVStream* GetSubtitleStream();
+	std::shared_ptr<const AVMediaInfo> GetMediaInfo();
 
 private:
+	enum Operation {
+		OPERATION_NONE,
+		OPERATION_OPEN,
+		OPERATION_PROBE,
+		OPERATION_READ,
+		OPERATION_NB,
+	};
+
+	AVFormatContext* OpenInput(const std::string& url);
+	bool SelectProgram(AVFormatContext* format_context);
+	int  FindBestStream(AVFormatContext* format_context, AVMediaType type, int related_stream);
+	void PublishMediaInfo(AVFormatContext* format_context);
+	int  ReadPacket(AVPacket* pkt, bool rescale);
+	bool DropPacket(const AVPacket* pkt);
+	void BeginOperation(Operation operation);
+	bool EndOperation();
+
+private:
+	// guards the format context only, held across av_read_frame
 	std::mutex  mutex_;
 	std::string url_;
 
-	bool is_opened_ = false;
+	std::atomic<bool> is_opened_{ false };
 
-	AVFormatContext* format_context_ = nullptr;
+	std::atomic<AVFormatContext*> format_context_{ nullptr };
 	AVDictionary* options_ = nullptr;
 
 	int st_index_[AVMEDIA_TYPE_NB];
-	AVStream* video_stream_ = nullptr;
-	AVStream* audio_stream_ = nullptr;
-	AVStream* subtitle_stream_ = nullptr;
+	std::atomic<AVStream*> video_stream_{ nullptr };
+	std::atomic<AVStream*> audio_stream_{ nullptr };
+	std::atomic<AVStream*> subtitle_stream_{ nullptr };
+	std::shared_ptr<const AVMediaInfo> media_info_;
+
+	std::atomic<int> program_id_{ -1 };
+	int    program_stream_ = -1; // first stream of the selected program
 
 	int    is_realtime_ = 0;
 	int    genpts_ = 0;
 	int    infinite_buffer_ = -1;
 	double max_frame_duration_ = 0.0; 
-	int    eof_ = 0;
+	std::atomic<int> eof_{ 0 };
+
+	std::atomic<bool> abort_request_{ false };
+	std::atomic<int> timeout_ms_[OPERATION_NB];
+	std::atomic<int> operation_{ OPERATION_NONE };
+	std::atomic<int64_t> deadline_{ 0 }; // steady clock, ns
+	std::atomic<bool> timed_out_{ false };
+	std::atomic<int64_t> timeouts_[OPERATION_NB];
+	std::atomic<int64_t> aborts_{ 0 };
+
+	std::atomic<bool> keyframe_only_{ false };
+	std::atomic<int64_t> dropped_packets_{ 0 };
 
 	uint64_t pts_[AVMEDIA_TYPE_NB];
 };
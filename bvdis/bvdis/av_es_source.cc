@@ -0,0 +1,294 @@
+#include "av_es_source.h"
+#include "av_log.h"
+
+#include <string.h>
+
+// parse at most this many access units to find the first SPS
+static const int kProbeAccessUnits = 64;
+
+static AVCodecID codec_from_extension(const std::string& url)
+{
+	size_t pos = url.find_last_of('.');
+	if (pos == std::string::npos) {
+		return AV_CODEC_ID_NONE;
+	}
+
+	std::string ext = url.substr(pos);
+	if (ext == ".h264" || ext == ".264" || ext == ".avc") {
+		return AV_CODEC_ID_H264;
+	}
+	if (ext == ".h265" || ext == ".265" || ext == ".hevc") {
+		return AV_CODEC_ID_HEVC;
+	}
+
+	return AV_CODEC_ID_NONE;
+}
+
+AVElementarySource::AVElementarySource()
+{
+
+}
+
+AVElementarySource::~AVElementarySource()
+{
+	Close();
+}
+
+bool AVElementarySource::IsElementaryStream(const std::string& url)
+{
+	return codec_from_extension(url) != AV_CODEC_ID_NONE;
+}
+
+bool AVElementarySource::Open(std::string url, AVCodecID codec_id, AVRational frame_rate)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (file_.IsOpened()) {
+		LOG("AVElementarySource was opened.");
+		return false;
+	}
+
+	if (codec_id == AV_CODEC_ID_NONE) {
+		codec_id = codec_from_extension(url);
+	}
+
+	if (codec_id != AV_CODEC_ID_H264 && codec_id != AV_CODEC_ID_HEVC) {
+		LOG("un support elementary stream %s.", url.c_str());
+		return false;
+	}
+
+	if (!file_.Open(url)) {
+		return false;
+	}
+
+	int start_code_size = 0;
+	pos_ = FindStartCode(0, &start_code_size);
+	if (pos_ >= file_.GetSize()) {
+		LOG("%s has no Annex-B start code.", url.c_str());
+		file_.Close();
+		return false;
+	}
+
+	codecpar_ = avcodec_parameters_alloc();
+	codecpar_->codec_type = AVMEDIA_TYPE_VIDEO;
+	codecpar_->codec_id = codec_id;
+	frame_rate_ = frame_rate.num > 0 && frame_rate.den > 0 ? frame_rate : AVRational{ 25, 1 };
+
+	ProbeVideoSize();
+
+	frame_index_ = 0;
+	eof_ = 0;
+	url_ = url;
+	return true;
+}
+
+void AVElementarySource::Close()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	// packets still referencing the mapping keep it alive
+	file_.Close();
+	avcodec_parameters_free(&codecpar_);
+
+	pos_ = 0;
+	frame_index_ = 0;
+	eof_ = 0;
+}
+
+bool AVElementarySource::IsOpened()
+{
+	return file_.IsOpened();
+}
+
+bool AVElementarySource::IsEOF()
+{
+	return eof_ ? true : false;
+}
+
+// Offset of the next 00 00 01 / 00 00 00 01 at or after pos, file size if none.
+uint64_t AVElementarySource::FindStartCode(uint64_t pos, int* start_code_size)
+{
+	const uint8_t* data = file_.GetData();
+	uint64_t size = file_.GetSize();
+
+	uint64_t i = pos;
+	while (i + 3 <= size) {
+		const uint8_t* one = (const uint8_t*)memchr(data + i + 2, 1, (size_t)(size - i - 2));
+		if (!one) {
+			break;
+		}
+
+		uint64_t offset = (uint64_t)(one - data);
+		if (data[offset - 1] == 0 && data[offset - 2] == 0) {
+			uint64_t start = offset - 2;
+			if (start > pos && data[start - 1] == 0) {
+				*start_code_size = 4;
+				return start - 1;
+			}
+
+			*start_code_size = 3;
+			return start;
+		}
+
+		i = offset - 1;
+	}
+
+	*start_code_size = 0;
+	return size;
+}
+
+bool AVElementarySource::StartsAccessUnit(const uint8_t* nal, uint64_t size, bool seen_vcl, bool* vcl, bool* keyframe)
+{
+	*vcl = false;
+	*keyframe = false;
+
+	if (size < 1) {
+		return false;
+	}
+
+	if (codecpar_->codec_id == AV_CODEC_ID_H264) {
+		int type = nal[0] & 0x1f;
+		if (type >= 1 && type <= 5) {
+			*vcl = true;
+			*keyframe = type == 5;
+			// first_mb_in_slice == 0, ue(v) starting with a 1 bit
+			return seen_vcl && size > 1 && (nal[1] & 0x80);
+		}
+
+		// AUD, SEI, SPS, PPS and prefix NALs precede the first slice
+		return seen_vcl && ((type >= 6 && type <= 9) || (type >= 14 && type <= 18));
+	}
+
+	if (size < 2) {
+		return false;
+	}
+
+	int type = (nal[0] >> 1) & 0x3f;
+	if (type < 32) {
+		*vcl = true;
+		*keyframe = type >= 16 && type <= 23;
+		// first_slice_segment_in_pic_flag
+		return seen_vcl && size > 2 && (nal[2] & 0x80);
+	}
+
+	// VPS, SPS, PPS, AUD, prefix SEI and reserved prefix types
+	return seen_vcl && ((type >= 32 && type <= 35) || type == 39 || (type >= 41 && type <= 44) || (type >= 48 && type <= 55));
+}
+
+// End offset of the access unit starting at pos.
+uint64_t AVElementarySource::NextAccessUnit(uint64_t pos, bool* keyframe)
+{
+	uint64_t size = file_.GetSize();
+	const uint8_t* data = file_.GetData();
+
+	bool seen_vcl = false;
+	*keyframe = false;
+
+	int start_code_size = 0;
+	uint64_t nal = FindStartCode(pos, &start_code_size);
+	while (nal < size) {
+		uint64_t payload = nal + start_code_size;
+		uint64_t next = FindStartCode(payload, &start_code_size);
+
+		bool vcl = false;
+		bool irap = false;
+		if (StartsAccessUnit(data + payload, next - payload, seen_vcl, &vcl, &irap) && nal != pos) {
+			return nal;
+		}
+
+		seen_vcl = seen_vcl || vcl;
+		*keyframe = *keyframe || irap;
+		nal = next;
+	}
+
+	return size;
+}
+
+int AVElementarySource::Read(AVPacket* pkt)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (!file_.IsOpened()) {
+		return -1;
+	}
+
+	uint64_t size = file_.GetSize();
+	if (pos_ >= size) {
+		eof_ = 1;
+		return -1;
+	}
+
+	bool keyframe = false;
+	uint64_t end = NextAccessUnit(pos_, &keyframe);
+	uint64_t au_size = end - pos_;
+	const uint8_t* data = file_.GetData() + pos_;
+
+	av_packet_unref(pkt);
+
+	// decoders read up to AV_INPUT_BUFFER_PADDING_SIZE past the end, inside the
+	// file that is the next start code; only the last access unit is copied
+	if (end + AV_INPUT_BUFFER_PADDING_SIZE <= size) {
+		pkt->buf = file_.Ref();
+		pkt->data = (uint8_t*)data;
+		pkt->size = (int)au_size;
+	}
+	else {
+		if (av_new_packet(pkt, (int)au_size) < 0) {
+			return -1;
+		}
+		memcpy(pkt->data, data, (size_t)au_size);
+	}
+
+	// no timestamps in an elementary stream, dts follows the frame rate
+	AVRational frame_tb = av_inv_q(frame_rate_);
+	pkt->stream_index = 0;
+	pkt->pts = AV_NOPTS_VALUE;
+	pkt->dts = av_rescale_q(frame_index_, frame_tb, { 1, 1000 });
+	pkt->duration = av_rescale_q(1, frame_tb, { 1, 1000 });
+	if (keyframe) {
+		pkt->flags |= AV_PKT_FLAG_KEY;
+	}
+
+	pos_ = end;
+	frame_index_++;
+	eof_ = 0;
+	return 0;
+}
+
+// Width/height/profile from the first SPS, via the libavcodec parser.
+void AVElementarySource::ProbeVideoSize()
+{
+	AVCodecParserContext* parser = av_parser_init(codecpar_->codec_id);
+	AVCodecContext* codec_context = avcodec_alloc_context3(NULL);
+	if (!parser || !codec_context) {
+		av_parser_close(parser);
+		avcodec_free_context(&codec_context);
+		return;
+	}
+
+	parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
+
+	uint64_t pos = pos_;
+	for (int i = 0; i < kProbeAccessUnits && pos < file_.GetSize(); i++) {
+		bool keyframe = false;
+		uint64_t end = NextAccessUnit(pos, &keyframe);
+
+		uint8_t* out = nullptr;
+		int out_size = 0;
+		av_parser_parse2(parser, codec_context, &out, &out_size,
+			file_.GetData() + pos, (int)(end - pos), AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+
+		if (parser->width > 0 && parser->height > 0) {
+			codecpar_->width = parser->width;
+			codecpar_->height = parser->height;
+			codecpar_->profile = codec_context->profile;
+			codecpar_->level = codec_context->level;
+			break;
+		}
+
+		pos = end;
+	}
+
+	av_parser_close(parser);
+	avcodec_free_context(&codec_context);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+
+#include "av_file_map.h"
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+}
+
+// Raw H.264/HEVC Annex-B elementary stream (.h264/.264/.h265/.265/.hevc) read
+// straight from a file mapping, no avformat probing. Access units are split on
+// NAL start codes and handed out as packets referencing the mapping.
+class AVElementarySource
+{
+public:
+	AVElementarySource& operator=(const AVElementarySource&) = delete;
+	AVElementarySource(const AVElementarySource&) = delete;
+	AVElementarySource();
+	virtual ~AVElementarySource();
+
+	// codec_id NONE guesses from the file extension.
+	virtual bool Open(std::string url, AVCodecID codec_id = AV_CODEC_ID_NONE, AVRational frame_rate = { 25, 1 });
+	virtual void Close();
+	virtual bool IsOpened();
+
+	// One access unit per packet, dts in ms. 0 on success, -1 at end of file.
+	virtual int  Read(AVPacket* pkt);
+	virtual bool IsEOF();
+
+	// For AVDecoder::Init(codecpar, time_base, ...).
+	const AVCodecParameters* GetCodecParameters() { return codecpar_; }
+	AVRational GetTimeBase() { return { 1, 1000 }; }
+
+	static bool IsElementaryStream(const std::string& url);
+
+private:
+	uint64_t FindStartCode(uint64_t pos, int* start_code_size);
+	uint64_t NextAccessUnit(uint64_t pos, bool* keyframe);
+	bool StartsAccessUnit(const uint8_t* nal, uint64_t size, bool seen_vcl, bool* vcl, bool* keyframe);
+	void ProbeVideoSize();
+
+private:
+	std::mutex  mutex_;
+	std::string url_;
+
+	AVFileMap file_;
+	AVCodecParameters* codecpar_ = nullptr;
+	AVRational frame_rate_ = { 25, 1 };
+
+	uint64_t pos_ = 0;
+	int64_t  frame_index_ = 0;
+	int      eof_ = 0;
+};
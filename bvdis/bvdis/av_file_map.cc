@@ -0,0 +1,142 @@
+#include "av_file_map.h"
+#include "av_log.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <limits.h>
+
+struct FileView {
+	void*    addr;
+	uint64_t size;
+};
+
+static void file_view_free(void* opaque, uint8_t* /*data*/)
+{
+	FileView* view = (FileView*)opaque;
+#ifdef _WIN32
+	UnmapViewOfFile(view->addr);
+#else
+	munmap(view->addr, (size_t)view->size);
+#endif
+	delete view;
+}
+
+static bool map_file(const std::string& path, FileView* view)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER size = {};
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping) {
+		return false;
+	}
+
+	// the view keeps the mapping object alive
+	view->addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	view->size = (uint64_t)size.QuadPart;
+	CloseHandle(mapping);
+	return view->addr != NULL;
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	view->addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	view->size = (uint64_t)st.st_size;
+	close(fd);
+	if (view->addr == MAP_FAILED) {
+		view->addr = NULL;
+		return false;
+	}
+
+	madvise(view->addr, (size_t)view->size, MADV_SEQUENTIAL);
+	return true;
+#endif
+}
+
+AVFileMap::AVFileMap()
+{
+
+}
+
+AVFileMap::~AVFileMap()
+{
+	Close();
+}
+
+bool AVFileMap::Open(std::string path)
+{
+	if (buffer_ != nullptr) {
+		LOG("AVFileMap was opened.");
+		return false;
+	}
+
+	FileView* view = new FileView();
+	if (!map_file(path, view)) {
+		LOG("map %s failed.", path.c_str());
+		delete view;
+		return false;
+	}
+
+	// AVBuffer sizes are int, the real size is kept in size_
+	int buffer_size = view->size > INT_MAX ? INT_MAX : (int)view->size;
+	buffer_ = av_buffer_create((uint8_t*)view->addr, buffer_size, file_view_free, view, AV_BUFFER_FLAG_READONLY);
+	if (!buffer_) {
+		file_view_free(view, nullptr);
+		return false;
+	}
+
+	data_ = buffer_->data;
+	size_ = view->size;
+	return true;
+}
+
+void AVFileMap::Close()
+{
+	if (buffer_ != nullptr) {
+		av_buffer_unref(&buffer_);
+		buffer_ = nullptr;
+	}
+
+	data_ = nullptr;
+	size_ = 0;
+}
+
+bool AVFileMap::IsOpened()
+{
+	return buffer_ != nullptr;
+}
+
+AVBufferRef* AVFileMap::Ref()
+{
+	if (!buffer_) {
+		return nullptr;
+	}
+
+	return av_buffer_ref(buffer_);
+}
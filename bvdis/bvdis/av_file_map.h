@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+extern "C" {
+#include "libavutil/buffer.h"
+}
+
+// Read-only memory mapping of a whole file. The view is wrapped in an AVBufferRef
+// so frames/packets pointing into it can keep the mapping alive after Close().
+class AVFileMap
+{
+public:
+	AVFileMap& operator=(const AVFileMap&) = delete;
+	AVFileMap(const AVFileMap&) = delete;
+	AVFileMap();
+	virtual ~AVFileMap();
+
+	virtual bool Open(std::string path);
+	virtual void Close();
+	virtual bool IsOpened();
+
+	const uint8_t* GetData() { return data_; }
+	uint64_t GetSize() { return size_; }
+
+	// New reference to the mapping, caller must av_buffer_unref() it.
+	AVBufferRef* Ref();
+
+private:
+	AVBufferRef* buffer_ = nullptr;
+	const uint8_t* data_ = nullptr;
+	uint64_t size_ = 0;
+};
@@ -0,0 +1,337 @@
+#include "av_frame_compare.h"
+
+#include <chrono>
+#include <algorithm>
+#include <string.h>
+
+extern "C" {
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
+}
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define AV_COMPARE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// luma block covered by one signature entry, and the rows sampled in it
+static const int kBlockSize = 64;
+static const int kSampleRows[] = { 5, 21, 37, 53 };
+static const int kSampleBytes = 16;
+
+static int64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Rows of one plane, chroma planes subsampled.
+static int plane_rows(const AVPixFmtDescriptor* desc, int plane, int height)
+{
+	if (plane == 1 || plane == 2) {
+		return AV_CEIL_RSHIFT(height, desc->log2_chroma_h);
+	}
+	return height;
+}
+
+static bool equal_bytes(const uint8_t* a, const uint8_t* b, size_t size)
+{
+#ifdef AV_COMPARE_SSE2
+	while (size >= 64) {
+		__m128i eq = _mm_and_si128(
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b)),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + 16)), _mm_loadu_si128((const __m128i*)(b + 16)))),
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + 32)), _mm_loadu_si128((const __m128i*)(b + 32))),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + 48)), _mm_loadu_si128((const __m128i*)(b + 48)))));
+		if (_mm_movemask_epi8(eq) != 0xFFFF) {
+			return false;
+		}
+		a += 64;
+		b += 64;
+		size -= 64;
+	}
+	while (size >= 16) {
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b));
+		if (_mm_movemask_epi8(eq) != 0xFFFF) {
+			return false;
+		}
+		a += 16;
+		b += 16;
+		size -= 16;
+	}
+#endif
+	return memcmp(a, b, size) == 0;
+}
+
+AVFrameComparator::AVFrameComparator()
+{
+	previous_ = av_frame_alloc();
+}
+
+AVFrameComparator::~AVFrameComparator()
+{
+	av_frame_free(&previous_);
+}
+
+bool AVFrameComparator::IsDuplicate(const AVFrame* frame)
+{
+	frames_++;
+
+	if (!previous_ || frame->hw_frames_ctx || !frame->data[0]) {
+		Reset();
+		return false;
+	}
+
+	int64_t begin = now_us();
+
+	Signature(frame, &next_signature_);
+
+	bool duplicate = false;
+	if (previous_->data[0] && previous_->format == frame->format &&
+		previous_->width == frame->width && previous_->height == frame->height) {
+		if (next_signature_ != signature_) {
+			sample_rejects_++;
+		}
+		else {
+			full_compares_++;
+			duplicate = Equal(previous_, frame);
+			if (!duplicate) {
+				full_mismatches_++;
+			}
+		}
+	}
+
+	// a duplicate leaves the reference as it is, the pixels are the same
+	if (duplicate) {
+		duplicates_++;
+	}
+	else {
+		av_frame_unref(previous_);
+		if (av_frame_ref(previous_, frame) < 0) {
+			av_frame_unref(previous_);
+		}
+		signature_.swap(next_signature_);
+	}
+
+	compare_us_ += now_us() - begin;
+	return duplicate;
+}
+
+void AVFrameComparator::Reset()
+{
+	if (previous_) {
+		av_frame_unref(previous_);
+	}
+	signature_.clear();
+}
+
+bool AVFrameComparator::Equal(const AVFrame* a, const AVFrame* b)
+{
+	if (a->format != b->format || a->width != b->width || a->height != b->height) {
+		return false;
+	}
+
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)a->format);
+	if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+		return false;
+	}
+
+	int planes = av_pix_fmt_count_planes((AVPixelFormat)a->format);
+	for (int plane = 0; plane < planes; plane++) {
+		int row_bytes = av_image_get_linesize((AVPixelFormat)a->format, a->width, plane);
+		if (row_bytes <= 0 || !a->data[plane] || !b->data[plane]) {
+			return false;
+		}
+
+		int rows = plane_rows(desc, plane, a->height);
+		const uint8_t* row_a = a->data[plane];
+		const uint8_t* row_b = b->data[plane];
+		if (row_a == row_b && a->linesize[plane] == b->linesize[plane]) {
+			continue;
+		}
+
+		for (int y = 0; y < rows; y++) {
+			if (!equal_bytes(row_a, row_b, row_bytes)) {
+				return false;
+			}
+			row_a += a->linesize[plane];
+			row_b += b->linesize[plane];
+		}
+	}
+
+	return true;
+}
+
+int64_t AVFrameComparator::DirtyRects(const AVFrame* previous, const AVFrame* frame, int tile, std::vector<AVDirtyRect>* rects)
+{
+	rects->clear();
+
+	if (previous->format != frame->format || previous->width != frame->width || previous->height != frame->height ||
+		tile <= 0 || (tile & 1)) {
+		return -1;
+	}
+
+	AVPixelFormat format = (AVPixelFormat)frame->format;
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+	if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL))) {
+		return -1;
+	}
+
+	int planes = av_pix_fmt_count_planes(format);
+	for (int plane = 0; plane < planes; plane++) {
+		if (!previous->data[plane] || !frame->data[plane]) {
+			return -1;
+		}
+	}
+
+	int width = frame->width;
+	int height = frame->height;
+	int tiles_x = (width + tile - 1) / tile;
+	int tiles_y = (height + tile - 1) / tile;
+
+	// byte offset of every tile column in every plane, tiles_x + 1 entries each
+	std::vector<int> columns((size_t)planes * (tiles_x + 1));
+	for (int plane = 0; plane < planes; plane++) {
+		for (int tx = 0; tx <= tiles_x; tx++) {
+			int x = tx * tile < width ? tx * tile : width;
+			columns[(size_t)plane * (tiles_x + 1) + tx] = x > 0 ? av_image_get_linesize(format, x, plane) : 0;
+		}
+	}
+
+	std::vector<bool> dirty(tiles_x);
+	std::vector<AVDirtyRect> open_rects; // still growing downwards
+	int64_t area = 0;
+
+	for (int ty = 0; ty < tiles_y; ty++) {
+		std::fill(dirty.begin(), dirty.end(), false);
+		int clean = tiles_x;
+
+		int y0 = ty * tile;
+		int y1 = y0 + tile < height ? y0 + tile : height;
+
+		for (int plane = 0; plane < planes && clean > 0; plane++) {
+			int shift = (plane == 1 || plane == 2) ? desc->log2_chroma_h : 0;
+			int row0 = y0 >> shift;
+			int row1 = AV_CEIL_RSHIFT(y1, shift);
+			const int* column = &columns[(size_t)plane * (tiles_x + 1)];
+
+			for (int row = row0; row < row1 && clean > 0; row++) {
+				const uint8_t* a = previous->data[plane] + (ptrdiff_t)row * previous->linesize[plane];
+				const uint8_t* b = frame->data[plane] + (ptrdiff_t)row * frame->linesize[plane];
+				for (int tx = 0; tx < tiles_x; tx++) {
+					if (!dirty[tx] && !equal_bytes(a + column[tx], b + column[tx], column[tx + 1] - column[tx])) {
+						dirty[tx] = true;
+						clean--;
+					}
+				}
+			}
+		}
+
+		// runs of dirty tiles in this row, joined to a rectangle from the row above
+		std::vector<AVDirtyRect> next_rects;
+		for (int tx = 0; tx < tiles_x;) {
+			if (!dirty[tx]) {
+				tx++;
+				continue;
+			}
+
+			int first = tx;
+			while (tx < tiles_x && dirty[tx]) {
+				tx++;
+			}
+
+			AVDirtyRect rect;
+			rect.x = first * tile;
+			rect.y = y0;
+			rect.width = (tx * tile < width ? tx * tile : width) - rect.x;
+			rect.height = y1 - y0;
+			area += (int64_t)rect.width * rect.height;
+
+			for (auto it = open_rects.begin(); it != open_rects.end(); ++it) {
+				if (it->x == rect.x && it->width == rect.width) {
+					rect.y = it->y;
+					rect.height += it->height;
+					open_rects.erase(it);
+					break;
+				}
+			}
+			next_rects.push_back(rect);
+		}
+
+		// rectangles not continued in this row are finished
+		rects->insert(rects->end(), open_rects.begin(), open_rects.end());
+		open_rects.swap(next_rects);
+	}
+	rects->insert(rects->end(), open_rects.begin(), open_rects.end());
+
+	return area;
+}
+
+// One 32-bit hash per 64x64 luma block over kSampleBytes of each sampled row.
+// A collision only costs a full compare.
+void AVFrameComparator::Signature(const AVFrame* frame, std::vector<uint32_t>* signature)
+{
+	int blocks_x = (frame->width + kBlockSize - 1) / kBlockSize;
+	int blocks_y = (frame->height + kBlockSize - 1) / kBlockSize;
+	signature->assign((size_t)blocks_x * blocks_y, 0);
+
+	int sample_bytes = frame->width < kSampleBytes ? frame->width : kSampleBytes;
+
+	for (int by = 0; by < blocks_y; by++) {
+		for (int bx = 0; bx < blocks_x; bx++) {
+			// middle of the block, moved left at the right edge
+			int x = bx * kBlockSize + kBlockSize / 2 - kSampleBytes / 2;
+			if (x + sample_bytes > frame->width) {
+				x = frame->width - sample_bytes;
+			}
+
+#ifdef AV_COMPARE_SSE2
+			__m128i acc = _mm_setzero_si128();
+#endif
+			uint32_t hash = 0;
+			for (int sample : kSampleRows) {
+				int y = by * kBlockSize + sample;
+				if (y >= frame->height) {
+					y = frame->height - 1;
+				}
+				const uint8_t* p = frame->data[0] + (ptrdiff_t)y * frame->linesize[0] + x;
+
+#ifdef AV_COMPARE_SSE2
+				if (sample_bytes == kSampleBytes) {
+					__m128i v = _mm_loadu_si128((const __m128i*)p);
+					acc = _mm_add_epi32(_mm_xor_si128(acc, v), _mm_shuffle_epi32(acc, _MM_SHUFFLE(0, 3, 2, 1)));
+					continue;
+				}
+#endif
+				for (int i = 0; i < sample_bytes; i++) {
+					hash = (hash ^ p[i]) * 16777619u;
+				}
+			}
+
+#ifdef AV_COMPARE_SSE2
+			hash ^= (uint32_t)_mm_cvtsi128_si32(acc);
+			hash = hash * 31 + (uint32_t)_mm_cvtsi128_si32(_mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 1, 1, 1)));
+			hash = hash * 31 + (uint32_t)_mm_cvtsi128_si32(_mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 2, 2, 2)));
+			hash = hash * 31 + (uint32_t)_mm_cvtsi128_si32(_mm_shuffle_epi32(acc, _MM_SHUFFLE(3, 3, 3, 3)));
+#endif
+			(*signature)[(size_t)by * blocks_x + bx] = hash;
+		}
+	}
+}
+
+AVFrameCompareStats AVFrameComparator::GetStats()
+{
+	AVFrameCompareStats stats;
+	stats.frames = frames_;
+	stats.duplicates = duplicates_;
+	stats.sample_rejects = sample_rejects_;
+	stats.full_compares = full_compares_;
+	stats.full_mismatches = full_mismatches_;
+	stats.compare_ms = compare_us_ / 1000.0;
+	if (stats.frames > 0) {
+		stats.skip_rate = (double)stats.duplicates / stats.frames;
+	}
+	return stats;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+
+extern "C" {
+#include "libavutil/frame.h"
+}
+
+struct AVFrameCompareStats
+{
+	int64_t frames = 0;
+	int64_t duplicates = 0;
+	int64_t sample_rejects = 0;   // told apart by the sampled block hashes
+	int64_t full_compares = 0;    // sampled hashes matched, every byte compared
+	int64_t full_mismatches = 0;  // ... and the frames still differed
+	double  compare_ms = 0.0;     // total time spent comparing
+	double  skip_rate = 0.0;      // duplicates / frames
+};
+
+// Changed area of a frame in luma pixels, see AVFrameComparator::DirtyRects().
+struct AVDirtyRect
+{
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+// Finds decoded frames identical to the one before, e.g. static surveillance
+// scenes and slideshows, so upload and present can be skipped. A hash of a few
+// sampled rows per 64x64 luma block rejects almost every changed frame
+// cheaply; only when all blocks match are the frames compared in full (SSE2).
+class AVFrameComparator
+{
+public:
+	AVFrameComparator& operator=(const AVFrameComparator&) = delete;
+	AVFrameComparator(const AVFrameComparator&) = delete;
+	AVFrameComparator();
+	virtual ~AVFrameComparator();
+
+	// True when frame has the same size, format and pixels as the previous
+	// frame passed in, which is released; frame is referenced for the next
+	// call. Hardware frames are never duplicates and are not referenced.
+	bool IsDuplicate(const AVFrame* frame);
+	// The next frame is never a duplicate.
+	void Reset();
+
+	// Visible bytes of every plane, padding ignored.
+	static bool Equal(const AVFrame* a, const AVFrame* b);
+
+	// Tiles of tile x tile luma pixels (and the chroma under them) that differ
+	// between two software frames of the same size and format, merged into
+	// rectangles: runs of dirty tiles per tile row, extended downwards while the
+	// run below covers the same columns. tile should be even so the rectangles
+	// fit 4:2:0 chroma. Returns the dirty area in luma pixels, -1 if the frames
+	// cannot be compared.
+	static int64_t DirtyRects(const AVFrame* previous, const AVFrame* frame, int tile, std::vector<AVDirtyRect>* rects);
+
+	AVFrameCompareStats GetStats();
+
+private:
+	static void Signature(const AVFrame* frame, std::vector<uint32_t>* signature);
+
+private:
+	AVFrame* previous_ = nullptr;
+	std::vector<uint32_t> signature_;
+	std::vector<uint32_t> next_signature_;
+
+	std::atomic<int64_t> frames_{ 0 };
+	std::atomic<int64_t> duplicates_{ 0 };
+	std::atomic<int64_t> sample_rejects_{ 0 };
+	std::atomic<int64_t> full_compares_{ 0 };
+	std::atomic<int64_t> full_mismatches_{ 0 };
+	std::atomic<int64_t> compare_us_{ 0 };
+};
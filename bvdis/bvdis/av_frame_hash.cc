@@ -0,0 +1,268 @@
+#include "av_frame_hash.h"
+#include "av_log.h"
+
+#include <chrono>
+
+extern "C" {
+#include "libavutil/cpu.h"
+#include "libavutil/hwcontext.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
+}
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define AV_HASH_X86 1
+#include <nmmintrin.h>
+#endif
+
+// CRC32C, reflected
+static const uint32_t kCrc32cPoly = 0x82F63B78;
+
+static int64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// slicing-by-8 tables
+struct Crc32cTable
+{
+	uint32_t table[8][256];
+
+	Crc32cTable() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; bit++) {
+				crc = (crc >> 1) ^ (kCrc32cPoly & (0 - (crc & 1)));
+			}
+			table[0][i] = crc;
+		}
+		for (uint32_t i = 0; i < 256; i++) {
+			for (int slice = 1; slice < 8; slice++) {
+				table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+			}
+		}
+	}
+};
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* data, size_t size)
+{
+	static const Crc32cTable tables;
+	const uint32_t (*t)[256] = tables.table;
+
+	crc = ~crc;
+	while (size >= 8) {
+		uint32_t lo = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+		uint32_t hi = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+			t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+		data += 8;
+		size -= 8;
+	}
+	while (size--) {
+		crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+	}
+	return ~crc;
+}
+
+#ifdef AV_HASH_X86
+#if defined(__GNUC__)
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t size)
+{
+	crc = ~crc;
+	while (size > 0 && ((uintptr_t)data & 7)) {
+		crc = _mm_crc32_u8(crc, *data++);
+		size--;
+	}
+#if defined(_M_X64) || defined(__x86_64__)
+	uint64_t crc64 = crc;
+	while (size >= 8) {
+		crc64 = _mm_crc32_u64(crc64, *(const uint64_t*)data);
+		data += 8;
+		size -= 8;
+	}
+	crc = (uint32_t)crc64;
+#else
+	while (size >= 4) {
+		crc = _mm_crc32_u32(crc, *(const uint32_t*)data);
+		data += 4;
+		size -= 4;
+	}
+#endif
+	while (size--) {
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+	return ~crc;
+}
+#endif
+
+AVFrameHasher::AVFrameHasher()
+{
+
+}
+
+AVFrameHasher::~AVFrameHasher()
+{
+	Close();
+}
+
+bool AVFrameHasher::Open(std::string url)
+{
+	if (file_ != nullptr) {
+		LOG("AVFrameHasher was opened.");
+		return false;
+	}
+
+	file_ = url == "-" ? stdout : fopen(url.c_str(), "w");
+	if (!file_) {
+		LOG("open %s failed.", url.c_str());
+		return false;
+	}
+
+	sw_frame_ = av_frame_alloc();
+	header_written_ = false;
+	frames_ = 0;
+	bytes_ = 0;
+	hash_us_ = 0;
+	return true;
+}
+
+void AVFrameHasher::Close()
+{
+	if (file_ == nullptr) {
+		return;
+	}
+
+	if (file_ == stdout) {
+		fflush(file_);
+	}
+	else {
+		fclose(file_);
+	}
+	file_ = nullptr;
+
+	av_frame_free(&sw_frame_);
+}
+
+bool AVFrameHasher::IsOpened()
+{
+	return file_ != nullptr;
+}
+
+int AVFrameHasher::Write(AVFrame* frame)
+{
+	if (file_ == nullptr) {
+		return -1;
+	}
+
+	const AVFrame* src = frame;
+	if (frame->hw_frames_ctx) {
+		av_frame_unref(sw_frame_);
+		int ret = av_hwframe_transfer_data(sw_frame_, frame, 0);
+		if (ret < 0) {
+			LOG("av_hwframe_transfer_data failed. %d\n", ret);
+			return ret;
+		}
+		sw_frame_->pts = frame->pts;
+		sw_frame_->pkt_dts = frame->pkt_dts;
+		src = sw_frame_;
+	}
+
+	if (!header_written_) {
+		const char* format = av_get_pix_fmt_name((AVPixelFormat)src->format);
+		fprintf(file_, "#format: frame checksums\n");
+		fprintf(file_, "#hash: CRC32C\n");
+		fprintf(file_, "#tb 0: 1/1000\n");
+		fprintf(file_, "#media_type 0: video\n");
+		fprintf(file_, "#pix_fmt 0: %s\n", format ? format : "none");
+		fprintf(file_, "#dimensions 0: %dx%d\n", src->width, src->height);
+		fprintf(file_, "#stream#, dts, pts, size, hash\n");
+		header_written_ = true;
+	}
+
+	uint32_t crc = 0;
+	int64_t size = 0;
+	int64_t begin = now_us();
+	int ret = HashFrame(src, &crc, &size);
+	hash_us_ += now_us() - begin;
+	if (ret < 0) {
+		return ret;
+	}
+
+	frames_++;
+	bytes_ += size;
+
+	fprintf(file_, "0, %10lld, %10lld, %8lld, 0x%08x\n",
+		(long long)(src->pkt_dts != AV_NOPTS_VALUE ? src->pkt_dts : src->pts),
+		(long long)src->pts, (long long)size, crc);
+	return 0;
+}
+
+int AVFrameHasher::HashFrame(const AVFrame* frame, uint32_t* crc, int64_t* size)
+{
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+	if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+		return -1;
+	}
+
+	uint32_t value = 0;
+	int64_t total = 0;
+
+	int planes = av_pix_fmt_count_planes((AVPixelFormat)frame->format);
+	for (int plane = 0; plane < planes; plane++) {
+		int row_bytes = av_image_get_linesize((AVPixelFormat)frame->format, frame->width, plane);
+		if (row_bytes <= 0 || !frame->data[plane]) {
+			return -1;
+		}
+
+		// planes 1 and 2 are the chroma planes, 3 is alpha
+		int rows = frame->height;
+		if ((plane == 1 || plane == 2) && !(desc->flags & AV_PIX_FMT_FLAG_PAL)) {
+			rows = AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h);
+		}
+		// palette formats carry the palette in plane 1
+		if (plane == 1 && (desc->flags & AV_PIX_FMT_FLAG_PAL)) {
+			rows = 1;
+			row_bytes = 256 * 4;
+		}
+
+		const uint8_t* row = frame->data[plane];
+		if (row_bytes == frame->linesize[plane]) {
+			// no padding, one run
+			value = Crc32c(value, row, (size_t)row_bytes * rows);
+		}
+		else {
+			for (int y = 0; y < rows; y++) {
+				value = Crc32c(value, row, row_bytes);
+				row += frame->linesize[plane];
+			}
+		}
+		total += (int64_t)row_bytes * rows;
+	}
+
+	*crc = value;
+	*size = total;
+	return 0;
+}
+
+uint32_t AVFrameHasher::Crc32c(uint32_t crc, const uint8_t* data, size_t size)
+{
+#ifdef AV_HASH_X86
+	static const bool sse42 = HasHardwareCrc();
+	if (sse42) {
+		return crc32c_sse42(crc, data, size);
+	}
+#endif
+	return crc32c_sw(crc, data, size);
+}
+
+bool AVFrameHasher::HasHardwareCrc()
+{
+#ifdef AV_HASH_X86
+	return (av_get_cpu_flags() & AV_CPU_FLAG_SSE42) != 0;
+#else
+	return false;
+#endif
+}
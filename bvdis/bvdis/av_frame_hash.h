@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+
+extern "C" {
+#include "libavutil/frame.h"
+}
+
+// Per-frame CRC32C (Castagnoli) of the decoded pictures, written as a
+// framemd5-like text log for bit-exact comparisons between builds, decoder
+// settings and conversion kernels. SSE4.2 crc32 when the CPU has it, a
+// table-driven fallback otherwise; both give the same values.
+//
+//   #stream#, dts, pts, size, hash
+//   0,          0,          0,   460800, 0x1c2f8a3e
+class AVFrameHasher
+{
+public:
+	AVFrameHasher& operator=(const AVFrameHasher&) = delete;
+	AVFrameHasher(const AVFrameHasher&) = delete;
+	AVFrameHasher();
+	virtual ~AVFrameHasher();
+
+	// "-" writes to stdout.
+	virtual bool Open(std::string url);
+	virtual void Close();
+	virtual bool IsOpened();
+
+	// Hashes and logs one frame, timestamps in ms. Hardware frames are
+	// downloaded first.
+	virtual int  Write(AVFrame* frame);
+
+	// Visible bytes of every plane in order, row padding excluded so the value
+	// does not depend on linesize. size gets the bytes hashed.
+	static int  HashFrame(const AVFrame* frame, uint32_t* crc, int64_t* size);
+	static uint32_t Crc32c(uint32_t crc, const uint8_t* data, size_t size);
+	static bool HasHardwareCrc();
+
+	int64_t GetFramesHashed() { return frames_; }
+	int64_t GetBytesHashed() { return bytes_; }
+	// time spent in HashFrame(), s
+	double  GetHashSeconds() { return hash_us_ / 1000000.0; }
+
+private:
+	FILE* file_ = nullptr;
+	AVFrame* sw_frame_ = nullptr;
+	bool header_written_ = false;
+
+	std::atomic<int64_t> frames_{ 0 };
+	std::atomic<int64_t> bytes_{ 0 };
+	std::atomic<int64_t> hash_us_{ 0 };
+};
@@ -0,0 +1,357 @@
+#include "av_frame_sink.h"
+#include "av_log.h"
+
+extern "C" {
+#include "libavutil/hwcontext.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/mem.h"
+}
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+
+// writes are issued in whole blocks, a few in flight
+static const size_t kBlockSize = 8 << 20;
+static const size_t kBlockAlign = 4096;
+static const size_t kBlockCount = 4;
+
+static uint8_t* block_alloc(size_t size)
+{
+#ifdef _WIN32
+	return (uint8_t*)_aligned_malloc(size, kBlockAlign);
+#else
+	void* data = nullptr;
+	return posix_memalign(&data, kBlockAlign, size) == 0 ? (uint8_t*)data : nullptr;
+#endif
+}
+
+static void block_free(uint8_t* data)
+{
+#ifdef _WIN32
+	_aligned_free(data);
+#else
+	free(data);
+#endif
+}
+
+AVFrameSink::AVFrameSink()
+{
+
+}
+
+AVFrameSink::~AVFrameSink()
+{
+	Close();
+}
+
+bool AVFrameSink::Open(std::string url, Format format, AVRational frame_rate)
+{
+	if (file_ != nullptr) {
+		LOG("AVFrameSink was opened.");
+		return false;
+	}
+
+	if (url == "-" || url == "pipe:") {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		file_ = stdout;
+	}
+	else {
+		file_ = fopen(url.c_str(), "wb");
+	}
+
+	if (!file_) {
+		LOG("open %s failed.", url.c_str());
+		return false;
+	}
+
+	// blocks are already large, skip the stdio copy
+	setvbuf(file_, NULL, _IONBF, 0);
+
+	sw_frame_ = av_frame_alloc();
+	format_ = format;
+	frame_rate_ = frame_rate;
+	header_written_ = false;
+	abort_ = false;
+	write_error_ = 0;
+	frames_written_ = 0;
+	bytes_written_ = 0;
+	url_ = url;
+
+	writer_ = std::thread(&AVFrameSink::WriterThread, this);
+	return true;
+}
+
+void AVFrameSink::Close()
+{
+	if (file_ == nullptr) {
+		return;
+	}
+
+	// the unaligned tail goes out with the last block
+	SubmitBlock(true);
+
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_all();
+
+	if (writer_.joinable()) {
+		writer_.join();
+	}
+
+	for (Block* block : blocks_) {
+		block_free(block->data);
+		delete block;
+	}
+	blocks_.clear();
+	free_blocks_.clear();
+	full_blocks_.clear();
+	current_ = nullptr;
+	tail_size_ = 0;
+
+	if (file_ == stdout) {
+		fflush(file_);
+	}
+	else {
+		fclose(file_);
+	}
+	file_ = nullptr;
+
+	av_frame_free(&sw_frame_);
+}
+
+bool AVFrameSink::IsOpened()
+{
+	return file_ != nullptr;
+}
+
+AVFrameSink::Block* AVFrameSink::AcquireBlock(size_t size)
+{
+	if (current_ && current_->capacity - current_->used >= size) {
+		return current_;
+	}
+
+	SubmitBlock(false);
+
+	std::unique_lock<std::mutex> locker(mutex_);
+	if (free_blocks_.empty() && blocks_.size() < kBlockCount) {
+		Block* block = new Block();
+		block->data = nullptr;
+		block->capacity = 0;
+		block->used = 0;
+		blocks_.push_back(block);
+		free_blocks_.push_back(block);
+	}
+
+	cond_.wait(locker, [this] { return !free_blocks_.empty() || write_error_; });
+	if (write_error_) {
+		return nullptr;
+	}
+
+	Block* block = free_blocks_.front();
+	free_blocks_.pop_front();
+	locker.unlock();
+
+	if (block->capacity < tail_size_ + size) {
+		block_free(block->data);
+		block->capacity = FFALIGN(FFMAX(kBlockSize, tail_size_ + size), kBlockAlign);
+		block->data = block_alloc(block->capacity);
+		if (!block->data) {
+			block->capacity = 0;
+			locker.lock();
+			free_blocks_.push_back(block);
+			return nullptr;
+		}
+	}
+
+	// the bytes the previous block could not write in whole pages go first
+	memcpy(block->data, tail_, tail_size_);
+	block->used = tail_size_;
+	tail_size_ = 0;
+	current_ = block;
+	return current_;
+}
+
+// Hands the current block to the writer. Except for the last one, only whole
+// kBlockAlign pages are written, the rest moves to the next block.
+void AVFrameSink::SubmitBlock(bool last)
+{
+	if (!current_) {
+		return;
+	}
+
+	if (!last) {
+		tail_size_ = current_->used % kBlockAlign;
+		current_->used -= tail_size_;
+		memcpy(tail_, current_->data + current_->used, tail_size_);
+	}
+
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+		if (current_->used > 0) {
+			full_blocks_.push_back(current_);
+		}
+		else {
+			free_blocks_.push_back(current_);
+		}
+		current_ = nullptr;
+	}
+	cond_.notify_all();
+}
+
+void AVFrameSink::WriterThread()
+{
+	while (true) {
+		Block* block = nullptr;
+		{
+			std::unique_lock<std::mutex> locker(mutex_);
+			cond_.wait(locker, [this] { return !full_blocks_.empty() || abort_; });
+			if (full_blocks_.empty()) {
+				break;
+			}
+
+			block = full_blocks_.front();
+			full_blocks_.pop_front();
+		}
+
+		size_t n = fwrite(block->data, 1, block->used, file_);
+		bytes_written_ += n;
+
+		{
+			std::lock_guard<std::mutex> locker(mutex_);
+			if (n != block->used) {
+				LOG("write %s failed.", url_.c_str());
+				write_error_ = 1;
+			}
+			free_blocks_.push_back(block);
+		}
+		cond_.notify_all();
+	}
+}
+
+int AVFrameSink::Write(AVFrame* frame)
+{
+	if (!file_ || write_error_) {
+		return -1;
+	}
+
+	AVFrame* src = frame;
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+	if (desc && (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+		av_frame_unref(sw_frame_);
+		int ret = av_hwframe_transfer_data(sw_frame_, frame, 0);
+		if (ret < 0) {
+			LOG("av_hwframe_transfer_data failed. %d\n", ret);
+			return ret;
+		}
+		src = sw_frame_;
+	}
+
+	bool planar = src->format == AV_PIX_FMT_YUV420P || src->format == AV_PIX_FMT_YUVJ420P;
+	if (!planar && src->format != AV_PIX_FMT_NV12) {
+		LOG("un support AVPixelFormat, %d\n", src->format);
+		return -1;
+	}
+
+	int width = src->width;
+	int height = src->height;
+	int chroma_width = (width + 1) >> 1;
+	int chroma_height = (height + 1) >> 1;
+
+	// the Y4M header, or the NV12 frame size, is fixed by the first frame
+	if (header_written_ && (width != width_ || height != height_)) {
+		LOG("frame size changed from %dx%d to %dx%d, %s cannot hold it.\n",
+			width_, height_, width, height, format_ == FORMAT_Y4M ? "y4m" : "nv12");
+		return AVERROR(EINVAL);
+	}
+
+	char header[128] = { 0 };
+	int header_size = 0;
+	if (format_ == FORMAT_Y4M && !header_written_) {
+		header_size = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg\n",
+			width, height, frame_rate_.num, frame_rate_.den);
+	}
+
+	static const char kFrameTag[] = "FRAME\n";
+	size_t tag_size = format_ == FORMAT_Y4M ? sizeof(kFrameTag) - 1 : 0;
+	size_t frame_size = (size_t)width * height + (size_t)chroma_width * chroma_height * 2;
+
+	Block* block = AcquireBlock(header_size + tag_size + frame_size);
+	if (!block) {
+		return -1;
+	}
+
+	uint8_t* dst = block->data + block->used;
+	memcpy(dst, header, header_size);
+	dst += header_size;
+	memcpy(dst, kFrameTag, tag_size);
+	dst += tag_size;
+
+	// Y
+	const uint8_t* y = src->data[0];
+	for (int i = 0; i < height; i++) {
+		memcpy(dst, y, width);
+		y += src->linesize[0];
+		dst += width;
+	}
+
+	if (format_ == FORMAT_NV12) {
+		// UVUV
+		const uint8_t* u = src->data[1];
+		const uint8_t* v = src->data[2];
+		for (int i = 0; i < chroma_height; i++) {
+			if (planar) {
+				for (int j = 0; j < chroma_width; j++) {
+					*dst++ = u[j];
+					*dst++ = v[j];
+				}
+				v += src->linesize[2];
+			}
+			else {
+				memcpy(dst, u, chroma_width * 2);
+				dst += chroma_width * 2;
+			}
+			u += src->linesize[1];
+		}
+	}
+	else if (planar) {
+		// UU VV
+		for (int plane = 1; plane <= 2; plane++) {
+			const uint8_t* c = src->data[plane];
+			for (int i = 0; i < chroma_height; i++) {
+				memcpy(dst, c, chroma_width);
+				c += src->linesize[plane];
+				dst += chroma_width;
+			}
+		}
+	}
+	else {
+		// UVUV -> UU VV
+		uint8_t* u = dst;
+		uint8_t* v = dst + chroma_width * chroma_height;
+		const uint8_t* uv = src->data[1];
+		for (int i = 0; i < chroma_height; i++) {
+			for (int j = 0; j < chroma_width; j++) {
+				*u++ = uv[2 * j];
+				*v++ = uv[2 * j + 1];
+			}
+			uv += src->linesize[1];
+		}
+	}
+
+	block->used += header_size + tag_size + frame_size;
+	header_written_ = true;
+	width_ = width;
+	height_ = height;
+	frames_written_++;
+
+	return 0;
+}
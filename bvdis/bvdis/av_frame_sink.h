@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <atomic>
+
+extern "C" {
+#include "libavutil/frame.h"
+}
+
+// Headless frame output. Frames are packed as raw NV12 or Y4M (I420) into large
+// page-aligned blocks which a writer thread flushes to a file or to stdout
+// ("-") in whole 4 KB pages; only the last write of the stream is shorter.
+class AVFrameSink
+{
+public:
+	enum Format {
+		FORMAT_NV12,
+		FORMAT_Y4M,
+	};
+
+	AVFrameSink& operator=(const AVFrameSink&) = delete;
+	AVFrameSink(const AVFrameSink&) = delete;
+	AVFrameSink();
+	virtual ~AVFrameSink();
+
+	virtual bool Open(std::string url, Format format, AVRational frame_rate = { 25, 1 });
+	virtual void Close();
+	virtual bool IsOpened();
+
+	// Accepts YUV420P, NV12 and hardware frames (downloaded as NV12). All
+	// frames must have the size of the first, AVERROR(EINVAL) otherwise.
+	virtual int  Write(AVFrame* frame);
+
+	int64_t GetFramesWritten() { return frames_written_; }
+	int64_t GetBytesWritten() { return bytes_written_; }
+
+private:
+	struct Block {
+		uint8_t* data;
+		size_t   capacity;
+		size_t   used;
+	};
+
+	Block* AcquireBlock(size_t size);
+	void   SubmitBlock(bool last);
+	void   WriterThread();
+
+private:
+	std::mutex  mutex_;
+	std::condition_variable cond_;
+	std::thread writer_;
+	std::string url_;
+
+	FILE* file_ = nullptr;
+	Format format_ = FORMAT_NV12;
+	AVRational frame_rate_ = { 25, 1 };
+	bool header_written_ = false;
+	int width_ = 0;  // of the first frame
+	int height_ = 0;
+	bool abort_ = false;
+
+	AVFrame* sw_frame_ = nullptr;
+
+	Block* current_ = nullptr;
+	uint8_t tail_[4096];     // end of the last block past its last whole page
+	size_t  tail_size_ = 0;
+	std::vector<Block*> blocks_;
+	std::deque<Block*>  free_blocks_;
+	std::deque<Block*>  full_blocks_;
+
+	std::atomic<int64_t> frames_written_{ 0 };
+	std::atomic<int64_t> bytes_written_{ 0 };
+	std::atomic<int> write_error_{ 0 };
+};
@@ -2,7 +2,9 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#ifdef _WIN32
 #include <Windows.h>
+#endif
 
 // _check_log vΪtrueʱӡ
 static bool _log_check(bool v, const char* fmt, ...) {
@@ -26,12 +28,14 @@ static bool _log_check_hr(long hr, const char* fmt, ...) {
         va_end(vl);
 
 
+#ifdef _WIN32
         const int BUFFER_LEN = 256;
         char buffer[BUFFER_LEN] = { 0 };
 
         FormatMessageA(FORMAT_MESSAGE_IGNORE_INSERTS | FORMAT_MESSAGE_FROM_SYSTEM,
             NULL, hr, 0, buffer, BUFFER_LEN, NULL);
         printf(buffer);
+#endif
     }
 
     return hr < 0;
@@ -0,0 +1,623 @@
+#include "av_nal_parser.h"
+
+#include <limits.h>
+#include <vector>
+
+extern "C" {
+#include "libavutil/avutil.h"
+}
+
+// enough RBSP for first_mb_in_slice and slice_type
+static const size_t kSliceHeaderBytes = 16;
+// SPS with scaling lists and VUI stays well below this
+static const size_t kMaxSpsBytes = 1024;
+
+static const int kMaxDpbFrames = 16;
+
+uint32_t AVBitReader::ReadBit()
+{
+	if (pos_ >= size_ * 8) {
+		pos_++;
+		return 0;
+	}
+
+	uint32_t bit = (data_[pos_ >> 3] >> (7 - (pos_ & 7))) & 1;
+	pos_++;
+	return bit;
+}
+
+uint32_t AVBitReader::ReadBits(int n)
+{
+	uint32_t value = 0;
+	for (int i = 0; i < n; i++) {
+		value = (value << 1) | ReadBit();
+	}
+	return value;
+}
+
+uint32_t AVBitReader::ReadUE()
+{
+	int zeros = 0;
+	while (!ReadBit()) {
+		if (++zeros > 31 || IsOverrun()) {
+			return 0;
+		}
+	}
+
+	return zeros ? ((1u << zeros) - 1 + ReadBits(zeros)) : 0;
+}
+
+int32_t AVBitReader::ReadSE()
+{
+	uint32_t value = ReadUE();
+	return (value & 1) ? (int32_t)((value + 1) / 2) : -(int32_t)(value / 2);
+}
+
+AVNalParser::AVNalParser()
+{
+
+}
+
+bool AVNalParser::Init(const AVCodecParameters* codecpar)
+{
+	codec_id_ = codecpar ? codecpar->codec_id : AV_CODEC_ID_NONE;
+	nal_length_size_ = 0;
+
+	if (!IsSupported()) {
+		return false;
+	}
+
+	// avcC / hvcC extradata means length-prefixed packets, Annex-B extradata
+	// (or none, e.g. transport streams) means start codes
+	const uint8_t* extradata = codecpar->extradata;
+	int extradata_size = codecpar->extradata_size;
+	if (extradata && extradata_size > 0 && extradata[0] == 1) {
+		if (codec_id_ == AV_CODEC_ID_H264 && extradata_size >= 7) {
+			nal_length_size_ = (extradata[4] & 3) + 1;
+		}
+		else if (codec_id_ == AV_CODEC_ID_HEVC && extradata_size >= 23) {
+			nal_length_size_ = (extradata[21] & 3) + 1;
+		}
+	}
+
+	return true;
+}
+
+size_t AVNalParser::Unescape(const uint8_t* nal, size_t size, uint8_t* dst, size_t max_size)
+{
+	size_t out = 0;
+	int zeros = 0;
+	for (size_t i = 0; i < size && out < max_size; i++) {
+		if (zeros >= 2 && nal[i] == 3) {
+			zeros = 0;
+			continue;
+		}
+
+		zeros = nal[i] == 0 ? zeros + 1 : 0;
+		dst[out++] = nal[i];
+	}
+
+	return out;
+}
+
+AVPacketClass AVNalParser::Classify(const uint8_t* data, int size)
+{
+	AVPacketClass result;
+	if (!IsSupported()) {
+		return result;
+	}
+
+	bool vcl = false;
+	bool key = false;
+	bool reference = false;
+	int temporal_id = INT_MAX;
+
+	ForEachNal(data, size, [&](const uint8_t* nal, size_t nal_size) {
+		AVPacketClass nal_class;
+		bool nal_reference = false;
+		if (codec_id_ == AV_CODEC_ID_H264) {
+			ClassifyH264(nal, nal_size, &nal_class, &nal_reference);
+		}
+		else {
+			ClassifyHEVC(nal, nal_size, &nal_class, &nal_reference);
+		}
+
+		result.parameter_sets = result.parameter_sets || nal_class.parameter_sets;
+		if (nal_class.frame_class == FRAME_CLASS_UNKNOWN) {
+			// H.264 prefix NAL carries the temporal id of the following slice
+			if (nal_class.temporal_id > 0) {
+				result.temporal_id = nal_class.temporal_id;
+			}
+			return;
+		}
+
+		vcl = true;
+		key = key || nal_class.frame_class == FRAME_CLASS_KEY;
+		reference = reference || nal_reference;
+		if (codec_id_ == AV_CODEC_ID_HEVC) {
+			temporal_id = FFMIN(temporal_id, nal_class.temporal_id);
+		}
+		if (result.slice_type < 0) {
+			result.slice_type = nal_class.slice_type;
+		}
+	});
+
+	if (!vcl) {
+		return result;
+	}
+
+	if (temporal_id != INT_MAX) {
+		result.temporal_id = temporal_id;
+	}
+
+	if (key) {
+		result.frame_class = FRAME_CLASS_KEY;
+	}
+	else {
+		result.frame_class = reference ? FRAME_CLASS_REFERENCE : FRAME_CLASS_NON_REFERENCE;
+	}
+
+	return result;
+}
+
+void AVNalParser::ClassifyH264(const uint8_t* nal, size_t size, AVPacketClass* result, bool* reference)
+{
+	if (size < 1) {
+		return;
+	}
+
+	int nal_ref_idc = (nal[0] >> 5) & 3;
+	int type = nal[0] & 0x1f;
+
+	if (type == 7 || type == 8) {
+		result->parameter_sets = true;
+		return;
+	}
+
+	// prefix NAL / coded slice extension, SVC or MVC header
+	if ((type == 14 || type == 20) && size >= 4) {
+		bool svc = (nal[1] & 0x80) != 0;
+		result->temporal_id = svc ? (nal[3] >> 5) & 7 : (nal[3] >> 3) & 7;
+		return;
+	}
+
+	if (type < 1 || type > 5) {
+		return;
+	}
+
+	*reference = nal_ref_idc != 0;
+	result->frame_class = type == 5 ? FRAME_CLASS_KEY : (*reference ? FRAME_CLASS_REFERENCE : FRAME_CLASS_NON_REFERENCE);
+
+	uint8_t rbsp[kSliceHeaderBytes];
+	size_t rbsp_size = Unescape(nal + 1, size - 1, rbsp, sizeof(rbsp));
+
+	AVBitReader reader(rbsp, rbsp_size);
+	reader.ReadUE(); // first_mb_in_slice
+	uint32_t slice_type = reader.ReadUE();
+	if (reader.IsOverrun() || slice_type > 9) {
+		return;
+	}
+
+	static const int slice_types[] = {
+		AV_PICTURE_TYPE_P, AV_PICTURE_TYPE_B, AV_PICTURE_TYPE_I, AV_PICTURE_TYPE_SP, AV_PICTURE_TYPE_SI
+	};
+	result->slice_type = slice_types[slice_type % 5];
+}
+
+void AVNalParser::ClassifyHEVC(const uint8_t* nal, size_t size, AVPacketClass* result, bool* reference)
+{
+	if (size < 2) {
+		return;
+	}
+
+	int type = (nal[0] >> 1) & 0x3f;
+	int temporal_id = (nal[1] & 7) - 1;
+
+	if (type >= 32 && type <= 34) {
+		result->parameter_sets = true;
+		return;
+	}
+
+	// reserved non-IRAP VCL types 24-31 are skipped along with non-VCL NALs
+	if (type > 21 && type != 22 && type != 23) {
+		return;
+	}
+
+	result->temporal_id = FFMAX(temporal_id, 0);
+
+	// IRAP: BLA, IDR, CRA and reserved IRAP 22/23
+	if (type >= 16) {
+		*reference = true;
+		result->frame_class = FRAME_CLASS_KEY;
+		return;
+	}
+
+	// TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N and reserved _N types are not
+	// referenced by pictures of the same temporal sub-layer
+	*reference = type > 14 || (type & 1) != 0;
+	result->frame_class = *reference ? FRAME_CLASS_REFERENCE : FRAME_CLASS_NON_REFERENCE;
+}
+
+
+static void skip_h264_scaling_list(AVBitReader* reader, int size)
+{
+	int last_scale = 8;
+	int next_scale = 8;
+	for (int i = 0; i < size; i++) {
+		if (next_scale != 0) {
+			int delta_scale = reader->ReadSE();
+			next_scale = (last_scale + delta_scale + 256) % 256;
+		}
+		last_scale = next_scale == 0 ? last_scale : next_scale;
+	}
+}
+
+static void skip_h264_hrd_parameters(AVBitReader* reader)
+{
+	uint32_t cpb_cnt = reader->ReadUE() + 1;
+	reader->SkipBits(4 + 4); // bit_rate_scale, cpb_size_scale
+	for (uint32_t i = 0; i < cpb_cnt && !reader->IsOverrun(); i++) {
+		reader->ReadUE(); // bit_rate_value_minus1
+		reader->ReadUE(); // cpb_size_value_minus1
+		reader->SkipBits(1); // cbr_flag
+	}
+	reader->SkipBits(5 + 5 + 5 + 5);
+}
+
+bool AVNalParser::ParseH264Sps(AVBitReader* reader, AVSpsInfo* sps)
+{
+	sps->profile_idc = reader->ReadBits(8);
+	reader->SkipBits(8); // constraint_set flags
+	sps->level_idc = reader->ReadBits(8);
+	reader->ReadUE(); // seq_parameter_set_id
+
+	int chroma_format_idc = 1;
+	switch (sps->profile_idc)
+	{
+	case 100: case 110: case 122: case 244: case 44:
+	case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+		chroma_format_idc = reader->ReadUE();
+		if (chroma_format_idc == 3) {
+			reader->SkipBits(1); // separate_colour_plane_flag
+		}
+		reader->ReadUE(); // bit_depth_luma_minus8
+		reader->ReadUE(); // bit_depth_chroma_minus8
+		reader->SkipBits(1); // qpprime_y_zero_transform_bypass_flag
+		if (reader->ReadBit()) { // seq_scaling_matrix_present_flag
+			int lists = chroma_format_idc != 3 ? 8 : 12;
+			for (int i = 0; i < lists; i++) {
+				if (reader->ReadBit()) {
+					skip_h264_scaling_list(reader, i < 6 ? 16 : 64);
+				}
+			}
+		}
+		break;
+	default:
+		break;
+	}
+
+	reader->ReadUE(); // log2_max_frame_num_minus4
+	uint32_t poc_type = reader->ReadUE();
+	if (poc_type == 0) {
+		reader->ReadUE(); // log2_max_pic_order_cnt_lsb_minus4
+	}
+	else if (poc_type == 1) {
+		reader->SkipBits(1); // delta_pic_order_always_zero_flag
+		reader->ReadSE(); // offset_for_non_ref_pic
+		reader->ReadSE(); // offset_for_top_to_bottom_field
+		uint32_t cycle = reader->ReadUE();
+		for (uint32_t i = 0; i < cycle && !reader->IsOverrun(); i++) {
+			reader->ReadSE();
+		}
+	}
+
+	sps->max_num_ref_frames = reader->ReadUE();
+	reader->SkipBits(1); // gaps_in_frame_num_value_allowed_flag
+	uint32_t width_mbs = reader->ReadUE() + 1;
+	uint32_t height_map_units = reader->ReadUE() + 1;
+	uint32_t frame_mbs_only = reader->ReadBit();
+	if (!frame_mbs_only) {
+		reader->SkipBits(1); // mb_adaptive_frame_field_flag
+	}
+	sps->width = width_mbs * 16;
+	sps->height = height_map_units * 16 * (2 - frame_mbs_only);
+
+	reader->SkipBits(1); // direct_8x8_inference_flag
+	if (reader->ReadBit()) { // frame_cropping_flag
+		for (int i = 0; i < 4; i++) {
+			reader->ReadUE();
+		}
+	}
+
+	if (reader->IsOverrun()) {
+		return false;
+	}
+
+	if (!reader->ReadBit()) { // vui_parameters_present_flag
+		return true;
+	}
+
+	if (reader->ReadBit()) { // aspect_ratio_info_present_flag
+		if (reader->ReadBits(8) == 255) {
+			reader->SkipBits(32); // sar_width, sar_height
+		}
+	}
+	if (reader->ReadBit()) { // overscan_info_present_flag
+		reader->SkipBits(1);
+	}
+	if (reader->ReadBit()) { // video_signal_type_present_flag
+		reader->SkipBits(3 + 1);
+		if (reader->ReadBit()) {
+			reader->SkipBits(24); // colour description
+		}
+	}
+	if (reader->ReadBit()) { // chroma_loc_info_present_flag
+		reader->ReadUE();
+		reader->ReadUE();
+	}
+	if (reader->ReadBit()) { // timing_info_present_flag
+		reader->SkipBits(32 + 32 + 1);
+	}
+	uint32_t nal_hrd = reader->ReadBit();
+	if (nal_hrd) {
+		skip_h264_hrd_parameters(reader);
+	}
+	uint32_t vcl_hrd = reader->ReadBit();
+	if (vcl_hrd) {
+		skip_h264_hrd_parameters(reader);
+	}
+	if (nal_hrd || vcl_hrd) {
+		reader->SkipBits(1); // low_delay_hrd_flag
+	}
+	reader->SkipBits(1); // pic_struct_present_flag
+
+	if (reader->ReadBit()) { // bitstream_restriction_flag
+		reader->SkipBits(1); // motion_vectors_over_pic_boundaries_flag
+		reader->ReadUE(); // max_bytes_per_pic_denom
+		reader->ReadUE(); // max_bits_per_mb_denom
+		reader->ReadUE(); // log2_max_mv_length_horizontal
+		reader->ReadUE(); // log2_max_mv_length_vertical
+		reader->ReadUE(); // max_num_reorder_frames
+		uint32_t max_dec_frame_buffering = reader->ReadUE();
+		if (!reader->IsOverrun() && max_dec_frame_buffering <= kMaxDpbFrames) {
+			sps->max_dec_frame_buffering = (int)max_dec_frame_buffering;
+		}
+	}
+
+	return true;
+}
+
+bool AVNalParser::ParseHEVCSps(AVBitReader* reader, AVSpsInfo* sps)
+{
+	reader->SkipBits(4); // sps_video_parameter_set_id
+	int max_sub_layers = reader->ReadBits(3) + 1;
+	reader->SkipBits(1); // sps_temporal_id_nesting_flag
+
+	// profile_tier_level(1, max_sub_layers - 1)
+	reader->SkipBits(2 + 1); // general_profile_space, general_tier_flag
+	sps->profile_idc = reader->ReadBits(5);
+	reader->SkipBits(32 + 48); // compatibility flags, constraint flags
+	sps->level_idc = reader->ReadBits(8);
+
+	int sub_layer_profile[8] = { 0 };
+	int sub_layer_level[8] = { 0 };
+	for (int i = 0; i < max_sub_layers - 1; i++) {
+		sub_layer_profile[i] = reader->ReadBit();
+		sub_layer_level[i] = reader->ReadBit();
+	}
+	if (max_sub_layers > 1) {
+		reader->SkipBits(2 * (8 - (max_sub_layers - 1))); // reserved_zero_2bits
+	}
+	for (int i = 0; i < max_sub_layers - 1; i++) {
+		if (sub_layer_profile[i]) {
+			reader->SkipBits(88);
+		}
+		if (sub_layer_level[i]) {
+			reader->SkipBits(8);
+		}
+	}
+
+	reader->ReadUE(); // sps_seq_parameter_set_id
+	if (reader->ReadUE() == 3) { // chroma_format_idc
+		reader->SkipBits(1); // separate_colour_plane_flag
+	}
+	sps->width = reader->ReadUE();
+	sps->height = reader->ReadUE();
+	if (reader->ReadBit()) { // conformance_window_flag
+		for (int i = 0; i < 4; i++) {
+			reader->ReadUE();
+		}
+	}
+	reader->ReadUE(); // bit_depth_luma_minus8
+	reader->ReadUE(); // bit_depth_chroma_minus8
+	reader->ReadUE(); // log2_max_pic_order_cnt_lsb_minus4
+
+	// the highest sub-layer carries the largest value
+	uint32_t ordering_info_present = reader->ReadBit();
+	uint32_t max_dec_pic_buffering = 0;
+	for (int i = ordering_info_present ? 0 : max_sub_layers - 1; i < max_sub_layers; i++) {
+		max_dec_pic_buffering = reader->ReadUE() + 1;
+		reader->ReadUE(); // sps_max_num_reorder_pics
+		reader->ReadUE(); // sps_max_latency_increase_plus1
+	}
+
+	if (reader->IsOverrun()) {
+		return false;
+	}
+
+	if (max_dec_pic_buffering <= kMaxDpbFrames) {
+		sps->max_dec_frame_buffering = (int)max_dec_pic_buffering;
+	}
+	return true;
+}
+
+bool AVNalParser::ParseSps(AVCodecID codec_id, const uint8_t* nal, size_t size, AVSpsInfo* sps)
+{
+	size_t header = codec_id == AV_CODEC_ID_HEVC ? 2 : 1;
+	if (size <= header) {
+		return false;
+	}
+
+	std::vector<uint8_t> rbsp(FFMIN(size, kMaxSpsBytes));
+	size_t rbsp_size = Unescape(nal + header, size - header, rbsp.data(), rbsp.size());
+
+	AVBitReader reader(rbsp.data(), rbsp_size);
+	*sps = AVSpsInfo();
+	return codec_id == AV_CODEC_ID_HEVC ? ParseHEVCSps(&reader, sps) : ParseH264Sps(&reader, sps);
+}
+
+bool AVNalParser::ParseExtradataSps(const AVCodecParameters* codecpar, AVSpsInfo* sps)
+{
+	const uint8_t* data = codecpar->extradata;
+	int size = codecpar->extradata_size;
+	AVCodecID codec_id = codecpar->codec_id;
+	if (!data || size <= 0 || (codec_id != AV_CODEC_ID_H264 && codec_id != AV_CODEC_ID_HEVC)) {
+		return false;
+	}
+
+	// avcC: 5 byte header, SPS count, then 16 bit length + SPS
+	if (codec_id == AV_CODEC_ID_H264 && data[0] == 1) {
+		if (size < 8 || (data[5] & 0x1f) == 0) {
+			return false;
+		}
+		int length = (data[6] << 8) | data[7];
+		return length > 0 && 8 + length <= size && ParseSps(codec_id, data + 8, length, sps);
+	}
+
+	// hvcC: 22 byte header, arrays of NAL type, count and 16 bit length + NAL
+	if (codec_id == AV_CODEC_ID_HEVC && data[0] == 1) {
+		if (size < 23) {
+			return false;
+		}
+		int arrays = data[22];
+		int pos = 23;
+		for (int i = 0; i < arrays && pos + 3 <= size; i++) {
+			int type = data[pos] & 0x3f;
+			int count = (data[pos + 1] << 8) | data[pos + 2];
+			pos += 3;
+			for (int j = 0; j < count && pos + 2 <= size; j++) {
+				int length = (data[pos] << 8) | data[pos + 1];
+				pos += 2;
+				if (pos + length > size) {
+					return false;
+				}
+				if (type == 33) {
+					return ParseSps(codec_id, data + pos, length, sps);
+				}
+				pos += length;
+			}
+		}
+		return false;
+	}
+
+	// Annex-B
+	AVNalParser parser;
+	parser.codec_id_ = codec_id;
+
+	bool found = false;
+	parser.ForEachNal(data, size, [&](const uint8_t* nal, size_t nal_size) {
+		if (found || nal_size < 2) {
+			return;
+		}
+		int type = codec_id == AV_CODEC_ID_HEVC ? (nal[0] >> 1) & 0x3f : nal[0] & 0x1f;
+		if (type == (codec_id == AV_CODEC_ID_HEVC ? 33 : 7)) {
+			found = ParseSps(codec_id, nal, nal_size, sps);
+		}
+	});
+
+	return found;
+}
+
+// H.264 table A-1 MaxDpbMbs
+static int h264_max_dpb_mbs(int level_idc)
+{
+	switch (level_idc)
+	{
+	case 9: case 10: return 396;
+	case 11: return 900;
+	case 12: case 13: case 20: return 2376;
+	case 21: return 4752;
+	case 22: case 30: return 8100;
+	case 31: return 18000;
+	case 32: return 20480;
+	case 40: case 41: return 32768;
+	case 42: return 34816;
+	case 50: return 110400;
+	case 51: case 52: return 184320;
+	case 60: case 61: case 62: return 696320;
+	default: return 0;
+	}
+}
+
+// HEVC table A.8 MaxLumaPs, level_idc = level * 30
+static int hevc_max_luma_ps(int level_idc)
+{
+	if (level_idc <= 30) return 36864;
+	if (level_idc <= 60) return 122880;
+	if (level_idc <= 63) return 245760;
+	if (level_idc <= 90) return 552960;
+	if (level_idc <= 93) return 983040;
+	if (level_idc <= 123) return 2228224;
+	if (level_idc <= 156) return 8912896;
+	return 35651584;
+}
+
+int AVNalParser::GetMaxDpbFrames(const AVCodecParameters* codecpar)
+{
+	AVSpsInfo sps;
+	bool has_sps = ParseExtradataSps(codecpar, &sps);
+
+	switch (codecpar->codec_id)
+	{
+	case AV_CODEC_ID_H264: {
+		if (has_sps && sps.max_dec_frame_buffering >= 0) {
+			return FFMAX(sps.max_dec_frame_buffering, sps.max_num_ref_frames);
+		}
+
+		int level = has_sps ? sps.level_idc : codecpar->level;
+		int width = has_sps ? sps.width : codecpar->width;
+		int height = has_sps ? sps.height : codecpar->height;
+		int frame_mbs = ((width + 15) / 16) * ((height + 15) / 16);
+		int max_dpb_mbs = h264_max_dpb_mbs(level);
+		if (max_dpb_mbs > 0 && frame_mbs > 0) {
+			int frames = FFMIN(max_dpb_mbs / frame_mbs, kMaxDpbFrames);
+			return FFMAX(frames, has_sps ? sps.max_num_ref_frames : 1);
+		}
+		return has_sps && sps.max_num_ref_frames > 0 ? FFMAX(sps.max_num_ref_frames, 4) : kMaxDpbFrames;
+	}
+
+	case AV_CODEC_ID_HEVC: {
+		if (has_sps && sps.max_dec_frame_buffering > 0) {
+			return sps.max_dec_frame_buffering;
+		}
+
+		// A.4.2 maxDpbSize
+		int level = has_sps ? sps.level_idc : codecpar->level;
+		int64_t samples = (int64_t)(has_sps ? sps.width : codecpar->width) * (has_sps ? sps.height : codecpar->height);
+		if (level <= 0 || samples <= 0) {
+			return kMaxDpbFrames;
+		}
+
+		int64_t max_luma_ps = hevc_max_luma_ps(level);
+		if (samples <= max_luma_ps >> 2) return 16;
+		if (samples <= max_luma_ps >> 1) return 12;
+		if (samples <= (max_luma_ps * 3) >> 2) return 8;
+		return 6;
+	}
+
+	case AV_CODEC_ID_VP9:
+		return 8;
+	case AV_CODEC_ID_VP8:
+		return 3;
+	case AV_CODEC_ID_MPEG1VIDEO:
+	case AV_CODEC_ID_MPEG2VIDEO:
+	case AV_CODEC_ID_MPEG4:
+	case AV_CODEC_ID_VC1:
+	case AV_CODEC_ID_WMV3:
+		return 2;
+	case AV_CODEC_ID_MJPEG:
+		return 0;
+	default:
+		return kMaxDpbFrames;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdint.h>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+}
+
+enum AVFrameClass
+{
+	FRAME_CLASS_UNKNOWN,       // no slice NAL in the packet
+	FRAME_CLASS_KEY,           // H.264 IDR, HEVC IRAP
+	FRAME_CLASS_REFERENCE,     // may be referenced by later pictures
+	FRAME_CLASS_NON_REFERENCE, // H.264 nal_ref_idc == 0, HEVC sub-layer non-reference
+};
+
+// HEVC sub-layer non-reference pictures may still be referenced by higher
+// temporal layers, they are only safe to drop together with every packet of a
+// higher temporal_id (or when temporal_id is the highest in the stream).
+
+struct AVPacketClass
+{
+	AVFrameClass frame_class = FRAME_CLASS_UNKNOWN;
+	int temporal_id = 0;       // HEVC nuh_temporal_id, H.264 SVC/MVC prefix, else 0
+	int slice_type = -1;       // H.264 only, AV_PICTURE_TYPE_I/P/B
+	bool parameter_sets = false;
+};
+
+// Fields of the first SPS that size the decoded picture buffer.
+struct AVSpsInfo
+{
+	int profile_idc = 0;
+	int level_idc = 0;          // H.264 level * 10, HEVC general_level_idc (level * 30)
+	int width = 0;              // luma samples, before cropping
+	int height = 0;
+	int max_num_ref_frames = 0; // H.264 only
+	int max_dec_frame_buffering = -1; // VUI (H.264) / sps_max_dec_pic_buffering (HEVC), -1 absent
+};
+
+// Exp-Golomb reader over an RBSP (emulation prevention bytes already removed).
+class AVBitReader
+{
+public:
+	AVBitReader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+	uint32_t ReadBit();
+	uint32_t ReadBits(int n);
+	uint32_t ReadUE();
+	int32_t  ReadSE();
+	void     SkipBits(size_t n) { pos_ += n; }
+	bool     IsOverrun() { return pos_ > size_ * 8; }
+
+private:
+	const uint8_t* data_;
+	size_t size_;
+	size_t pos_ = 0;
+};
+
+// Compressed-domain H.264/HEVC packet classification from NAL headers and the
+// start of the slice header, for both Annex-B and length-prefixed (mp4) packets.
+class AVNalParser
+{
+public:
+	AVNalParser();
+
+	bool Init(const AVCodecParameters* codecpar);
+	bool IsSupported() { return codec_id_ == AV_CODEC_ID_H264 || codec_id_ == AV_CODEC_ID_HEVC; }
+
+	AVPacketClass Classify(const uint8_t* data, int size);
+	AVPacketClass Classify(const AVPacket* pkt) { return Classify(pkt->data, pkt->size); }
+
+	// Calls fn(nal, size) for every NAL unit (header included) of a packet.
+	template <typename Fn>
+	void ForEachNal(const uint8_t* data, int size, Fn fn);
+
+	// First SPS of the extradata (avcC, hvcC or Annex-B).
+	static bool ParseExtradataSps(const AVCodecParameters* codecpar, AVSpsInfo* sps);
+	// nal includes its header.
+	static bool ParseSps(AVCodecID codec_id, const uint8_t* nal, size_t size, AVSpsInfo* sps);
+
+	// Pictures the decoder may hold for reference and reordering: the SPS
+	// value, else the level limit for the picture size, else the codec maximum.
+	static int GetMaxDpbFrames(const AVCodecParameters* codecpar);
+
+	// Copies at most max_size bytes of a NAL payload, dropping emulation prevention bytes.
+	static size_t Unescape(const uint8_t* nal, size_t size, uint8_t* dst, size_t max_size);
+
+private:
+	static bool ParseH264Sps(AVBitReader* reader, AVSpsInfo* sps);
+	static bool ParseHEVCSps(AVBitReader* reader, AVSpsInfo* sps);
+
+	void ClassifyH264(const uint8_t* nal, size_t size, AVPacketClass* result, bool* reference);
+	void ClassifyHEVC(const uint8_t* nal, size_t size, AVPacketClass* result, bool* reference);
+
+private:
+	AVCodecID codec_id_ = AV_CODEC_ID_NONE;
+	int nal_length_size_ = 0; // 0 for Annex-B
+};
+
+template <typename Fn>
+void AVNalParser::ForEachNal(const uint8_t* data, int size, Fn fn)
+{
+	if (!data || size <= 0) {
+		return;
+	}
+
+	if (nal_length_size_ > 0) {
+		int pos = 0;
+		while (pos + nal_length_size_ <= size) {
+			uint32_t length = 0;
+			for (int i = 0; i < nal_length_size_; i++) {
+				length = (length << 8) | data[pos + i];
+			}
+			pos += nal_length_size_;
+			if (length == 0 || length > (uint32_t)(size - pos)) {
+				break;
+			}
+
+			fn(data + pos, (size_t)length);
+			pos += length;
+		}
+		return;
+	}
+
+	// Annex-B
+	int start = -1;
+	for (int i = 0; i + 2 < size; i++) {
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+			if (start >= 0) {
+				int end = i;
+				while (end > start && data[end - 1] == 0) {
+					end--;
+				}
+				fn(data + start, (size_t)(end - start));
+			}
+			start = i + 3;
+			i += 2;
+		}
+	}
+
+	if (start >= 0 && start < size) {
+		fn(data + start, (size_t)(size - start));
+	}
+}
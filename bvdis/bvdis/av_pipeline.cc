@@ -0,0 +1,222 @@
+#include "av_pipeline.h"
+#include "av_log.h"
+
+#include <chrono>
+
+AVPipeline::AVPipeline()
+{
+
+}
+
+AVPipeline::~AVPipeline()
+{
+	Close();
+}
+
+bool AVPipeline::Open(std::string input, std::string output, AVFrameSink::Format format)
+{
+	AVStream* video_stream = nullptr;
+	if (sharded_) {
+		if (!sharded_decoder_.Open(input, shard_workers_)) {
+			return false;
+		}
+		video_stream = sharded_decoder_.GetVideoStream();
+	}
+	else {
+		if (!demuxer_.Open(input)) {
+			return false;
+		}
+
+		video_stream = demuxer_.GetVideoStream();
+		if (!video_stream) {
+			LOG("%s has no video stream.", input.c_str());
+			demuxer_.Close();
+			return false;
+		}
+
+		if (!decoder_.Init(video_stream, nullptr, false)) {
+			demuxer_.Close();
+			return false;
+		}
+	}
+
+	AVRational frame_rate = video_stream->avg_frame_rate;
+	if (frame_rate.num <= 0 || frame_rate.den <= 0) {
+		frame_rate = video_stream->r_frame_rate;
+	}
+	if (frame_rate.num <= 0 || frame_rate.den <= 0) {
+		frame_rate = { 25, 1 };
+	}
+
+	if ((!output.empty() || hash_url_.empty()) && !sink_.Open(output, format, frame_rate)) {
+		sharded_decoder_.Close();
+		decoder_.Destroy();
+		demuxer_.Close();
+		return false;
+	}
+
+	if (!hash_url_.empty() && !hasher_.Open(hash_url_)) {
+		sink_.Close();
+		sharded_decoder_.Close();
+		decoder_.Destroy();
+		demuxer_.Close();
+		return false;
+	}
+
+	stop_ = false;
+	packets_ = 0;
+	frames_ = 0;
+	scene_detector_.Reset();
+	scene_changes_.clear();
+	elapsed_ = 0.0;
+	return true;
+}
+
+void AVPipeline::Close()
+{
+	sink_.Close();
+	hasher_.Close();
+	sharded_decoder_.Close();
+	decoder_.Destroy();
+	demuxer_.Close();
+}
+
+int AVPipeline::Run()
+{
+	if (sharded_) {
+		return RunSharded();
+	}
+
+	AVStream* video_stream = demuxer_.GetVideoStream();
+	if (!video_stream) {
+		return -1;
+	}
+
+	AVPacket* packet = av_packet_alloc();
+	AVFrame* frame = av_frame_alloc();
+	int result = 0;
+
+	auto start = std::chrono::steady_clock::now();
+
+	while (!stop_) {
+		int ret = demuxer_.Read(packet);
+		if (ret < 0) {
+			if (demuxer_.IsEOF()) {
+				break;
+			}
+			if (ret == -2) {
+				result = -1;
+				break;
+			}
+			continue;
+		}
+
+		if (packet->stream_index == video_stream->index) {
+			packets_++;
+			decoder_.Send(packet);
+			DrainFrames(frame);
+		}
+
+		av_packet_unref(packet);
+	}
+
+	// drain the frames still buffered in the decoder
+	decoder_.Send(nullptr);
+	DrainFrames(frame);
+
+	elapsed_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	av_frame_free(&frame);
+	av_packet_free(&packet);
+	return result;
+}
+
+// Frames come out in order, the workers decode ahead.
+int AVPipeline::RunSharded()
+{
+	if (!sharded_decoder_.IsOpened()) {
+		return -1;
+	}
+
+	AVFrame* frame = av_frame_alloc();
+
+	auto start = std::chrono::steady_clock::now();
+
+	while (!stop_ && sharded_decoder_.Read(frame) >= 0) {
+		OnFrame(frame);
+		av_frame_unref(frame);
+	}
+
+	elapsed_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	av_frame_free(&frame);
+	return sharded_decoder_.GetStats().failed_ranges > 0 ? -1 : 0;
+}
+
+void AVPipeline::DrainFrames(AVFrame* frame)
+{
+	while (decoder_.Recv(frame) >= 0) {
+		OnFrame(frame);
+		av_frame_unref(frame);
+	}
+}
+
+void AVPipeline::OnFrame(AVFrame* frame)
+{
+	frames_++;
+
+	AVSceneChange change;
+	if (detect_scenes_ && scene_detector_.Process(frame, &change)) {
+		OnSceneChange(change);
+	}
+
+	if (hasher_.IsOpened()) {
+		hasher_.Write(frame);
+	}
+
+	if (sink_.IsOpened()) {
+		sink_.Write(frame);
+	}
+}
+
+void AVPipeline::OnSceneChange(const AVSceneChange& change)
+{
+	scene_changes_.push_back(change);
+	LOG("scene change at %lld ms (frame %lld), histogram %.2f, sad %.2f\n",
+		(long long)change.pts, (long long)change.frame_index, change.histogram_diff, change.sad);
+}
+
+void AVPipeline::PrintStats()
+{
+	double seconds = elapsed_ > 0.0 ? elapsed_ : 1e-9;
+	fprintf(stderr, "packets: %lld, frames: %lld, %.3f s, %.1f fps, %.1f MB/s written\n",
+		(long long)packets_, (long long)frames_, elapsed_,
+		frames_ / seconds, sink_.GetBytesWritten() / seconds / (1024.0 * 1024.0));
+
+	if (hasher_.GetFramesHashed() > 0) {
+		double hash_seconds = hasher_.GetHashSeconds() > 0.0 ? hasher_.GetHashSeconds() : 1e-9;
+		fprintf(stderr, "hash: %lld frames, CRC32C (%s), %.3f s, %.1f MB/s\n",
+			(long long)hasher_.GetFramesHashed(), AVFrameHasher::HasHardwareCrc() ? "sse4.2" : "table",
+			hasher_.GetHashSeconds(), hasher_.GetBytesHashed() / hash_seconds / (1024.0 * 1024.0));
+	}
+
+	if (detect_scenes_) {
+		AVSceneDetectorStats scene = scene_detector_.GetStats();
+		fprintf(stderr, "scenes: %lld cuts in %lld frames, %.1f us/frame, max %.0f us\n",
+			(long long)scene.scene_changes, (long long)scene.frames, scene.avg_us, scene.max_us);
+	}
+
+	if (sharded_) {
+		sharded_decoder_.PrintStats();
+		return;
+	}
+
+	AVDecoderStats stats = decoder_.GetStats();
+	fprintf(stderr, "decoder: in %lld, out %lld, eagain send %lld/%lld recv %lld/%lld, errors %lld, flushes %lld, "
+		"reorder %d (peak %d), latency avg %.2f ms max %.2f ms\n",
+		(long long)stats.packets_in, (long long)stats.frames_out,
+		(long long)stats.send_eagain, (long long)stats.send_calls,
+		(long long)stats.recv_eagain, (long long)stats.recv_calls,
+		(long long)stats.errors, (long long)stats.flushes,
+		stats.reorder_depth, stats.peak_reorder_depth, stats.avg_latency_ms, stats.max_latency_ms);
+}
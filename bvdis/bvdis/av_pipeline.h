@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <vector>
+
+#include "av_demuxer.h"
+#include "av_decoder.h"
+#include "av_sharded_decoder.h"
+#include "av_frame_sink.h"
+#include "av_frame_hash.h"
+#include "av_scene_detector.h"
+
+// Headless demux -> software decode -> AVFrameSink, no window or D3D11 device.
+// Used for throughput measurement and reference dumps on build machines.
+class AVPipeline
+{
+public:
+	AVPipeline& operator=(const AVPipeline&) = delete;
+	AVPipeline(const AVPipeline&) = delete;
+	AVPipeline();
+	virtual ~AVPipeline();
+
+	// Offline mode: GOP ranges decoded in parallel by AVShardedDecoder, workers
+	// 0 is one per core. Set before Open().
+	void SetSharded(bool sharded, int workers = 0) { sharded_ = sharded; shard_workers_ = workers; }
+
+	// MPEG-TS program_number to decode, -1 for all (AVDemuxer::SetProgram()).
+	// Not applied in sharded mode. Set before Open().
+	void SetProgram(int program_id) { demuxer_.SetProgram(program_id); }
+
+	// Per-frame CRC32C log (AVFrameHasher), "-" for stdout. Set before Open().
+	void SetHashLog(std::string url) { hash_url_ = url; }
+
+	// Scene cuts on the decoded frames, reported through OnSceneChange(). Set
+	// before Run().
+	void SetSceneDetection(bool detect) { detect_scenes_ = detect; }
+	AVSceneDetector* GetSceneDetector() { return &scene_detector_; }
+	const std::vector<AVSceneChange>& GetSceneChanges() { return scene_changes_; }
+
+	// output empty with a hash log set: checksums only, no frames written.
+	virtual bool Open(std::string input, std::string output, AVFrameSink::Format format);
+	virtual void Close();
+
+	// Blocks until end of input or Stop().
+	virtual int  Run();
+	void Stop() { stop_ = true; }
+
+	// To stderr, stdout may carry the frames.
+	void PrintStats();
+
+protected:
+	virtual void OnFrame(AVFrame* frame);
+	// Records and logs the cut.
+	virtual void OnSceneChange(const AVSceneChange& change);
+
+private:
+	int  RunSharded();
+	void DrainFrames(AVFrame* frame);
+
+private:
+	AVDemuxer demuxer_;
+	AVDecoder decoder_;
+	AVShardedDecoder sharded_decoder_;
+	AVFrameSink sink_;
+	AVFrameHasher hasher_;
+	std::string hash_url_;
+	AVSceneDetector scene_detector_;
+	bool detect_scenes_ = false;
+	std::vector<AVSceneChange> scene_changes_;
+
+	bool sharded_ = false;
+	int  shard_workers_ = 0;
+
+	std::atomic<bool> stop_{ false };
+
+	int64_t packets_ = 0;
+	int64_t frames_ = 0;
+	double  elapsed_ = 0.0;
+};
@@ -0,0 +1,574 @@
+#include "av_player.h"
+#include "av_log.h"
+
+#include <chrono>
+#include <thread>
+
+// a frame this late restarts the clock instead of rushing to catch up, ms
+static const int64_t kMaxLateness = 100;
+// longer waits are timestamp jumps, not cadence, ms
+static const int64_t kMaxWait = 5000;
+
+const int AVPlayer::kRates[] = { 1, 2, 4, 8, 16 };
+
+static int64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const char* mode_name(int mode)
+{
+	switch (mode)
+	{
+	case AVPlayer::DECODE_ALL:
+		return "all";
+	case AVPlayer::DECODE_REFERENCE:
+		return "reference";
+	case AVPlayer::DECODE_KEYFRAME:
+		return "keyframe";
+	case AVPlayer::DECODE_REVERSE:
+		return "reverse";
+	default:
+		return "unknown";
+	}
+}
+
+AVPlayer::AVPlayer()
+{
+	for (int i = 0; i < kNumRates; i++) {
+		stats_[i].rate = kRates[i];
+	}
+}
+
+AVPlayer::~AVPlayer()
+{
+	Close();
+}
+
+int AVPlayer::RateIndex(int rate)
+{
+	for (int i = 0; i < kNumRates; i++) {
+		if (kRates[i] == rate) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+bool AVPlayer::Open(std::string url, void* d3d11_device, bool hw)
+{
+	if (demuxer_.IsOpened()) {
+		LOG("AVPlayer was opened.");
+		return false;
+	}
+
+	if (!demuxer_.Open(url)) {
+		return false;
+	}
+
+	AVStream* video_stream = demuxer_.GetVideoStream();
+	if (!video_stream || !decoder_.Init(video_stream, d3d11_device, hw)) {
+		demuxer_.Close();
+		return false;
+	}
+
+	// without a parser DECODE_REFERENCE falls back to AVDISCARD_NONREF alone
+	nal_parser_.Init(video_stream->codecpar);
+	max_temporal_id_ = 0;
+
+	AVRational frame_rate = video_stream->avg_frame_rate.num > 0 ? video_stream->avg_frame_rate : video_stream->r_frame_rate;
+	frame_rate_ = frame_rate.num > 0 && frame_rate.den > 0 ? av_q2d(frame_rate) : 25.0;
+
+	url_ = url;
+	d3d11_device_ = d3d11_device;
+	hw_ = hw;
+
+	packet_ = av_packet_alloc();
+	draining_ = false;
+	applied_rate_ = 0;
+	clock_pts_ = AV_NOPTS_VALUE;
+	last_pts_ = AV_NOPTS_VALUE;
+	skip_until_ = AV_NOPTS_VALUE;
+
+	std::lock_guard<std::mutex> locker(mutex_);
+	for (int i = 0; i < kNumRates; i++) {
+		stats_[i] = AVPlayerRateStats();
+		stats_[i].rate = kRates[i];
+	}
+	rate_start_ = 0;
+	demuxer_dropped_ = demuxer_.GetStats().dropped_packets;
+	return true;
+}
+
+void AVPlayer::Close()
+{
+	ClearHistory();
+	reverse_.Close();
+	demuxer_.Close();
+	decoder_.Destroy();
+	av_packet_free(&packet_);
+	draining_ = false;
+	applied_rate_ = 0;
+}
+
+bool AVPlayer::IsOpened()
+{
+	return demuxer_.IsOpened();
+}
+
+bool AVPlayer::SetRate(int rate)
+{
+	if (RateIndex(FFABS(rate)) < 0) {
+		LOG("un support rate %d.", rate);
+		return false;
+	}
+
+	rate_ = rate;
+	return true;
+}
+
+AVPlayer::DecodeMode AVPlayer::ChooseMode(int rate)
+{
+	double fps = frame_rate_ * rate;
+	double max_fps = max_decode_fps_;
+
+	if (rate == 1 || fps <= max_fps) {
+		return DECODE_ALL;
+	}
+
+	// in IBBP-like GOPs at least half of the frames are non-reference
+	if (fps <= max_fps * 3 && nal_parser_.IsSupported()) {
+		return DECODE_REFERENCE;
+	}
+
+	return DECODE_KEYFRAME;
+}
+
+void AVPlayer::ApplyRate(int rate)
+{
+	int64_t now = now_us();
+	DecodeMode mode = rate < 0 ? DECODE_REVERSE : ChooseMode(rate);
+
+	if (rate < 0 && applied_rate_ >= 0) {
+		// from the frame on screen backwards
+		if (!reverse_.Open(url_, last_pts_, d3d11_device_, hw_)) {
+			LOG("reverse playback of %s failed.", url_.c_str());
+			if (applied_rate_ != 0) {
+				rate_ = applied_rate_;
+				return;
+			}
+			// nothing applied yet, Read() needs a forward rate
+			rate_ = 1;
+			rate = 1;
+			mode = ChooseMode(rate);
+		}
+	}
+	else if (rate > 0 && applied_rate_ < 0) {
+		// continue forwards after the last frame shown in reverse
+		reverse_.Close();
+		ClearHistory();
+		if (last_pts_ != AV_NOPTS_VALUE) {
+			demuxer_.Seek(last_pts_);
+			decoder_.Flush();
+			draining_ = false;
+			skip_until_ = last_pts_;
+		}
+	}
+
+	// frames skipped or played backwards leave no history of neighbours
+	if (mode != DECODE_ALL) {
+		ClearHistory();
+	}
+
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	UpdateRateStats(now);
+
+	if (mode != DECODE_REVERSE) {
+		demuxer_.SetKeyframeOnly(mode == DECODE_KEYFRAME);
+		if (mode == DECODE_KEYFRAME) {
+			decoder_.SetSkipFrame(AVDISCARD_NONKEY);
+		}
+		else {
+			decoder_.SetSkipFrame(mode == DECODE_REFERENCE ? AVDISCARD_NONREF : AVDISCARD_DEFAULT);
+		}
+		stats_[RateIndex(rate)].mode = mode;
+	}
+
+	applied_rate_ = rate;
+	mode_ = mode;
+	rate_start_ = now;
+
+	// restart the presentation clock at the next frame
+	clock_pts_ = AV_NOPTS_VALUE;
+}
+
+bool AVPlayer::DropPacket(const AVPacket* packet)
+{
+	if (mode_ != DECODE_REFERENCE || !nal_parser_.IsSupported()) {
+		return false;
+	}
+
+	AVPacketClass packet_class = nal_parser_.Classify(packet);
+	max_temporal_id_ = FFMAX(max_temporal_id_, packet_class.temporal_id);
+
+	// HEVC sub-layer non-reference pictures are only disposable in the top layer
+	return packet_class.frame_class == FRAME_CLASS_NON_REFERENCE
+		&& packet_class.temporal_id >= max_temporal_id_;
+}
+
+int AVPlayer::DecodeFrame(AVFrame* frame)
+{
+	AVStream* video_stream = demuxer_.GetVideoStream();
+	if (!video_stream) {
+		return -1;
+	}
+
+	while (demuxer_.IsOpened()) {
+		int ret = decoder_.Recv(frame);
+		if (ret >= 0) {
+			return 0;
+		}
+
+		if (ret != AVERROR(EAGAIN) || draining_) {
+			return -1;
+		}
+
+		ret = demuxer_.Read(packet_);
+		if (ret < 0) {
+			if (demuxer_.IsEOF() || ret == -2) {
+				decoder_.Send(nullptr);
+				draining_ = true;
+			}
+			continue;
+		}
+
+		if (packet_->stream_index == video_stream->index) {
+			if (DropPacket(packet_)) {
+				std::lock_guard<std::mutex> locker(mutex_);
+				stats_[RateIndex(applied_rate_)].dropped_packets++;
+			}
+			else {
+				decoder_.Send(packet_);
+			}
+		}
+
+		av_packet_unref(packet_);
+	}
+
+	return -1;
+}
+
+void AVPlayer::WaitPresentation(AVFrame* frame)
+{
+	int64_t pts = frame->pts;
+	if (pts == AV_NOPTS_VALUE && last_pts_ != AV_NOPTS_VALUE) {
+		pts = last_pts_ + (int64_t)(1000.0 / frame_rate_);
+	}
+	if (pts == AV_NOPTS_VALUE) {
+		return;
+	}
+	last_pts_ = pts;
+
+	// media time elapsed since the clock start, in the playback direction
+	int64_t elapsed = applied_rate_ > 0 ? pts - clock_pts_ : clock_pts_ - pts;
+
+	int64_t now = now_us();
+	int64_t wait = clock_pts_ != AV_NOPTS_VALUE ? clock_time_ + elapsed * 1000 / FFABS(applied_rate_) - now : 0;
+
+	if (clock_pts_ == AV_NOPTS_VALUE || elapsed < 0 || wait < -kMaxLateness * 1000 || wait > kMaxWait * 1000) {
+		clock_time_ = now;
+		clock_pts_ = pts;
+		return;
+	}
+
+	if (wait > 0) {
+		std::this_thread::sleep_for(std::chrono::microseconds(wait));
+	}
+}
+
+int AVPlayer::Read(AVFrame* frame)
+{
+	if (!packet_) {
+		return -1;
+	}
+
+	int rate = rate_;
+	if (rate != applied_rate_) {
+		ApplyRate(rate);
+	}
+
+	if (applied_rate_ < 0) {
+		if (reverse_.Read(frame) < 0) {
+			return -1;
+		}
+
+		WaitPresentation(frame);
+		return 0;
+	}
+
+	// frames stepped back over come first
+	if (history_pos_ + 1 < (int)history_.size()) {
+		HistoryFrame(history_pos_ + 1, frame);
+		WaitPresentation(frame);
+		return 0;
+	}
+
+	if (NextFrame(frame) < 0) {
+		return -1;
+	}
+
+	// software frames are only referenced, hardware surfaces stay with the decoder
+	if (mode_ == DECODE_ALL && !frame->hw_frames_ctx) {
+		PushHistory(frame, false);
+	}
+	else {
+		ClearHistory();
+	}
+
+	int index = RateIndex(applied_rate_);
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+		stats_[index].decoded++;
+	}
+
+	WaitPresentation(frame);
+
+	std::lock_guard<std::mutex> locker(mutex_);
+	stats_[index].presented++;
+	return 0;
+}
+
+int AVPlayer::NextFrame(AVFrame* frame)
+{
+	if (DecodeFrame(frame) < 0) {
+		return -1;
+	}
+
+	// decoding restarts at the keyframe before the reverse stop point
+	while (skip_until_ != AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE && frame->pts <= skip_until_) {
+		av_frame_unref(frame);
+		if (DecodeFrame(frame) < 0) {
+			return -1;
+		}
+	}
+	skip_until_ = AV_NOPTS_VALUE;
+
+	return 0;
+}
+
+void AVPlayer::ClearHistory()
+{
+	for (AVFrame* cached : history_) {
+		av_frame_free(&cached);
+	}
+	history_.clear();
+	history_pos_ = -1;
+}
+
+// Appends a frame after the one on screen, copy_hw moves hardware frames to
+// system memory so the decoder gets its surfaces back.
+void AVPlayer::PushHistory(AVFrame* frame, bool copy_hw)
+{
+	AVFrame* cached = av_frame_alloc();
+	int ret = 0;
+	if (frame->hw_frames_ctx && copy_hw) {
+		ret = av_hwframe_transfer_data(cached, frame, 0);
+		if (ret >= 0) {
+			ret = av_frame_copy_props(cached, frame);
+		}
+	}
+	else {
+		ret = av_frame_ref(cached, frame);
+	}
+
+	if (ret < 0 || frame->pts == AV_NOPTS_VALUE) {
+		av_frame_free(&cached);
+		ClearHistory();
+		return;
+	}
+
+	// drop the frames stepped back over, they are decoded again
+	while ((int)history_.size() > history_pos_ + 1) {
+		av_frame_free(&history_.back());
+		history_.pop_back();
+	}
+
+	history_.push_back(cached);
+	while ((int)history_.size() > step_cache_size_) {
+		av_frame_free(&history_.front());
+		history_.pop_front();
+	}
+	history_pos_ = (int)history_.size() - 1;
+}
+
+int AVPlayer::HistoryFrame(int position, AVFrame* frame)
+{
+	if (position < 0 || position >= (int)history_.size()) {
+		return -1;
+	}
+
+	int ret = av_frame_ref(frame, history_[position]);
+	if (ret < 0) {
+		return -1;
+	}
+
+	history_pos_ = position;
+	last_pts_ = frame->pts;
+	return 0;
+}
+
+// Seeks to the keyframe before pts and decodes up to the frame at pts, the
+// frames before it become the history. The decoder continues after pts.
+bool AVPlayer::RedecodeBefore(int64_t pts)
+{
+	ClearHistory();
+
+	if (!demuxer_.Seek(pts - 1)) {
+		return false;
+	}
+	decoder_.Flush();
+	draining_ = false;
+	skip_until_ = AV_NOPTS_VALUE;
+
+	AVFrame* frame = av_frame_alloc();
+	bool found = false;
+	while (NextFrame(frame) >= 0) {
+		if (frame->pts != AV_NOPTS_VALUE && frame->pts >= pts) {
+			found = true;
+			PushHistory(frame, true);
+			break;
+		}
+
+		PushHistory(frame, true);
+		av_frame_unref(frame);
+	}
+	av_frame_free(&frame);
+
+	return found;
+}
+
+// Steps play at 1x without pacing from the frame on screen.
+void AVPlayer::PrepareStep()
+{
+	rate_ = 1;
+	if (applied_rate_ != 1) {
+		ApplyRate(1);
+	}
+
+	clock_pts_ = AV_NOPTS_VALUE;
+}
+
+int AVPlayer::StepForward(AVFrame* frame)
+{
+	if (!packet_) {
+		return -1;
+	}
+
+	PrepareStep();
+
+	if (history_pos_ + 1 < (int)history_.size()) {
+		step_hits_++;
+		return HistoryFrame(history_pos_ + 1, frame);
+	}
+
+	if (NextFrame(frame) < 0) {
+		return -1;
+	}
+
+	// hardware frames are copied, the shown frame is returned from the cache
+	AVFrame* decoded = av_frame_alloc();
+	av_frame_move_ref(decoded, frame);
+	PushHistory(decoded, true);
+	av_frame_free(&decoded);
+
+	if (history_.empty()) {
+		return -1;
+	}
+	return HistoryFrame((int)history_.size() - 1, frame);
+}
+
+int AVPlayer::StepBackward(AVFrame* frame)
+{
+	if (!packet_) {
+		return -1;
+	}
+
+	PrepareStep();
+
+	if (history_pos_ > 0) {
+		step_hits_++;
+		return HistoryFrame(history_pos_ - 1, frame);
+	}
+
+	int64_t pts = history_pos_ == 0 ? history_[0]->pts : last_pts_;
+	if (pts == AV_NOPTS_VALUE) {
+		return -1;
+	}
+
+	step_redecodes_++;
+	if (!RedecodeBefore(pts) || history_.size() < 2) {
+		return -1;
+	}
+
+	return HistoryFrame((int)history_.size() - 2, frame);
+}
+
+// Folds the time spent at the applied rate into its stats, mutex_ held.
+void AVPlayer::UpdateRateStats(int64_t now)
+{
+	int index = RateIndex(applied_rate_);
+	if (index < 0 || rate_start_ == 0) {
+		return;
+	}
+
+	// non-key packets dropped by the demuxer in DECODE_KEYFRAME
+	int64_t demuxer_dropped = demuxer_.GetStats().dropped_packets;
+
+	AVPlayerRateStats& stats = stats_[index];
+	stats.dropped_packets += demuxer_dropped - demuxer_dropped_;
+	demuxer_dropped_ = demuxer_dropped;
+	stats.seconds += (now - rate_start_) / 1000000.0;
+	stats.decoded_fps = stats.seconds > 0.0 ? stats.decoded / stats.seconds : 0.0;
+	rate_start_ = now;
+}
+
+AVPlayerRateStats AVPlayer::GetStats(int rate)
+{
+	int index = RateIndex(rate);
+	if (index < 0) {
+		return AVPlayerRateStats();
+	}
+
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	UpdateRateStats(now_us());
+	return stats_[index];
+}
+
+void AVPlayer::PrintStats()
+{
+	for (int i = 0; i < kNumRates; i++) {
+		AVPlayerRateStats stats = GetStats(kRates[i]);
+		if (stats.seconds <= 0.0) {
+			continue;
+		}
+
+		printf("%2dx: %-9s %.1f s, decoded %lld (%.1f fps), presented %lld, dropped %lld packets\n",
+			stats.rate, mode_name(stats.mode), stats.seconds, (long long)stats.decoded,
+			stats.decoded_fps, (long long)stats.presented, (long long)stats.dropped_packets);
+	}
+
+	if (step_hits_ + step_redecodes_ > 0) {
+		printf("steps: %lld from cache, %lld GOP re-decodes\n", (long long)step_hits_, (long long)step_redecodes_);
+	}
+
+	AVReverseStats reverse = reverse_.GetStats();
+	if (reverse.segments > 0) {
+		printf("reverse: %lld GOPs, decoded %lld (%.1f fps), cached %lld (%.1f fps), re-decoded %lld\n",
+			(long long)reverse.segments, (long long)reverse.decoded, reverse.decode_fps,
+			(long long)reverse.kept, reverse.reverse_fps, (long long)reverse.redecoded);
+	}
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <deque>
+
+#include "av_demuxer.h"
+#include "av_decoder.h"
+#include "av_nal_parser.h"
+#include "av_reverse_decoder.h"
+
+// Decoded frame rate achieved while playing at one rate.
+struct AVPlayerRateStats
+{
+	int     rate = 1;
+	int     mode = 0;          // AVPlayer::DecodeMode last used at this rate
+	int64_t decoded = 0;
+	int64_t presented = 0;
+	int64_t dropped_packets = 0; // never sent to the decoder
+	double  seconds = 0.0;
+	double  decoded_fps = 0.0;
+};
+
+// Rate-controlled playback of one file. Read() hands out the next frame at its
+// presentation time for the current rate. Past what the decoder can keep up
+// with, whole classes of frames are dropped before decoding instead of decoding
+// everything and presenting a few.
+class AVPlayer
+{
+public:
+	enum DecodeMode {
+		DECODE_ALL,
+		// non-reference packets dropped (AVNalParser) and skipped (AVDISCARD_NONREF)
+		DECODE_REFERENCE,
+		// demuxer drops non-key packets, decoder AVDISCARD_NONKEY
+		DECODE_KEYFRAME,
+		// negative rates, GOPs decoded forwards by AVReverseDecoder
+		DECODE_REVERSE,
+	};
+
+	static const int kRates[];
+	static const int kNumRates = 5;
+
+	AVPlayer& operator=(const AVPlayer&) = delete;
+	AVPlayer(const AVPlayer&) = delete;
+	AVPlayer();
+	virtual ~AVPlayer();
+
+	virtual bool Open(std::string url, void* d3d11_device, bool hw);
+	virtual void Close();
+	virtual bool IsOpened();
+
+	// Blocks until the next frame is due. 0 on success, -1 at the end.
+	virtual int  Read(AVFrame* frame);
+
+	// 1, 2, 4, 8 or 16, negative plays backwards from the last frame read.
+	// Takes effect at the next Read().
+	bool SetRate(int rate);
+	int  GetRate() { return rate_; }
+	DecodeMode GetDecodeMode() { return (DecodeMode)(int)mode_; }
+
+	// Frames per second the decoder is expected to sustain, picks the mode.
+	void SetMaxDecodeFps(double fps) { max_decode_fps_ = fps; }
+
+	AVStream* GetVideoStream() { return demuxer_.GetVideoStream(); }
+
+	// Single frames, no pacing; playback continues at 1x from there. A step
+	// forward keeps decoding, a step back is served from the recently shown
+	// frames and otherwise re-decodes the GOP. 0 on success, -1 at either end.
+	int  StepForward(AVFrame* frame);
+	int  StepBackward(AVFrame* frame);
+	void SetStepCache(int frames) { step_cache_size_ = frames > 1 ? frames : 1; }
+
+	// Frames cached for reverse playback, see AVReverseDecoder::SetFrameBudget().
+	void SetReverseFrameBudget(int frames) { reverse_.SetFrameBudget(frames); }
+
+	// Forward rates only, reverse throughput is in GetReverseStats().
+	AVPlayerRateStats GetStats(int rate);
+	AVReverseStats GetReverseStats() { return reverse_.GetStats(); }
+	void PrintStats();
+
+private:
+	DecodeMode ChooseMode(int rate);
+	void ApplyRate(int rate);
+	bool DropPacket(const AVPacket* packet);
+	int  DecodeFrame(AVFrame* frame);
+	int  NextFrame(AVFrame* frame);
+	void PushHistory(AVFrame* frame, bool copy_hw);
+	int  HistoryFrame(int position, AVFrame* frame);
+	bool RedecodeBefore(int64_t pts);
+	void ClearHistory();
+	void PrepareStep();
+	void WaitPresentation(AVFrame* frame);
+	void UpdateRateStats(int64_t now);
+	static int RateIndex(int rate);
+
+private:
+	std::mutex mutex_;
+
+	std::string url_;
+	void* d3d11_device_ = nullptr;
+	bool hw_ = false;
+
+	AVDemuxer demuxer_;
+	AVDecoder decoder_;
+	AVReverseDecoder reverse_;
+	AVNalParser nal_parser_;
+	AVPacket* packet_ = nullptr;
+	bool draining_ = false;
+	double frame_rate_ = 25.0;
+	int max_temporal_id_ = 0;
+
+	std::atomic<int> rate_{ 1 };
+	std::atomic<int> mode_{ DECODE_ALL };
+	std::atomic<double> max_decode_fps_{ 120.0 };
+	int applied_rate_ = 0;
+
+	// presentation clock, rebased on rate changes and late frames
+	int64_t clock_time_ = 0;  // us
+	int64_t clock_pts_ = AV_NOPTS_VALUE; // ms
+	int64_t last_pts_ = AV_NOPTS_VALUE;
+	int64_t skip_until_ = AV_NOPTS_VALUE; // back to forward play, frames already shown
+
+	// recently shown frames in pts order, history_[history_pos_] is on screen;
+	// frames after it were stepped back over and are shown again before decoding
+	std::deque<AVFrame*> history_;
+	int history_pos_ = -1;
+	int step_cache_size_ = 16;
+	int64_t step_hits_ = 0;
+	int64_t step_redecodes_ = 0;
+
+	int64_t rate_start_ = 0;  // us
+	int64_t demuxer_dropped_ = 0;
+	AVPlayerRateStats stats_[kNumRates];
+};
@@ -0,0 +1,206 @@
+#include "av_playlist.h"
+#include "av_log.h"
+
+#include <chrono>
+
+static int64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+AVPlaylist::Item::~Item()
+{
+	av_frame_free(&first_frame);
+	av_packet_free(&packet);
+}
+
+AVPlaylist::AVPlaylist()
+{
+
+}
+
+AVPlaylist::~AVPlaylist()
+{
+	Close();
+}
+
+void AVPlaylist::Add(std::string url)
+{
+	urls_.push_back(url);
+}
+
+bool AVPlaylist::Open(void* d3d11_device, bool hw)
+{
+	if (current_) {
+		LOG("AVPlaylist was opened.");
+		return false;
+	}
+
+	d3d11_device_ = d3d11_device;
+	hw_ = hw;
+	abort_ = false;
+
+	current_ = OpenItem(0);
+	if (!current_) {
+		LOG("no playable item in playlist.");
+		return false;
+	}
+
+	current_index_ = current_->index;
+	last_frame_time_ = 0;
+	StartPreload(NextIndex(current_->index));
+	return true;
+}
+
+void AVPlaylist::Close()
+{
+	abort_ = true;
+	if (preload_thread_.joinable()) {
+		preload_thread_.join();
+	}
+
+	current_.reset();
+	next_.reset();
+	retired_.reset();
+	current_index_ = -1;
+	abort_ = false;
+}
+
+AVStream* AVPlaylist::GetVideoStream()
+{
+	return current_ ? current_->demuxer.GetVideoStream() : nullptr;
+}
+
+int AVPlaylist::NextIndex(int index)
+{
+	if (index + 1 < (int)urls_.size()) {
+		return index + 1;
+	}
+
+	return loop_ && !urls_.empty() ? 0 : -1;
+}
+
+std::unique_ptr<AVPlaylist::Item> AVPlaylist::OpenItem(int index)
+{
+	// skip broken items, at most one pass over the list
+	for (size_t tries = 0; index >= 0 && tries < urls_.size() && !abort_; tries++) {
+		std::unique_ptr<Item> item(new Item());
+		item->index = index;
+
+		if (item->demuxer.Open(urls_[index])
+			&& item->decoder.Init(item->demuxer.GetVideoStream(), d3d11_device_, hw_)) {
+			item->packet = av_packet_alloc();
+			item->first_frame = av_frame_alloc();
+
+			// prime the decoder, the first frame is ready before the switch
+			if (DecodeFrame(item.get(), item->first_frame) == 0) {
+				return item;
+			}
+		}
+
+		LOG("skip playlist item %s.", urls_[index].c_str());
+		index = NextIndex(index);
+	}
+
+	return nullptr;
+}
+
+void AVPlaylist::StartPreload(int index)
+{
+	if (preload_thread_.joinable()) {
+		preload_thread_.join();
+	}
+
+	// closing the finished item is also kept off the playback thread
+	preload_thread_ = std::thread([this, index]() {
+		retired_.reset();
+
+		std::unique_ptr<Item> item = OpenItem(index);
+
+		std::lock_guard<std::mutex> locker(mutex_);
+		next_ = std::move(item);
+	});
+}
+
+int AVPlaylist::DecodeFrame(Item* item, AVFrame* frame)
+{
+	AVStream* video_stream = item->demuxer.GetVideoStream();
+
+	while (!abort_) {
+		int ret = item->decoder.Recv(frame);
+		if (ret >= 0) {
+			return 0;
+		}
+
+		if (ret != AVERROR(EAGAIN) || item->draining) {
+			return -1;
+		}
+
+		ret = item->demuxer.Read(item->packet);
+		if (ret < 0) {
+			if (item->demuxer.IsEOF() || ret == -2) {
+				// flush the frames still buffered in the decoder
+				item->decoder.Send(nullptr);
+				item->draining = true;
+			}
+			continue;
+		}
+
+		if (item->packet->stream_index == video_stream->index) {
+			item->decoder.Send(item->packet);
+		}
+
+		av_packet_unref(item->packet);
+	}
+
+	return -1;
+}
+
+int AVPlaylist::Read(AVFrame* frame)
+{
+	if (!current_) {
+		return -1;
+	}
+
+	if (current_->first_frame->buf[0]) {
+		av_frame_move_ref(frame, current_->first_frame);
+		last_frame_time_ = now_us();
+		return 0;
+	}
+
+	if (DecodeFrame(current_.get(), frame) == 0) {
+		last_frame_time_ = now_us();
+		return 0;
+	}
+
+	// end of item, the next one is normally preloaded long before
+	if (preload_thread_.joinable()) {
+		preload_thread_.join();
+	}
+
+	std::unique_ptr<Item> next;
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+		next = std::move(next_);
+	}
+
+	if (!next) {
+		return -1;
+	}
+
+	retired_ = std::move(current_);
+	current_ = std::move(next);
+	current_index_ = current_->index;
+	StartPreload(NextIndex(current_->index));
+
+	av_frame_move_ref(frame, current_->first_frame);
+
+	int64_t now = now_us();
+	if (last_frame_time_ != 0) {
+		last_switch_gap_ = (now - last_frame_time_) / 1000.0;
+	}
+	last_frame_time_ = now;
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <atomic>
+
+#include "av_demuxer.h"
+#include "av_decoder.h"
+
+// Gapless playlist. While one item plays, a worker opens the next item's
+// demuxer and decoder and decodes its first frame, so switching items only
+// swaps pointers.
+class AVPlaylist
+{
+public:
+	AVPlaylist& operator=(const AVPlaylist&) = delete;
+	AVPlaylist(const AVPlaylist&) = delete;
+	AVPlaylist();
+	virtual ~AVPlaylist();
+
+	void Add(std::string url);
+	void SetLoop(bool loop) { loop_ = loop; }
+
+	virtual bool Open(void* d3d11_device, bool hw);
+	virtual void Close();
+
+	// Next video frame, moving on to the next item at the end of the current one.
+	// Returns -1 once the playlist is finished.
+	virtual int  Read(AVFrame* frame);
+
+	int GetCurrentIndex() { return current_index_; }
+	AVStream* GetVideoStream();
+
+	// Time between the last frame of one item and the first frame of the next, ms.
+	double GetLastSwitchGap() { return last_switch_gap_; }
+
+private:
+	struct Item {
+		int index = -1;
+		AVDemuxer demuxer;
+		AVDecoder decoder;
+		AVPacket* packet = nullptr;
+		AVFrame* first_frame = nullptr;
+		bool draining = false;
+
+		~Item();
+	};
+
+	std::unique_ptr<Item> OpenItem(int index);
+	int  DecodeFrame(Item* item, AVFrame* frame);
+	int  NextIndex(int index);
+	void StartPreload(int index);
+
+private:
+	std::mutex mutex_;
+	std::thread preload_thread_;
+
+	std::vector<std::string> urls_;
+	void* d3d11_device_ = nullptr;
+	bool hw_ = false;
+	bool loop_ = false;
+
+	std::unique_ptr<Item> current_;
+	std::unique_ptr<Item> next_;
+	std::unique_ptr<Item> retired_;
+
+	std::atomic<int> current_index_{ -1 };
+	std::atomic<bool> abort_{ false };
+
+	int64_t last_frame_time_ = 0;
+	std::atomic<double> last_switch_gap_{ 0.0 };
+};
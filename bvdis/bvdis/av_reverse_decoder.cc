@@ -0,0 +1,290 @@
+#include "av_reverse_decoder.h"
+#include "av_log.h"
+
+#include <chrono>
+
+// first step back when a seek lands on the keyframe at end_ms itself, ms
+static const int64_t kSeekStep = 1000;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+AVReverseDecoder::Segment::~Segment()
+{
+	for (AVFrame* frame : frames) {
+		av_frame_free(&frame);
+	}
+}
+
+AVReverseDecoder::AVReverseDecoder()
+{
+
+}
+
+AVReverseDecoder::~AVReverseDecoder()
+{
+	Close();
+}
+
+bool AVReverseDecoder::Open(std::string url, int64_t end_ms, void* d3d11_device, bool hw)
+{
+	if (worker_.joinable()) {
+		LOG("AVReverseDecoder was opened.");
+		return false;
+	}
+
+	if (!demuxer_.Open(url)) {
+		return false;
+	}
+
+	AVStream* video_stream = demuxer_.GetVideoStream();
+	if (!video_stream || !decoder_.Init(video_stream, d3d11_device, hw)) {
+		demuxer_.Close();
+		return false;
+	}
+
+	AVFormatContext* format_context = demuxer_.GetFormatContext();
+	origin_ms_ = format_context->start_time != AV_NOPTS_VALUE ? av_rescale(format_context->start_time, 1000, AV_TIME_BASE) : 0;
+	if (end_ms == AV_NOPTS_VALUE) {
+		// one past the last frame
+		end_ms = format_context->duration != AV_NOPTS_VALUE
+			? origin_ms_ + av_rescale(format_context->duration, 1000, AV_TIME_BASE) + 1
+			: INT64_MAX;
+	}
+
+	packet_ = av_packet_alloc();
+	frame_ = av_frame_alloc();
+	end_ms_ = end_ms;
+	finished_ = false;
+	abort_ = false;
+	stats_ = AVReverseStats();
+
+	worker_ = std::thread([this]() {
+		Worker();
+	});
+
+	return true;
+}
+
+void AVReverseDecoder::Close()
+{
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_all();
+
+	// unblocks a pending read or seek
+	demuxer_.Close();
+	if (worker_.joinable()) {
+		worker_.join();
+	}
+
+	decoder_.Destroy();
+	av_packet_free(&packet_);
+	av_frame_free(&frame_);
+
+	current_.reset();
+	ready_.clear();
+	finished_ = false;
+}
+
+bool AVReverseDecoder::IsOpened()
+{
+	return worker_.joinable();
+}
+
+void AVReverseDecoder::Worker()
+{
+	int64_t end_ms = end_ms_;
+
+	while (!abort_) {
+		{
+			// one segment presented, one prefetched
+			std::unique_lock<std::mutex> locker(mutex_);
+			cond_.wait(locker, [this]() { return abort_ || ready_.empty(); });
+			if (abort_) {
+				break;
+			}
+		}
+
+		auto begin = std::chrono::steady_clock::now();
+
+		std::unique_ptr<Segment> segment(new Segment());
+		bool ok = DecodeSegment(end_ms, segment.get());
+
+		std::lock_guard<std::mutex> locker(mutex_);
+		stats_.decode_seconds += seconds_since(begin);
+
+		if (!ok || segment->frames.empty()) {
+			// the start of the file, or nothing decodable before it
+			finished_ = true;
+			cond_.notify_all();
+			break;
+		}
+
+		stats_.segments++;
+		end_ms = segment->frames.front()->pts;
+		ready_.push_back(std::move(segment));
+		cond_.notify_all();
+	}
+}
+
+// Caches the frames with pts < end_ms of the GOP before end_ms, at most half
+// the budget; earlier frames of a longer GOP are left for the next pass.
+bool AVReverseDecoder::DecodeSegment(int64_t end_ms, Segment* segment)
+{
+	AVStream* video_stream = demuxer_.GetVideoStream();
+	if (!video_stream) {
+		return false;
+	}
+
+	int64_t step = 0;
+	while (!abort_) {
+		int64_t seek_ms = end_ms == INT64_MAX ? INT64_MAX / 2000 : FFMAX(end_ms - 1 - step, origin_ms_);
+		if (!demuxer_.Seek(seek_ms)) {
+			return false;
+		}
+		decoder_.Flush();
+
+		bool draining = false;
+		bool done = false;
+		while (!abort_ && !done) {
+			int ret = decoder_.Recv(frame_);
+			if (ret >= 0) {
+				done = !KeepFrame(frame_, end_ms, segment);
+				continue;
+			}
+
+			if (ret != AVERROR(EAGAIN) || draining) {
+				break;
+			}
+
+			ret = demuxer_.Read(packet_);
+			if (ret < 0) {
+				if (demuxer_.IsEOF() || ret == -2) {
+					decoder_.Send(nullptr);
+					draining = true;
+				}
+				else if (ret == -3) {
+					return false;
+				}
+				continue;
+			}
+
+			if (packet_->stream_index == video_stream->index) {
+				decoder_.Send(packet_);
+			}
+			av_packet_unref(packet_);
+		}
+
+		if (!segment->frames.empty()) {
+			return true;
+		}
+
+		// the seek landed on the keyframe at end_ms, look further back
+		if (end_ms == INT64_MAX || seek_ms == origin_ms_) {
+			return false;
+		}
+		step = step ? step * 2 : kSeekStep;
+	}
+
+	return false;
+}
+
+// false once the frame reaches end_ms, the rest of the GOP belongs to the
+// segment already handed out
+bool AVReverseDecoder::KeepFrame(AVFrame* frame, int64_t end_ms, Segment* segment)
+{
+	if (frame->pts != AV_NOPTS_VALUE && frame->pts >= end_ms) {
+		av_frame_unref(frame);
+
+		std::lock_guard<std::mutex> locker(mutex_);
+		stats_.decoded++;
+		return false;
+	}
+
+	AVFrame* cached = av_frame_alloc();
+	if (frame->hw_frames_ctx) {
+		if (av_hwframe_transfer_data(cached, frame, 0) < 0) {
+			av_frame_free(&cached);
+		}
+		else {
+			av_frame_copy_props(cached, frame);
+		}
+		av_frame_unref(frame);
+	}
+	else {
+		av_frame_move_ref(cached, frame);
+	}
+
+	std::lock_guard<std::mutex> locker(mutex_);
+	stats_.decoded++;
+
+	if (!cached) {
+		return true;
+	}
+
+	// frames without pts follow the previous one, the segment start needs one
+	if (cached->pts == AV_NOPTS_VALUE) {
+		if (segment->frames.empty()) {
+			av_frame_free(&cached);
+			return true;
+		}
+		cached->pts = segment->frames.back()->pts + 1;
+	}
+
+	size_t max_frames = (size_t)FFMAX(frame_budget_ / 2, 1);
+	if (segment->frames.size() >= max_frames) {
+		av_frame_free(&segment->frames.front());
+		segment->frames.erase(segment->frames.begin());
+		stats_.kept--;
+		stats_.redecoded++;
+	}
+
+	segment->frames.push_back(cached);
+	stats_.kept++;
+	return true;
+}
+
+int AVReverseDecoder::Read(AVFrame* frame)
+{
+	std::unique_lock<std::mutex> locker(mutex_);
+
+	while (!current_ || current_->frames.empty()) {
+		if (!ready_.empty()) {
+			current_ = std::move(ready_.front());
+			ready_.pop_front();
+			cond_.notify_all();
+			continue;
+		}
+
+		if (finished_ || abort_ || !worker_.joinable()) {
+			return -1;
+		}
+
+		cond_.wait(locker);
+	}
+
+	AVFrame* last = current_->frames.back();
+	current_->frames.pop_back();
+	av_frame_move_ref(frame, last);
+	av_frame_free(&last);
+	return 0;
+}
+
+AVReverseStats AVReverseDecoder::GetStats()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	AVReverseStats stats = stats_;
+	stats.cached = current_ ? (int)current_->frames.size() : 0;
+	for (auto& segment : ready_) {
+		stats.cached += (int)segment->frames.size();
+	}
+	stats.decode_fps = stats.decode_seconds > 0.0 ? stats.decoded / stats.decode_seconds : 0.0;
+	stats.reverse_fps = stats.decode_seconds > 0.0 ? stats.kept / stats.decode_seconds : 0.0;
+	return stats;
+}
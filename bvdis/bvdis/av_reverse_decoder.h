@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <atomic>
+
+#include "av_demuxer.h"
+#include "av_decoder.h"
+
+struct AVReverseStats
+{
+	int64_t segments = 0;     // decoded GOPs (or parts of GOPs)
+	int64_t decoded = 0;      // frames out of the decoder
+	int64_t kept = 0;         // frames cached for presentation
+	int64_t redecoded = 0;    // frames dropped by the budget, decoded again later
+	int     cached = 0;       // frames currently held
+	double  decode_seconds = 0.0;
+	double  decode_fps = 0.0; // decoded / decode_seconds
+	double  reverse_fps = 0.0; // kept / decode_seconds, sustainable reverse rate
+};
+
+// Frames of a file in descending pts order. Decoders only run forwards, so a
+// worker seeks to the keyframe before the current position, decodes that GOP
+// into a cache and the cache is handed out backwards while the worker decodes
+// the GOP before it. Has its own demuxer and decoder.
+class AVReverseDecoder
+{
+public:
+	AVReverseDecoder& operator=(const AVReverseDecoder&) = delete;
+	AVReverseDecoder(const AVReverseDecoder&) = delete;
+	AVReverseDecoder();
+	virtual ~AVReverseDecoder();
+
+	// Starts with the last frame before end_ms (Read() timestamp domain),
+	// AV_NOPTS_VALUE for the end of the file. Hardware frames are copied to
+	// system memory, a GOP would not fit the decoder's surface pool.
+	virtual bool Open(std::string url, int64_t end_ms, void* d3d11_device, bool hw);
+	virtual void Close();
+	virtual bool IsOpened();
+
+	// Previous frame, blocks while its GOP decodes. -1 at the start of the file.
+	virtual int  Read(AVFrame* frame);
+
+	// Frames held at once across the presented and the prefetched segment,
+	// longer GOPs are decoded in several passes. Set before Open().
+	void SetFrameBudget(int frames) { frame_budget_ = frames > 2 ? frames : 2; }
+
+	AVReverseStats GetStats();
+
+private:
+	struct Segment {
+		std::vector<AVFrame*> frames; // ascending pts
+		~Segment();
+	};
+
+	void Worker();
+	bool DecodeSegment(int64_t end_ms, Segment* segment);
+	bool KeepFrame(AVFrame* frame, int64_t end_ms, Segment* segment);
+
+private:
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::thread worker_;
+
+	AVDemuxer demuxer_;
+	AVDecoder decoder_;
+	AVPacket* packet_ = nullptr;
+	AVFrame* frame_ = nullptr;
+	int64_t origin_ms_ = 0;
+	int64_t end_ms_ = AV_NOPTS_VALUE;
+	int frame_budget_ = 120;
+
+	std::unique_ptr<Segment> current_;
+	std::deque<std::unique_ptr<Segment>> ready_;
+	bool finished_ = false;
+	std::atomic<bool> abort_{ false };
+
+	AVReverseStats stats_;
+};
@@ -0,0 +1,179 @@
+#include "av_scene_detector.h"
+
+#include <chrono>
+#include <string.h>
+
+extern "C" {
+#include "libavutil/pixdesc.h"
+}
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define AV_SCENE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// thumbnail cell, and the rows of it that are read
+static const int kCellSize = 8;
+static const int kSampleRow0 = 2;
+static const int kSampleRow1 = 6;
+
+static int64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t sad_bytes(const uint8_t* a, const uint8_t* b, size_t size)
+{
+	uint64_t sad = 0;
+#ifdef AV_SCENE_SSE2
+	__m128i acc = _mm_setzero_si128();
+	while (size >= 16) {
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b)));
+		a += 16;
+		b += 16;
+		size -= 16;
+	}
+	sad = (uint64_t)_mm_cvtsi128_si32(acc) + (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+	while (size--) {
+		int d = (int)*a++ - (int)*b++;
+		sad += d < 0 ? -d : d;
+	}
+	return sad;
+}
+
+AVSceneDetector::AVSceneDetector()
+{
+	Reset();
+}
+
+AVSceneDetector::~AVSceneDetector()
+{
+
+}
+
+void AVSceneDetector::Reset()
+{
+	has_previous_ = false;
+	last_cut_pts_ = AV_NOPTS_VALUE;
+	memset(histogram_, 0, sizeof(histogram_));
+	memset(previous_histogram_, 0, sizeof(previous_histogram_));
+}
+
+// Mean of each 8x8 cell from rows 2 and 6, 16 pixels per cell. The right
+// edge past a multiple of 16 pixels is left out.
+bool AVSceneDetector::Downsample(const AVFrame* frame)
+{
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+	if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL)) ||
+		desc->comp[0].depth != 8 || desc->comp[0].step != 1 || !frame->data[0]) {
+		return false;
+	}
+
+	int width = frame->width / 16 * 16;
+	int cells_x = width / kCellSize;
+	int cells_y = frame->height / kCellSize;
+	if (cells_x <= 0 || cells_y <= 0) {
+		return false;
+	}
+
+	thumbnail_.resize((size_t)cells_x * cells_y);
+
+	for (int cy = 0; cy < cells_y; cy++) {
+		const uint8_t* row0 = frame->data[0] + (ptrdiff_t)(cy * kCellSize + kSampleRow0) * frame->linesize[0];
+		const uint8_t* row1 = frame->data[0] + (ptrdiff_t)(cy * kCellSize + kSampleRow1) * frame->linesize[0];
+		uint8_t* out = &thumbnail_[(size_t)cy * cells_x];
+
+#ifdef AV_SCENE_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		for (int x = 0; x < width; x += 16) {
+			// two sums of 8 pixels per row, one per cell
+			__m128i sums = _mm_add_epi64(
+				_mm_sad_epu8(_mm_loadu_si128((const __m128i*)(row0 + x)), zero),
+				_mm_sad_epu8(_mm_loadu_si128((const __m128i*)(row1 + x)), zero));
+			*out++ = (uint8_t)((_mm_cvtsi128_si32(sums) + 8) >> 4);
+			*out++ = (uint8_t)((_mm_cvtsi128_si32(_mm_srli_si128(sums, 8)) + 8) >> 4);
+		}
+#else
+		for (int x = 0; x < width; x += kCellSize) {
+			int sum = 0;
+			for (int i = 0; i < kCellSize; i++) {
+				sum += row0[x + i] + row1[x + i];
+			}
+			*out++ = (uint8_t)((sum + 8) >> 4);
+		}
+#endif
+	}
+
+	return true;
+}
+
+bool AVSceneDetector::Process(const AVFrame* frame, AVSceneChange* change)
+{
+	int64_t begin = now_us();
+
+	if (!Downsample(frame)) {
+		return false;
+	}
+
+	int64_t index = frames_++;
+
+	memset(histogram_, 0, sizeof(histogram_));
+	for (uint8_t value : thumbnail_) {
+		histogram_[value >> 2]++;
+	}
+
+	bool cut = false;
+	if (has_previous_ && previous_.size() == thumbnail_.size()) {
+		size_t count = thumbnail_.size();
+
+		uint64_t distance = 0;
+		for (int i = 0; i < kBins; i++) {
+			distance += histogram_[i] > previous_histogram_[i] ? histogram_[i] - previous_histogram_[i] : previous_histogram_[i] - histogram_[i];
+		}
+		double histogram_diff = distance / (2.0 * count);
+		double sad = sad_bytes(thumbnail_.data(), previous_.data(), count) / (255.0 * count);
+
+		if (histogram_diff >= histogram_threshold_ && sad >= sad_threshold_) {
+			cut = last_cut_pts_ == AV_NOPTS_VALUE || frame->pts == AV_NOPTS_VALUE ||
+				frame->pts - last_cut_pts_ >= min_interval_ms_;
+		}
+
+		if (cut) {
+			last_cut_pts_ = frame->pts;
+			scene_changes_++;
+
+			if (change) {
+				change->pts = frame->pts;
+				change->frame_index = index;
+				change->histogram_diff = histogram_diff;
+				change->sad = sad;
+			}
+		}
+	}
+
+	thumbnail_.swap(previous_);
+	memcpy(previous_histogram_, histogram_, sizeof(histogram_));
+	has_previous_ = true;
+
+	int64_t elapsed = now_us() - begin;
+	total_us_ += elapsed;
+	if (elapsed > max_us_) {
+		max_us_ = elapsed;
+	}
+
+	return cut;
+}
+
+AVSceneDetectorStats AVSceneDetector::GetStats()
+{
+	AVSceneDetectorStats stats;
+	stats.frames = frames_;
+	stats.scene_changes = scene_changes_;
+	stats.max_us = (double)max_us_;
+	if (stats.frames > 0) {
+		stats.avg_us = (double)total_us_ / stats.frames;
+	}
+	return stats;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+
+extern "C" {
+#include "libavutil/frame.h"
+}
+
+struct AVSceneChange
+{
+	int64_t pts = AV_NOPTS_VALUE; // ms, first frame of the new scene
+	int64_t frame_index = 0;
+	double  histogram_diff = 0.0; // 0..1, half the L1 distance of the normalized histograms
+	double  sad = 0.0;            // 0..1, mean absolute difference / 255
+};
+
+struct AVSceneDetectorStats
+{
+	int64_t frames = 0;
+	int64_t scene_changes = 0;
+	double  avg_us = 0.0;         // per frame
+	double  max_us = 0.0;
+};
+
+// Scene cuts from decoded luma. Each frame is reduced to a thumbnail of 8x8
+// block means (two of the eight rows sampled, summed 8 pixels at a time with
+// _mm_sad_epu8), then compared with the previous thumbnail by histogram and
+// SAD. A cut needs both: the histogram keeps motion and pans within a shot out
+// (high SAD, same content), the SAD keeps small global brightness shifts out
+// (values cross histogram bins, pixels barely change). Flashes raise both and
+// are reported as cuts; the minimum interval only limits how often.
+class AVSceneDetector
+{
+public:
+	AVSceneDetector& operator=(const AVSceneDetector&) = delete;
+	AVSceneDetector(const AVSceneDetector&) = delete;
+	AVSceneDetector();
+	virtual ~AVSceneDetector();
+
+	// True when frame starts a new scene, the event goes to change if given.
+	// Frames without an 8-bit luma plane (hardware frames) are skipped.
+	bool Process(const AVFrame* frame, AVSceneChange* change = nullptr);
+	void Reset();
+
+	// Both must be exceeded. Defaults 0.4 and 0.1.
+	void SetThresholds(double histogram_diff, double sad) { histogram_threshold_ = histogram_diff; sad_threshold_ = sad; }
+	// Cuts closer than this to the previous one are ignored, default 500 ms.
+	void SetMinInterval(int64_t ms) { min_interval_ms_ = ms; }
+
+	AVSceneDetectorStats GetStats();
+
+private:
+	bool Downsample(const AVFrame* frame);
+
+private:
+	static const int kBins = 64;
+
+	std::vector<uint8_t> thumbnail_;
+	std::vector<uint8_t> previous_;
+	uint32_t histogram_[kBins];
+	uint32_t previous_histogram_[kBins];
+	bool has_previous_ = false;
+
+	double histogram_threshold_ = 0.4;
+	double sad_threshold_ = 0.1;
+	int64_t min_interval_ms_ = 500;
+	int64_t last_cut_pts_ = AV_NOPTS_VALUE;
+
+	std::atomic<int64_t> frames_{ 0 };
+	std::atomic<int64_t> scene_changes_{ 0 };
+	std::atomic<int64_t> total_us_{ 0 };
+	std::atomic<int64_t> max_us_{ 0 };
+};
@@ -0,0 +1,426 @@
+#include "av_sharded_decoder.h"
+#include "av_log.h"
+
+#include <chrono>
+#include <algorithm>
+
+// ranges per worker, more and smaller ranges even out GOPs of different cost
+static const int kRangesPerWorker = 4;
+
+static int64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+AVShardedDecoder::AVShardedDecoder()
+{
+
+}
+
+AVShardedDecoder::~AVShardedDecoder()
+{
+	Close();
+}
+
+bool AVShardedDecoder::Open(std::string url, int workers)
+{
+	if (is_opened_) {
+		LOG("AVShardedDecoder was opened.");
+		return false;
+	}
+
+	if (!demuxer_.Open(url)) {
+		return false;
+	}
+
+	if (!demuxer_.GetVideoStream()) {
+		LOG("%s has no video stream.", url.c_str());
+		demuxer_.Close();
+		return false;
+	}
+
+	url_ = url;
+	stats_ = AVShardStats();
+
+	int64_t begin = now_us();
+	std::vector<int64_t> keyframes;
+	if (!BuildIndex(&keyframes)) {
+		LOG("no keyframes in %s.", url.c_str());
+		demuxer_.Close();
+		return false;
+	}
+	stats_.index_seconds = (now_us() - begin) / 1000000.0;
+	stats_.keyframes = keyframes.size();
+
+	if (workers <= 0) {
+		workers = (int)std::thread::hardware_concurrency();
+	}
+	BuildRanges(keyframes, std::max(1, workers));
+	workers = std::max(1, std::min(workers, (int)ranges_.size()));
+
+	next_range_ = 0;
+	out_range_ = 0;
+	buffered_ = 0;
+	abort_ = false;
+	decoded_ = 0;
+	active_workers_ = workers;
+	stats_.workers = workers;
+	stats_.ranges = (int)ranges_.size();
+
+	start_time_ = now_us();
+	is_opened_ = true;
+	for (int i = 0; i < workers; i++) {
+		workers_.emplace_back(&AVShardedDecoder::WorkerThread, this);
+	}
+
+	return true;
+}
+
+void AVShardedDecoder::Close()
+{
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_all();
+
+	for (std::thread& worker : workers_) {
+		worker.join();
+	}
+	workers_.clear();
+
+	for (Range& range : ranges_) {
+		for (AVFrame* frame : range.frames) {
+			av_frame_free(&frame);
+		}
+	}
+	ranges_.clear();
+	buffered_ = 0;
+
+	demuxer_.Close();
+	is_opened_ = false;
+}
+
+bool AVShardedDecoder::IsOpened()
+{
+	return is_opened_;
+}
+
+// Keyframe timestamps in the Read() domain (dts, pts when there is none). The
+// container index when it covers the whole file (MP4, MKV cues), otherwise one
+// pass over the file with only keyframes passed up by the demuxer.
+bool AVShardedDecoder::BuildIndex(std::vector<int64_t>* keyframes)
+{
+	AVStream* video_stream = demuxer_.GetVideoStream();
+	double time_base = av_q2d(video_stream->time_base);
+
+	for (int i = 0; i < video_stream->nb_index_entries; i++) {
+		const AVIndexEntry& entry = video_stream->index_entries[i];
+		if (entry.flags & AVINDEX_KEYFRAME) {
+			keyframes->push_back((int64_t)(entry.timestamp * (1000 * time_base)));
+		}
+	}
+
+	if (!keyframes->empty() && !IndexCoversFile(*keyframes)) {
+		LOG("index of %s ends at %lld ms, scanning for keyframes.\n", url_.c_str(), (long long)keyframes->back());
+		keyframes->clear();
+	}
+	stats_.from_index = !keyframes->empty();
+
+	if (keyframes->empty()) {
+		AVPacket* packet = av_packet_alloc();
+		if (!packet) {
+			return false;
+		}
+
+		demuxer_.SetKeyframeOnly(true);
+		int ret = 0;
+		while ((ret = demuxer_.Read(packet)) != -1 && ret != -2) {
+			if (ret == 0) {
+				if (packet->stream_index == video_stream->index && (packet->flags & AV_PKT_FLAG_KEY)) {
+					keyframes->push_back(packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts);
+				}
+				av_packet_unref(packet);
+			}
+		}
+		demuxer_.SetKeyframeOnly(false);
+
+		av_packet_free(&packet);
+	}
+
+	std::sort(keyframes->begin(), keyframes->end());
+	keyframes->erase(std::unique(keyframes->begin(), keyframes->end()), keyframes->end());
+	keyframes->erase(std::remove(keyframes->begin(), keyframes->end(), (int64_t)AV_NOPTS_VALUE), keyframes->end());
+	return !keyframes->empty();
+}
+
+// Generic indexes (raw H.264/HEVC, MPEG-TS) and fragmented MP4 only hold what
+// avformat_find_stream_info read. The last keyframe has to be within two of
+// the longest GOPs, or 5% of the duration, of the end; unknown duration fails.
+bool AVShardedDecoder::IndexCoversFile(const std::vector<int64_t>& keyframes)
+{
+	AVFormatContext* format_context = demuxer_.GetFormatContext();
+	if (format_context->duration <= 0) {
+		return false;
+	}
+
+	int64_t origin_ms = format_context->start_time != AV_NOPTS_VALUE ? av_rescale(format_context->start_time, 1000, AV_TIME_BASE) : 0;
+	int64_t duration_ms = av_rescale(format_context->duration, 1000, AV_TIME_BASE);
+
+	std::vector<int64_t> sorted = keyframes;
+	std::sort(sorted.begin(), sorted.end());
+
+	int64_t max_gap = 0;
+	for (size_t i = 1; i < sorted.size(); i++) {
+		max_gap = std::max(max_gap, sorted[i] - sorted[i - 1]);
+	}
+
+	int64_t tolerance = std::max(2 * max_gap, duration_ms / 20);
+	return sorted.back() + tolerance >= origin_ms + duration_ms;
+}
+
+void AVShardedDecoder::BuildRanges(const std::vector<int64_t>& keyframes, int workers)
+{
+	// half the shortest GOP, well above any reorder delay
+	int64_t min_gap = INT64_MAX;
+	for (size_t i = 1; i < keyframes.size(); i++) {
+		min_gap = std::min(min_gap, keyframes[i] - keyframes[i - 1]);
+	}
+	slack_ms_ = min_gap != INT64_MAX ? std::max<int64_t>(min_gap / 2, 1) : 1;
+
+	size_t count = std::min(keyframes.size(), (size_t)workers * kRangesPerWorker);
+	ranges_.clear();
+	ranges_.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		size_t first = i * keyframes.size() / count;
+		size_t next = (i + 1) * keyframes.size() / count;
+
+		ranges_[i].start_ms = keyframes[first];
+		ranges_[i].end_ms = next < keyframes.size() ? keyframes[next] : INT64_MAX;
+	}
+}
+
+void AVShardedDecoder::WorkerThread()
+{
+	AVDemuxer demuxer;
+	AVDecoder decoder;
+
+	// one thread per range decoder, the ranges are the parallelism
+	decoder.SetThreading(AVDecoder::THREAD_NONE);
+
+	bool opened = demuxer.Open(url_) && demuxer.GetVideoStream() &&
+		decoder.Init(demuxer.GetVideoStream(), nullptr, false);
+
+	while (opened) {
+		size_t index = 0;
+		{
+			std::lock_guard<std::mutex> locker(mutex_);
+			if (abort_ || next_range_ >= ranges_.size()) {
+				break;
+			}
+			index = next_range_++;
+		}
+
+		bool ok = DecodeRange(&demuxer, &decoder, index);
+
+		{
+			std::lock_guard<std::mutex> locker(mutex_);
+			ranges_[index].done = true;
+			ranges_[index].failed = !ok;
+			stats_.failed_ranges += ok ? 0 : 1;
+		}
+		cond_.notify_all();
+	}
+
+	decoder.Destroy();
+	demuxer.Close();
+
+	std::lock_guard<std::mutex> locker(mutex_);
+	if (--active_workers_ == 0) {
+		// ranges nobody could take, e.g. every worker failed to open
+		for (size_t i = next_range_; i < ranges_.size(); i++) {
+			ranges_[i].done = true;
+			ranges_[i].failed = true;
+			stats_.failed_ranges++;
+		}
+		next_range_ = ranges_.size();
+		stats_.decode_seconds = (now_us() - start_time_) / 1000000.0;
+		cond_.notify_all();
+	}
+}
+
+// Decodes from the range's keyframe up to the next range's keyframe plus the
+// packets after it that show before it (leading pictures), and keeps the
+// frames with start_pts <= pts < end_pts.
+bool AVShardedDecoder::DecodeRange(AVDemuxer* demuxer, AVDecoder* decoder, size_t index)
+{
+	const Range& range = ranges_[index];
+	int video_index = demuxer->GetVideoStream()->index;
+
+	decoder->Flush();
+	if (!demuxer->Seek(range.start_ms)) {
+		return false;
+	}
+
+	AVPacket* packet = av_packet_alloc();
+	AVFrame* frame = av_frame_alloc();
+	if (!packet || !frame) {
+		av_packet_free(&packet);
+		av_frame_free(&frame);
+		return false;
+	}
+
+	bool ok = true;
+	bool started = false;
+	bool ending = false;
+	int64_t start_pts = INT64_MIN;
+	int64_t end_pts = INT64_MAX;
+
+	while (ok) {
+		int ret = demuxer->Read(packet);
+		if (ret < 0) {
+			ok = ret == -1 || demuxer->IsEOF();
+			break;
+		}
+
+		if (packet->stream_index != video_index) {
+			av_packet_unref(packet);
+			continue;
+		}
+
+		bool key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+		int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+
+		if (!started) {
+			// the seek may land on an earlier keyframe
+			if (!key || ts < range.start_ms - slack_ms_) {
+				av_packet_unref(packet);
+				continue;
+			}
+			started = true;
+			if (index > 0 && packet->pts != AV_NOPTS_VALUE) {
+				start_pts = packet->pts;
+			}
+		}
+		else if (!ending && key && range.end_ms != INT64_MAX && ts >= range.end_ms - slack_ms_) {
+			ending = true;
+			end_pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : ts;
+		}
+		else if (ending && (key || packet->pts == AV_NOPTS_VALUE || packet->pts >= end_pts)) {
+			av_packet_unref(packet);
+			break;
+		}
+
+		decoder->Send(packet);
+		av_packet_unref(packet);
+
+		ok = DrainRange(decoder, index, start_pts, end_pts, frame);
+	}
+
+	if (ok) {
+		decoder->Send(nullptr);
+		ok = DrainRange(decoder, index, start_pts, end_pts, frame);
+	}
+
+	av_frame_free(&frame);
+	av_packet_free(&packet);
+	return ok && started;
+}
+
+bool AVShardedDecoder::DrainRange(AVDecoder* decoder, size_t index, int64_t start_pts, int64_t end_pts, AVFrame* frame)
+{
+	while (decoder->Recv(frame) >= 0) {
+		decoded_++;
+
+		if (frame->pts == AV_NOPTS_VALUE || (frame->pts >= start_pts && frame->pts < end_pts)) {
+			PushFrame(index, frame);
+		}
+		av_frame_unref(frame);
+	}
+
+	std::lock_guard<std::mutex> locker(mutex_);
+	return !abort_;
+}
+
+// Waits while the reorder buffer is full, except for the range being read.
+void AVShardedDecoder::PushFrame(size_t index, AVFrame* frame)
+{
+	AVFrame* copy = av_frame_alloc();
+	if (!copy) {
+		return;
+	}
+	av_frame_move_ref(copy, frame);
+
+	std::unique_lock<std::mutex> locker(mutex_);
+	cond_.wait(locker, [&]() { return abort_ || index == out_range_ || buffered_ < max_buffered_; });
+	if (abort_) {
+		av_frame_free(&copy);
+		return;
+	}
+
+	ranges_[index].frames.push_back(copy);
+	buffered_++;
+	stats_.peak_buffered = std::max(stats_.peak_buffered, buffered_);
+	locker.unlock();
+
+	cond_.notify_all();
+}
+
+int AVShardedDecoder::Read(AVFrame* frame)
+{
+	std::unique_lock<std::mutex> locker(mutex_);
+
+	while (!abort_ && out_range_ < ranges_.size()) {
+		Range& range = ranges_[out_range_];
+		if (!range.frames.empty()) {
+			AVFrame* next = range.frames.front();
+			range.frames.pop_front();
+			buffered_--;
+			stats_.delivered++;
+			locker.unlock();
+
+			av_frame_move_ref(frame, next);
+			av_frame_free(&next);
+			cond_.notify_all();
+			return 0;
+		}
+
+		if (range.done) {
+			// the next range may have been held back by a full buffer
+			out_range_++;
+			cond_.notify_all();
+			continue;
+		}
+
+		cond_.wait(locker);
+	}
+
+	return -1;
+}
+
+AVShardStats AVShardedDecoder::GetStats()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	AVShardStats stats = stats_;
+	stats.decoded = decoded_;
+	if (active_workers_ > 0) {
+		stats.decode_seconds = (now_us() - start_time_) / 1000000.0;
+	}
+	if (stats.decode_seconds > 0.0) {
+		stats.fps = stats.delivered / stats.decode_seconds;
+	}
+	return stats;
+}
+
+void AVShardedDecoder::PrintStats()
+{
+	AVShardStats stats = GetStats();
+	fprintf(stderr, "shards: %d workers, %d ranges (%d failed), %lld keyframes from %s in %.3f s\n",
+		stats.workers, stats.ranges, stats.failed_ranges, (long long)stats.keyframes,
+		stats.from_index ? "index" : "scan", stats.index_seconds);
+	fprintf(stderr, "shards: %lld decoded, %lld delivered, peak buffered %d, %.3f s, %.1f fps\n",
+		(long long)stats.decoded, (long long)stats.delivered, stats.peak_buffered,
+		stats.decode_seconds, stats.fps);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "av_demuxer.h"
+#include "av_decoder.h"
+
+struct AVShardStats
+{
+	int     workers = 0;
+	int     ranges = 0;
+	int     failed_ranges = 0;
+	int64_t keyframes = 0;
+	bool    from_index = false;    // keyframes from the container index, else scanned
+	int64_t decoded = 0;           // including the overlap decoded twice
+	int64_t delivered = 0;
+	int     peak_buffered = 0;     // frames waiting in the reorder buffer
+	double  index_seconds = 0.0;
+	double  decode_seconds = 0.0;
+	double  fps = 0.0;             // delivered / decode_seconds
+};
+
+// Offline decode of a whole file, not paced. The file is cut at keyframes into
+// GOP ranges which a pool of workers decodes independently, each with its own
+// AVDemuxer/AVDecoder pair (software). Read() returns the frames in pts order
+// through a reorder buffer.
+//
+// A range also decodes the leading pictures of the next GOP (open GOPs refer
+// back across the keyframe); the next range drops them.
+class AVShardedDecoder
+{
+public:
+	AVShardedDecoder& operator=(const AVShardedDecoder&) = delete;
+	AVShardedDecoder(const AVShardedDecoder&) = delete;
+	AVShardedDecoder();
+	virtual ~AVShardedDecoder();
+
+	// workers 0 uses one per core.
+	virtual bool Open(std::string url, int workers = 0);
+	virtual void Close();
+	virtual bool IsOpened();
+
+	// Blocks until the next frame in order is decoded. 0 on success, -1 at the end.
+	virtual int  Read(AVFrame* frame);
+
+	// Frames held for ranges ahead of the one being read, set before Open().
+	// The range being read is never held back.
+	void SetMaxBufferedFrames(int frames) { max_buffered_ = frames > 0 ? frames : 1; }
+
+	AVStream* GetVideoStream() { return demuxer_.GetVideoStream(); }
+
+	AVShardStats GetStats();
+	void PrintStats();
+
+private:
+	struct Range {
+		int64_t start_ms;  // keyframe timestamp, as read by AVDemuxer::Read()
+		int64_t end_ms;    // next range's keyframe, INT64_MAX for the last
+		std::deque<AVFrame*> frames;
+		bool done = false;
+		bool failed = false;
+	};
+
+	bool BuildIndex(std::vector<int64_t>* keyframes);
+	bool IndexCoversFile(const std::vector<int64_t>& keyframes);
+	void BuildRanges(const std::vector<int64_t>& keyframes, int workers);
+	void WorkerThread();
+	bool DecodeRange(AVDemuxer* demuxer, AVDecoder* decoder, size_t index);
+	bool DrainRange(AVDecoder* decoder, size_t index, int64_t start_pts, int64_t end_pts, AVFrame* frame);
+	void PushFrame(size_t index, AVFrame* frame);
+
+private:
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::vector<std::thread> workers_;
+
+	std::string url_;
+	AVDemuxer demuxer_; // index and stream info
+
+	std::vector<Range> ranges_;
+	int64_t slack_ms_ = 1; // boundary tolerance, index and packet timestamps may differ by the reorder delay
+	size_t next_range_ = 0;
+	size_t out_range_ = 0;
+	int buffered_ = 0;
+	int max_buffered_ = 128;
+	int active_workers_ = 0;
+	bool abort_ = false;
+
+	std::atomic<bool> is_opened_{ false };
+	std::atomic<int64_t> decoded_{ 0 };
+	int64_t start_time_ = 0; // us
+	AVShardStats stats_;
+};
@@ -0,0 +1,462 @@
+#include "av_thumbnailer.h"
+#include "av_log.h"
+
+#include <chrono>
+#include <algorithm>
+
+static int64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+AVThumbnailer::AVThumbnailer()
+{
+
+}
+
+AVThumbnailer::~AVThumbnailer()
+{
+	Cancel();
+	Wait();
+}
+
+bool AVThumbnailer::Start(const std::vector<std::string>& inputs, std::string output_dir, int count, int workers)
+{
+	if (running_) {
+		LOG("AVThumbnailer is running.");
+		return false;
+	}
+
+	for (std::thread& worker : workers_) {
+		worker.join();
+	}
+	workers_.clear();
+
+	if (inputs.empty() || count <= 0) {
+		return false;
+	}
+
+	if (workers <= 0) {
+		workers = (int)std::thread::hardware_concurrency();
+	}
+	workers = std::max(1, std::min(workers, (int)inputs.size()));
+
+	inputs_ = inputs;
+	output_dir_ = output_dir;
+	count_ = count;
+	cancel_ = false;
+	next_file_ = 0;
+	done_files_ = 0;
+
+	file_stats_.assign(inputs.size(), AVThumbnailFileStats());
+	for (size_t i = 0; i < inputs.size(); i++) {
+		file_stats_[i].input = inputs[i];
+	}
+	stats_ = AVThumbnailStats();
+	stats_.workers = workers;
+
+	start_time_ = now_us();
+	running_ = true;
+	active_workers_ = workers;
+	for (int i = 0; i < workers; i++) {
+		workers_.emplace_back(&AVThumbnailer::WorkerThread, this);
+	}
+
+	return true;
+}
+
+void AVThumbnailer::Cancel()
+{
+	cancel_ = true;
+}
+
+bool AVThumbnailer::Wait()
+{
+	for (std::thread& worker : workers_) {
+		worker.join();
+	}
+	workers_.clear();
+
+	std::lock_guard<std::mutex> locker(mutex_);
+	return stats_.failed == 0 && stats_.files == (int64_t)inputs_.size();
+}
+
+double AVThumbnailer::GetProgress()
+{
+	if (inputs_.empty()) {
+		return 0.0;
+	}
+	return (double)done_files_ / inputs_.size();
+}
+
+AVThumbnailStats AVThumbnailer::GetStats()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	AVThumbnailStats stats = stats_;
+	if (running_) {
+		stats.seconds = (now_us() - start_time_) / 1000000.0;
+	}
+	if (stats.seconds > 0.0) {
+		stats.files_per_second = stats.files / stats.seconds;
+		stats.thumbnails_per_second = stats.thumbnails / stats.seconds;
+	}
+	return stats;
+}
+
+std::vector<AVThumbnailFileStats> AVThumbnailer::GetFileStats()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+	return file_stats_;
+}
+
+void AVThumbnailer::PrintStats()
+{
+	for (const AVThumbnailFileStats& file : GetFileStats()) {
+		printf("%s: %s, %d thumbnails, %lld frames decoded, %lld bytes, %.3f s, %.1f thumbnails/s\n",
+			file.input.c_str(), file.ok ? "ok" : "failed", file.thumbnails,
+			(long long)file.decoded_frames, (long long)file.bytes, file.seconds, file.thumbnails_per_second);
+	}
+
+	AVThumbnailStats stats = GetStats();
+	printf("%lld files (%lld failed), %lld thumbnails, %d workers, %.3f s, %.1f files/s, %.1f thumbnails/s\n",
+		(long long)stats.files, (long long)stats.failed, (long long)stats.thumbnails, stats.workers,
+		stats.seconds, stats.files_per_second, stats.thumbnails_per_second);
+}
+
+void AVThumbnailer::WorkerThread()
+{
+	Worker worker;
+	worker.scaled = av_frame_alloc();
+	worker.packet = av_packet_alloc();
+
+	while (!cancel_ && worker.scaled && worker.packet) {
+		size_t index = next_file_++;
+		if (index >= inputs_.size()) {
+			break;
+		}
+
+		AVThumbnailFileStats stats;
+		stats.input = inputs_[index];
+
+		int64_t begin = now_us();
+		stats.ok = ProcessFile(&worker, index, &stats);
+		stats.seconds = (now_us() - begin) / 1000000.0;
+		if (stats.seconds > 0.0) {
+			stats.thumbnails_per_second = stats.thumbnails / stats.seconds;
+		}
+
+		{
+			std::lock_guard<std::mutex> locker(mutex_);
+			file_stats_[index] = stats;
+			stats_.files++;
+			stats_.failed += stats.ok ? 0 : 1;
+			stats_.thumbnails += stats.thumbnails;
+			stats_.decoded_frames += stats.decoded_frames;
+			stats_.bytes += stats.bytes;
+		}
+		done_files_++;
+	}
+
+	CloseWorker(&worker);
+
+	if (--active_workers_ == 0) {
+		std::lock_guard<std::mutex> locker(mutex_);
+		stats_.seconds = (now_us() - start_time_) / 1000000.0;
+		running_ = false;
+	}
+}
+
+bool AVThumbnailer::ProcessFile(Worker* worker, size_t index, AVThumbnailFileStats* stats)
+{
+	const std::string& input = inputs_[index];
+
+	// only keyframes leave the demuxer
+	AVDemuxer demuxer;
+	demuxer.SetKeyframeOnly(true);
+	if (!demuxer.Open(input)) {
+		return false;
+	}
+
+	AVStream* video_stream = demuxer.GetVideoStream();
+	if (!video_stream) {
+		LOG("%s has no video stream.", input.c_str());
+		return false;
+	}
+
+	// one keyframe at a time, frame threads would only add delay; the cores
+	// go to the other files
+	AVDecoder decoder;
+	decoder.SetThreading(AVDecoder::THREAD_NONE);
+	decoder.SetKeyframeOnly(true);
+	if (!decoder.Init(video_stream, nullptr, false)) {
+		return false;
+	}
+
+	AVFormatContext* format_context = demuxer.GetFormatContext();
+	int64_t origin_ms = format_context->start_time != AV_NOPTS_VALUE ? av_rescale(format_context->start_time, 1000, AV_TIME_BASE) : 0;
+	int64_t duration_ms = format_context->duration > 0 ? av_rescale(format_context->duration, 1000, AV_TIME_BASE) : 0;
+
+	// unknown duration, a single thumbnail from the start
+	int count = duration_ms > 0 ? count_ : 1;
+
+	AVFrame* frame = av_frame_alloc();
+	if (!frame) {
+		return false;
+	}
+
+	std::vector<Target> targets = SelectTargets(input, origin_ms, duration_ms, count);
+
+	int64_t last_pts = AV_NOPTS_VALUE;
+	for (const Target& target : targets) {
+		if (cancel_) {
+			break;
+		}
+
+		if (duration_ms > 0 || target.cut) {
+			demuxer.Seek(target.ms);
+		}
+
+		// keyframes further apart than the interval: the next one after the
+		// last thumbnail, or none left. Cuts skip to the first keyframe of the
+		// new scene, encoders usually place one on the cut.
+		int64_t after_pts = last_pts;
+		if (target.cut && (after_pts == AV_NOPTS_VALUE || after_pts < target.ms - 1)) {
+			after_pts = target.ms - 1;
+		}
+
+		if (DecodeKeyframe(&demuxer, &decoder, video_stream->index, after_pts, frame, stats) < 0) {
+			if (target.cut) {
+				continue;
+			}
+			break;
+		}
+
+		last_pts = frame->pts;
+		WriteThumbnail(worker, frame, OutputPath(index, stats->thumbnails), stats);
+		av_frame_unref(frame);
+	}
+
+	av_frame_free(&frame);
+	decoder.Destroy();
+	demuxer.Close();
+
+	return stats->thumbnails > 0;
+}
+
+// Up to count scene cuts spread over the list, evenly spaced points for the
+// rest, in time order.
+std::vector<AVThumbnailer::Target> AVThumbnailer::SelectTargets(const std::string& input, int64_t origin_ms, int64_t duration_ms, int count)
+{
+	std::vector<Target> targets;
+
+	auto it = scene_cuts_.find(input);
+	if (it != scene_cuts_.end() && !it->second.empty()) {
+		const std::vector<int64_t>& cuts = it->second;
+		size_t picks = std::min(cuts.size(), (size_t)count);
+		for (size_t i = 0; i < picks; i++) {
+			targets.push_back({ cuts[i * cuts.size() / picks], true });
+		}
+	}
+
+	int even = count - (int)targets.size();
+	for (int i = 0; i < even; i++) {
+		// middle of each of even equal intervals
+		targets.push_back({ origin_ms + duration_ms * (2 * i + 1) / (2 * even), false });
+	}
+
+	std::sort(targets.begin(), targets.end(), [](const Target& a, const Target& b) { return a.ms < b.ms; });
+	return targets;
+}
+
+// First decodable keyframe after last_pts. 0 with the frame in frame, -1 at the end.
+int AVThumbnailer::DecodeKeyframe(AVDemuxer* demuxer, AVDecoder* decoder, int video_index, int64_t last_pts, AVFrame* frame, AVThumbnailFileStats* stats)
+{
+	AVPacket* packet = av_packet_alloc();
+	if (!packet) {
+		return -1;
+	}
+
+	int result = -1;
+	while (!cancel_) {
+		if (demuxer->Read(packet) < 0) {
+			break;
+		}
+
+		if (packet->stream_index != video_index || !(packet->flags & AV_PKT_FLAG_KEY) ||
+			(last_pts != AV_NOPTS_VALUE && packet->pts != AV_NOPTS_VALUE && packet->pts <= last_pts)) {
+			av_packet_unref(packet);
+			continue;
+		}
+
+		// send and drain, the picture comes out without waiting for the next packet
+		decoder->Send(packet);
+		av_packet_unref(packet);
+		decoder->Send(nullptr);
+
+		int ret = 0;
+		do {
+			ret = decoder->Recv(frame);
+		} while (ret == AVERROR(EAGAIN));
+		decoder->Flush();
+
+		if (ret >= 0) {
+			stats->decoded_frames++;
+			result = 0;
+			break;
+		}
+	}
+
+	av_packet_free(&packet);
+	return result;
+}
+
+bool AVThumbnailer::WriteThumbnail(Worker* worker, AVFrame* frame, const std::string& path, AVThumbnailFileStats* stats)
+{
+	if (frame->width <= 0 || frame->height <= 0) {
+		return false;
+	}
+
+	int width = width_ > 0 ? width_ : frame->width;
+	int height = height_;
+	if (height <= 0) {
+		// display aspect ratio
+		AVRational sar = frame->sample_aspect_ratio;
+		int64_t display_width = frame->width;
+		if (sar.num > 0 && sar.den > 0) {
+			display_width = av_rescale(frame->width, sar.num, sar.den);
+		}
+		height = (int)av_rescale(width, frame->height, display_width > 0 ? display_width : frame->width);
+	}
+	width = std::max(2, width & ~1);
+	height = std::max(2, height & ~1);
+
+	if (!OpenEncoder(worker, width, height)) {
+		return false;
+	}
+
+	worker->sws_context = sws_getCachedContext(worker->sws_context,
+		frame->width, frame->height, (AVPixelFormat)frame->format,
+		width, height, AV_PIX_FMT_YUVJ420P, SWS_BILINEAR, NULL, NULL, NULL);
+	if (!worker->sws_context) {
+		LOG("no scaler for %s.", av_get_pix_fmt_name((AVPixelFormat)frame->format));
+		return false;
+	}
+
+	AVFrame* scaled = worker->scaled;
+	if (scaled->width != width || scaled->height != height) {
+		av_frame_unref(scaled);
+		scaled->format = AV_PIX_FMT_YUVJ420P;
+		scaled->width = width;
+		scaled->height = height;
+		if (av_frame_get_buffer(scaled, 32) < 0) {
+			av_frame_unref(scaled);
+			return false;
+		}
+	}
+	if (av_frame_make_writable(scaled) < 0) {
+		return false;
+	}
+
+	sws_scale(worker->sws_context, frame->data, frame->linesize, 0, frame->height, scaled->data, scaled->linesize);
+	scaled->pts = stats->thumbnails;
+	scaled->quality = worker->encoder->global_quality;
+
+	int ret = avcodec_send_frame(worker->encoder, scaled);
+	if (ret >= 0) {
+		ret = avcodec_receive_packet(worker->encoder, worker->packet);
+	}
+	if (ret < 0) {
+		LOG("encode thumbnail failed. %d", ret);
+		return false;
+	}
+
+	bool result = false;
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file) {
+		result = fwrite(worker->packet->data, 1, worker->packet->size, file) == (size_t)worker->packet->size;
+		fclose(file);
+	}
+	else {
+		LOG("open %s failed.", path.c_str());
+	}
+
+	if (result) {
+		stats->thumbnails++;
+		stats->bytes += worker->packet->size;
+	}
+
+	av_packet_unref(worker->packet);
+	return result;
+}
+
+// One mjpeg encoder per worker, reopened when the thumbnail size changes.
+bool AVThumbnailer::OpenEncoder(Worker* worker, int width, int height)
+{
+	if (worker->encoder && worker->encoder->width == width && worker->encoder->height == height) {
+		return true;
+	}
+
+	avcodec_free_context(&worker->encoder);
+
+	AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+	if (!codec) {
+		LOG("encoder(mjpeg) not found.");
+		return false;
+	}
+
+	worker->encoder = avcodec_alloc_context3(codec);
+	if (!worker->encoder) {
+		return false;
+	}
+
+	worker->encoder->width = width;
+	worker->encoder->height = height;
+	worker->encoder->pix_fmt = AV_PIX_FMT_YUVJ420P;
+	worker->encoder->time_base = { 1, 25 };
+	worker->encoder->thread_count = 1;
+	worker->encoder->flags |= AV_CODEC_FLAG_QSCALE;
+	worker->encoder->global_quality = FF_QP2LAMBDA * quality_;
+
+	if (avcodec_open2(worker->encoder, codec, NULL) < 0) {
+		LOG("open encoder(mjpeg) %dx%d failed.", width, height);
+		avcodec_free_context(&worker->encoder);
+		return false;
+	}
+
+	return true;
+}
+
+void AVThumbnailer::CloseWorker(Worker* worker)
+{
+	sws_freeContext(worker->sws_context);
+	worker->sws_context = nullptr;
+	avcodec_free_context(&worker->encoder);
+	av_frame_free(&worker->scaled);
+	av_packet_free(&worker->packet);
+}
+
+std::string AVThumbnailer::OutputPath(size_t index, int thumbnail)
+{
+	const std::string& input = inputs_[index];
+
+	size_t begin = input.find_last_of("/\\");
+	begin = begin == std::string::npos ? 0 : begin + 1;
+	size_t end = input.find_last_of('.');
+	if (end == std::string::npos || end < begin) {
+		end = input.size();
+	}
+
+	// the input index keeps same-named files from different directories apart
+	char prefix[32];
+	snprintf(prefix, sizeof(prefix), "%04u_", (unsigned)index);
+	char name[32];
+	snprintf(name, sizeof(name), "_%03d.jpg", thumbnail);
+
+	std::string path = output_dir_;
+	if (!path.empty() && path.back() != '/' && path.back() != '\\') {
+		path += '/';
+	}
+	return path + prefix + input.substr(begin, end - begin) + name;
+}
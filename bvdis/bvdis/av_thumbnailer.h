@@ -0,0 +1,120 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <map>
+
+#include "av_demuxer.h"
+#include "av_decoder.h"
+
+extern "C" {
+#include "libswscale/swscale.h"
+}
+
+struct AVThumbnailFileStats
+{
+	std::string input;
+	bool    ok = false;
+	int     thumbnails = 0;
+	int64_t decoded_frames = 0;
+	int64_t bytes = 0;           // JPEG bytes written
+	double  seconds = 0.0;
+	double  thumbnails_per_second = 0.0;
+};
+
+struct AVThumbnailStats
+{
+	int     workers = 0;
+	int64_t files = 0;
+	int64_t failed = 0;
+	int64_t thumbnails = 0;
+	int64_t decoded_frames = 0;
+	int64_t bytes = 0;
+	double  seconds = 0.0;       // wall clock of the whole batch
+	double  files_per_second = 0.0;
+	double  thumbnails_per_second = 0.0;
+};
+
+// Timeline thumbnails for a batch of files. Each file gets count JPEGs from
+// keyframes evenly spaced over its duration, written as
+// <output_dir>/<index>_<name>_<nnn>.jpg, index being the file's position in
+// inputs. Only those keyframes are demuxed and decoded (software), files are
+// spread over a pool of worker threads.
+class AVThumbnailer
+{
+public:
+	AVThumbnailer& operator=(const AVThumbnailer&) = delete;
+	AVThumbnailer(const AVThumbnailer&) = delete;
+	AVThumbnailer();
+	virtual ~AVThumbnailer();
+
+	// workers 0 uses one per core.
+	virtual bool Start(const std::vector<std::string>& inputs, std::string output_dir, int count, int workers = 0);
+	virtual void Cancel();
+	// true when every file produced thumbnails.
+	virtual bool Wait();
+
+	// Set before Start(). height -1 keeps the aspect ratio.
+	void SetSize(int width, int height = -1) { width_ = width; height_ = height; }
+	// Scene cuts of input in ms (AVSceneChange::pts, e.g. from AVPipeline), set
+	// before Start(). Thumbnails go to the keyframe at or after a cut first,
+	// spread over the list; evenly spaced ones fill up to count.
+	void SetSceneCuts(const std::string& input, const std::vector<int64_t>& cuts_ms) { scene_cuts_[input] = cuts_ms; }
+
+	// mjpeg qscale, 2 (best) to 31.
+	void SetQuality(int quality) { quality_ = av_clip(quality, 2, 31); }
+
+	bool IsRunning() { return running_; }
+	double GetProgress();
+
+	AVThumbnailStats GetStats();
+	std::vector<AVThumbnailFileStats> GetFileStats();
+	void PrintStats();
+
+private:
+	struct Worker {
+		SwsContext* sws_context = nullptr;
+		AVCodecContext* encoder = nullptr;
+		AVFrame* scaled = nullptr;
+		AVPacket* packet = nullptr;
+	};
+
+	void WorkerThread();
+	bool ProcessFile(Worker* worker, size_t index, AVThumbnailFileStats* stats);
+	struct Target {
+		int64_t ms;
+		bool    cut;  // keyframe at or after ms, else at or before
+	};
+
+	std::vector<Target> SelectTargets(const std::string& input, int64_t origin_ms, int64_t duration_ms, int count);
+	int  DecodeKeyframe(AVDemuxer* demuxer, AVDecoder* decoder, int video_index, int64_t last_pts, AVFrame* frame, AVThumbnailFileStats* stats);
+	bool WriteThumbnail(Worker* worker, AVFrame* frame, const std::string& path, AVThumbnailFileStats* stats);
+	bool OpenEncoder(Worker* worker, int width, int height);
+	void CloseWorker(Worker* worker);
+	std::string OutputPath(size_t index, int thumbnail);
+
+private:
+	std::mutex mutex_;
+	std::vector<std::thread> workers_;
+
+	std::vector<std::string> inputs_;
+	std::string output_dir_;
+	int count_ = 10;
+	int width_ = 160;
+	int height_ = -1;
+	int quality_ = 5;
+	std::map<std::string, std::vector<int64_t>> scene_cuts_;
+
+	std::atomic<bool> running_{ false };
+	std::atomic<bool> cancel_{ false };
+	std::atomic<size_t> next_file_{ 0 };
+	std::atomic<int> active_workers_{ 0 };
+	std::atomic<int64_t> done_files_{ 0 };
+	int64_t start_time_ = 0; // us
+
+	std::vector<AVThumbnailFileStats> file_stats_;
+	AVThumbnailStats stats_;
+};
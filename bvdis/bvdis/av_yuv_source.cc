@@ -0,0 +1,233 @@
+#include "av_yuv_source.h"
+#include "av_log.h"
+
+extern "C" {
+#include "libavutil/mathematics.h"
+}
+
+static const char kY4MMagic[] = "YUV4MPEG2 ";
+static const char kY4MFrame[] = "FRAME";
+
+AVYuvSource::AVYuvSource()
+{
+
+}
+
+AVYuvSource::~AVYuvSource()
+{
+	Close();
+}
+
+bool AVYuvSource::Open(std::string url, int width, int height, AVPixelFormat format, AVRational frame_rate)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (file_.IsOpened()) {
+		LOG("AVYuvSource was opened.");
+		return false;
+	}
+
+	if (!file_.Open(url)) {
+		return false;
+	}
+
+	const uint8_t* data = file_.GetData();
+	uint64_t size = file_.GetSize();
+
+	if (size > sizeof(kY4MMagic) && !memcmp(data, kY4MMagic, sizeof(kY4MMagic) - 1)) {
+		if (!ParseY4MHeader()) {
+			LOG("parse y4m header %s failed.", url.c_str());
+			file_.Close();
+			return false;
+		}
+	}
+	else {
+		if (format != AV_PIX_FMT_YUV420P && format != AV_PIX_FMT_NV12) {
+			LOG("un support raw AVPixelFormat, %d\n", format);
+			file_.Close();
+			return false;
+		}
+
+		width_ = width;
+		height_ = height;
+		format_ = format;
+		frame_rate_ = frame_rate;
+		frame_size_ = av_image_get_buffer_size(format_, width_, height_, 1);
+		if (frame_size_ <= 0) {
+			LOG("invalid raw frame size %dx%d.", width_, height_);
+			file_.Close();
+			return false;
+		}
+
+		uint64_t count = size / frame_size_;
+		frame_offsets_.reserve((size_t)count);
+		for (uint64_t i = 0; i < count; i++) {
+			frame_offsets_.push_back(i * frame_size_);
+		}
+	}
+
+	if (frame_offsets_.empty()) {
+		LOG("%s has no complete frame.", url.c_str());
+		file_.Close();
+		return false;
+	}
+
+	next_frame_ = 0;
+	eof_ = 0;
+	url_ = url;
+	return true;
+}
+
+bool AVYuvSource::ParseY4MHeader()
+{
+	const char* data = (const char*)file_.GetData();
+	uint64_t size = file_.GetSize();
+
+	uint64_t pos = sizeof(kY4MMagic) - 1;
+	while (pos < size && data[pos] != '\n') {
+		while (pos < size && data[pos] == ' ') {
+			pos++;
+		}
+
+		uint64_t end = pos;
+		while (end < size && data[end] != ' ' && data[end] != '\n') {
+			end++;
+		}
+
+		std::string value(data + pos + 1, end > pos ? (size_t)(end - pos - 1) : 0);
+		switch (data[pos])
+		{
+		case 'W':
+			width_ = atoi(value.c_str());
+			break;
+		case 'H':
+			height_ = atoi(value.c_str());
+			break;
+		case 'F':
+			if (sscanf(value.c_str(), "%d:%d", &frame_rate_.num, &frame_rate_.den) != 2 || frame_rate_.num <= 0 || frame_rate_.den <= 0) {
+				frame_rate_ = { 25, 1 };
+			}
+			break;
+		case 'C':
+			// 8-bit 4:2:0 only, C420p10 / C420p12 would need 16-bit planes
+			if (value != "420" && value != "420jpeg" && value != "420paldv" && value != "420mpeg2") {
+				LOG("un support y4m colorspace C%s\n", value.c_str());
+				return false;
+			}
+			break;
+		default:
+			break;
+		}
+
+		pos = end;
+	}
+
+	format_ = AV_PIX_FMT_YUV420P;
+	frame_size_ = av_image_get_buffer_size(format_, width_, height_, 1);
+	if (pos >= size || frame_size_ <= 0) {
+		return false;
+	}
+
+	// every frame is "FRAME[ params]\n" followed by the planes
+	pos++;
+	while (pos + sizeof(kY4MFrame) - 1 <= size && !memcmp(data + pos, kY4MFrame, sizeof(kY4MFrame) - 1)) {
+		const char* nl = (const char*)memchr(data + pos, '\n', (size_t)FFMIN(size - pos, 256));
+		if (!nl) {
+			break;
+		}
+
+		uint64_t offset = (uint64_t)(nl - data) + 1;
+		if (offset + frame_size_ > size) {
+			break;
+		}
+
+		frame_offsets_.push_back(offset);
+		pos = offset + frame_size_;
+	}
+
+	return true;
+}
+
+void AVYuvSource::Close()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	// frames still referencing the mapping keep it alive
+	file_.Close();
+	frame_offsets_.clear();
+
+	width_ = 0;
+	height_ = 0;
+	format_ = AV_PIX_FMT_NONE;
+	frame_size_ = 0;
+	next_frame_ = 0;
+	eof_ = 0;
+}
+
+bool AVYuvSource::IsOpened()
+{
+	return file_.IsOpened();
+}
+
+int AVYuvSource::Read(AVFrame* frame)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (!file_.IsOpened()) {
+		return -1;
+	}
+
+	int64_t count = (int64_t)frame_offsets_.size();
+	if (next_frame_ >= count) {
+		if (!loop_) {
+			eof_ = 1;
+			return -1;
+		}
+
+		next_frame_ = 0;
+	}
+
+	av_frame_unref(frame);
+
+	frame->buf[0] = file_.Ref();
+	if (!frame->buf[0]) {
+		return -1;
+	}
+
+	const uint8_t* src = file_.GetData() + frame_offsets_[(size_t)next_frame_];
+	av_image_fill_arrays(frame->data, frame->linesize, src, format_, width_, height_, 1);
+
+	frame->format = format_;
+	frame->width = width_;
+	frame->height = height_;
+	frame->key_frame = 1;
+	frame->pict_type = AV_PICTURE_TYPE_I;
+
+	// ms, same unit as AVDemuxer::Read
+	AVRational frame_tb = av_inv_q(frame_rate_);
+	frame->pts = av_rescale_q(next_frame_, frame_tb, { 1, 1000 });
+	frame->best_effort_timestamp = frame->pts;
+	frame->pkt_duration = av_rescale_q(1, frame_tb, { 1, 1000 });
+
+	next_frame_++;
+	eof_ = 0;
+	return 0;
+}
+
+bool AVYuvSource::IsEOF()
+{
+	return eof_ ? true : false;
+}
+
+bool AVYuvSource::Seek(int64_t frame_index)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (frame_index < 0 || frame_index >= (int64_t)frame_offsets_.size()) {
+		return false;
+	}
+
+	next_frame_ = frame_index;
+	eof_ = 0;
+	return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <vector>
+
+#include "av_file_map.h"
+
+extern "C" {
+#include "libavutil/frame.h"
+#include "libavutil/imgutils.h"
+}
+
+// Raw YUV420P/NV12 or Y4M file source. Frames are served zero-copy: plane
+// pointers reference the file mapping, which each frame holds through buf[0].
+class AVYuvSource
+{
+public:
+	AVYuvSource& operator=(const AVYuvSource&) = delete;
+	AVYuvSource(const AVYuvSource&) = delete;
+	AVYuvSource();
+	virtual ~AVYuvSource();
+
+	// width/height/format are only used for raw files, Y4M files carry their own header.
+	virtual bool Open(std::string url, int width = 0, int height = 0,
+		AVPixelFormat format = AV_PIX_FMT_YUV420P, AVRational frame_rate = { 25, 1 });
+	virtual void Close();
+	virtual bool IsOpened();
+
+	virtual int  Read(AVFrame* frame);
+	virtual bool IsEOF();
+	virtual bool Seek(int64_t frame_index);
+
+	// Restart from the first frame at the end of file, for soak tests.
+	void SetLoop(bool loop) { loop_ = loop; }
+
+	int GetWidth() { return width_; }
+	int GetHeight() { return height_; }
+	AVPixelFormat GetFormat() { return format_; }
+	AVRational GetFrameRate() { return frame_rate_; }
+	int64_t GetFrameCount() { return (int64_t)frame_offsets_.size(); }
+
+private:
+	bool ParseY4MHeader();
+
+private:
+	std::mutex  mutex_;
+	std::string url_;
+
+	AVFileMap file_;
+	std::vector<uint64_t> frame_offsets_;
+
+	int width_ = 0;
+	int height_ = 0;
+	AVPixelFormat format_ = AV_PIX_FMT_NONE;
+	AVRational frame_rate_ = { 25, 1 };
+	int frame_size_ = 0;
+
+	int64_t next_frame_ = 0;
+	bool loop_ = false;
+	int  eof_ = 0;
+};
@@ -1,10 +1,20 @@
 #include <stdio.h>
 #include <thread>
+#include <atomic>
 #include "main_window.h"
 
 #include "render.h"
 #include "av_demuxer.h"
 #include "av_decoder.h"
+#include "av_yuv_source.h"
+#include "av_pipeline.h"
+#include "av_playlist.h"
+#include "av_es_source.h"
+#include "av_thumbnailer.h"
+#include "av_clip_exporter.h"
+#include "av_decoder_pool.h"
+#include "av_player.h"
+#include "av_log.h"
 
 #pragma comment(lib, "d3d11.lib")
 #pragma comment(lib, "dxgi.lib")
@@ -16,10 +26,42 @@
 #pragma comment(lib, "avcodec.lib")
 #pragma comment(lib, "avutil.lib")
 #pragma comment(lib, "avformat.lib")
+#pragma comment(lib, "swscale.lib")
 
 // ǷӲ
 const bool HARD_WARE_DECODER = true;
 
+// YUVļĳߴ (y4mļԴ)
+const int RAW_YUV_WIDTH = 1280;
+const int RAW_YUV_HEIGHT = 720;
+
+// ظ֡, ֡ʡȥת, ϴPresent; ֲϴֽ
+static void PrintRenderStats(Render* render)
+{
+    AVFrameCompareStats stats = render->GetDuplicateStats();
+    LOG("duplicate frames skipped %lld/%lld (%.1f%%), compare %.2f ms/frame, full compares %lld\n",
+        (long long)stats.duplicates, (long long)stats.frames, stats.skip_rate * 100.0,
+        stats.frames > 0 ? stats.compare_ms / stats.frames : 0.0, (long long)stats.full_compares);
+
+    RenderUploadStats upload = render->GetUploadStats();
+    if (upload.frames > 0) {
+        LOG("uploaded %lld frames (%lld partial), %.1f KB/frame, last %.1f KB, full frame %.1f KB\n",
+            (long long)upload.frames, (long long)upload.partialFrames, upload.bytes / 1024.0 / upload.frames,
+            upload.lastBytes / 1024.0, upload.frameBytes / 1024.0);
+    }
+}
+
+static bool IsYuvFile(const std::string& filePath)
+{
+    size_t pos = filePath.find_last_of('.');
+    if (pos == std::string::npos) {
+        return false;
+    }
+
+    std::string ext = filePath.substr(pos);
+    return ext == ".yuv" || ext == ".y4m";
+}
+
 class RenderWindow : public MainWindow
 {
 public:
@@ -27,9 +69,18 @@ public:
         this->filePath = filePath;
     }
 
+    // б, һں̨Ԥ
+    RenderWindow(const std::vector<std::string>& playlist) {
+        for (const std::string& url : playlist) {
+            this->playlist.Add(url);
+        }
+        this->usePlaylist = true;
+    }
+
     Render* GetRender() { return &render; }
     AVDemuxer* GetDemuxer() { return &demuxer; }
     AVDecoder* GetDecoder() { return &decoder; }
+    AVYuvSource* GetYuvSource() { return &yuvSource; }
 
     void Run();
 
@@ -48,6 +99,8 @@ public:
 
 private:
     void showFrame();
+    void showYuvFrame();
+    void showPlaylistFrame();
 
 private:
     std::string filePath;
@@ -55,18 +108,252 @@ private:
     Render render; // Ⱦ
     AVDemuxer demuxer; // ⸴
     AVDecoder decoder; // 
+    AVYuvSource yuvSource; // YUVļ, 
+    AVPlaylist playlist; // б
+    AVElementarySource esSource; // H.264/HEVC, avformat
+    bool usePlaylist = false;
 };
 
 
-int main()
+// ޴: bvdis.exe input output.(nv12|y4m|crc) [shards], output Ϊ - ʱд׼
+// .crc: ֻÿ֡CRC32CУֵ, λȶ
+// shards: GOPֶζ߽߳, 0 Ϊÿһ߳
+// bvdis.exe -program Ŀ input output: ֻMPEG-TSеһĿ
+static int RunHeadless(const std::string& input, const std::string& output, int shards = -1, int program = -1)
 {
+    AVFrameSink::Format format = AVFrameSink::FORMAT_NV12;
+    if (output.size() > 4 && output.compare(output.size() - 4, 4, ".y4m") == 0) {
+        format = AVFrameSink::FORMAT_Y4M;
+    }
+
+    bool checksums = output.size() > 4 && output.compare(output.size() - 4, 4, ".crc") == 0;
+
+    AVPipeline pipeline;
+
+    // ʱ˳ⳡл, Ҫķ
+    pipeline.SetSceneDetection(true);
+
+    if (shards >= 0) {
+        pipeline.SetSharded(true, shards);
+    }
+
+    if (program >= 0) {
+        pipeline.SetProgram(program);
+    }
+
+    if (checksums) {
+        pipeline.SetHashLog(output);
+    }
+
+    if (!pipeline.Open(input, checksums ? "" : output, format)) {
+        return -1;
+    }
+
+    int ret = pipeline.Run();
+    pipeline.Close();
+    pipeline.PrintStats();
+
+    return ret;
+}
+
+// ͼ: bvdis.exe -thumbnails Ŀ¼ ÿļ input...
+static int RunThumbnails(int argc, char* argv[])
+{
+    std::vector<std::string> inputs(argv + 4, argv + argc);
+
+    AVThumbnailer thumbnailer;
+    if (!thumbnailer.Start(inputs, argv[2], atoi(argv[3]))) {
+        return -1;
+    }
+
+    bool ok = thumbnailer.Wait();
+    thumbnailer.PrintStats();
+
+    return ok ? 0 : -1;
+}
+
+// Ƭε: bvdis.exe -clip input output.(mp4|mkv) ʼms ms [exact], ֱӸ
+// exact: ӿʼʱ侫ȷ (MP4༭б), ֮ǰĹؼ֡ʼ
+static int RunClip(int argc, char* argv[])
+{
+    bool exact = argc >= 7 && strcmp(argv[6], "exact") == 0;
+
+    AVClipExporter exporter;
+    if (!exporter.Start(argv[2], argv[3], atoll(argv[4]), atoll(argv[5]),
+        exact ? AVClipExporter::CUT_EXACT : AVClipExporter::CUT_KEYFRAME)) {
+        return -1;
+    }
+
+    bool ok = exporter.Wait();
+
+    AVClipExportStats stats = exporter.GetStats();
+    printf("%lld packets, %lld bytes, %.3f s clip in %.3f s (%.1fx realtime), transcode estimate %.3f s (%.1fx)\n",
+        (long long)stats.packets, (long long)stats.bytes, stats.clip_duration, stats.elapsed,
+        stats.realtime_factor, stats.transcode_estimate, stats.speedup);
+
+    return ok ? 0 : -1;
+}
+
+// Ƶл: bvdis.exe -switch input... ÿ·뵽һ֡еһ·, 
+// ڶֵĽԳ (ͬ, ͬߴʱ´), Ƚ/лӳ
+static int RunChannelSwitch(int argc, char* argv[])
+{
+    AVDecoderPool pool;
+    if (!pool.Init(nullptr)) {
+        return -1;
+    }
+
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    int ret = 0;
+
+    for (int round = 0; round < 2; round++) {
+        for (int i = 2; i < argc; i++) {
+            AVDemuxer demuxer;
+            AVStream* stream = demuxer.Open(argv[i]) ? demuxer.GetVideoStream() : nullptr;
+            if (!stream) {
+                ret = -1;
+                continue;
+            }
+
+            // һ·ǰ
+            if (round == 0 && i == 2) {
+                pool.Prewarm(stream, HARD_WARE_DECODER);
+            }
+
+            std::unique_ptr<AVDecoder> decoder = pool.Acquire(stream, HARD_WARE_DECODER);
+            if (!decoder) {
+                ret = -1;
+                continue;
+            }
+
+            // 뵽һ֡
+            bool decoded = false;
+            while (!decoded && demuxer.Read(packet) >= 0) {
+                if (packet->stream_index == stream->index && decoder->Send(packet) >= 0) {
+                    decoded = decoder->Recv(frame) >= 0;
+                    av_frame_unref(frame);
+                }
+                av_packet_unref(packet);
+            }
+
+            pool.Release(std::move(decoder));
+        }
+    }
+
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+
+    AVDecoderPoolStats stats = pool.GetStats();
+    printf("pool: %lld warm, %lld cold, %lld evicted, switch latency warm %.2f ms, cold %.2f ms\n",
+        (long long)stats.hits, (long long)stats.misses, (long long)stats.evictions,
+        stats.warm_switch_latency, stats.cold_switch_latency);
+
+    pool.Destroy();
+    return ret;
+}
+
+// //֡: bvdis.exe -trickplay input [ÿ֡]
+//  1 2 4 8 16 ,  1 4 ٵ, ֡ǰͺ, ÿĽٶ
+static int RunTrickPlay(const std::string& input, int frames)
+{
+    AVPlayer player;
+    if (!player.Open(input, nullptr, HARD_WARE_DECODER)) {
+        return -1;
+    }
+
+    AVFrame* frame = av_frame_alloc();
+
+    static const int rates[] = { 1, 2, 4, 8, 16, -1, -4 };
+    for (int rate : rates) {
+        player.SetRate(rate);
+        for (int i = 0; i < frames; i++) {
+            if (player.Read(frame) < 0) {
+                break;
+            }
+            av_frame_unref(frame);
+        }
+    }
+
+    // ˵Ĳǰ, Ĳ½GOP
+    for (int i = 0; i < 10; i++) {
+        if (player.StepForward(frame) < 0) {
+            break;
+        }
+        av_frame_unref(frame);
+    }
+    for (int i = 0; i < 40; i++) {
+        if (player.StepBackward(frame) < 0) {
+            break;
+        }
+        av_frame_unref(frame);
+    }
+
+    av_frame_free(&frame);
+
+    player.PrintStats();
+    player.Close();
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "-thumbnails") == 0) {
+        if (argc < 5) {
+            fprintf(stderr, "usage: bvdis.exe -thumbnails <dir> <count> input...\n");
+            return -1;
+        }
+        return RunThumbnails(argc, argv);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "-clip") == 0) {
+        if (argc < 6) {
+            fprintf(stderr, "usage: bvdis.exe -clip input output start_ms end_ms [exact]\n");
+            return -1;
+        }
+        return RunClip(argc, argv);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "-trickplay") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "usage: bvdis.exe -trickplay input [frames_per_rate]\n");
+            return -1;
+        }
+        return RunTrickPlay(argv[2], argc >= 4 ? atoi(argv[3]) : 100);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "-switch") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "usage: bvdis.exe -switch input...\n");
+            return -1;
+        }
+        return RunChannelSwitch(argc, argv);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "-program") == 0) {
+        if (argc < 5) {
+            fprintf(stderr, "usage: bvdis.exe -program program_number input output\n");
+            return -1;
+        }
+        return RunHeadless(argv[3], argv[4], -1, atoi(argv[2]));
+    }
+
+    if (argc >= 4) {
+        return RunHeadless(argv[1], argv[2], atoi(argv[3]));
+    }
+
+    if (argc >= 3) {
+        return RunHeadless(argv[1], argv[2]);
+    }
+
     RenderWindow win_1("F:/FFOutput/demo.mp4");
     if (!win_1.Init(100, 100, 640, 480)) {
         return -1;
     }
     win_1.Run();
 
-    RenderWindow win_2("F:/FFOutput/input.mp4");
+    RenderWindow win_2(std::vector<std::string>{ "F:/FFOutput/input.mp4", "F:/FFOutput/demo.mp4" });
     if (!win_2.Init(800, 100, 640, 480)) {
         return -1;
     }
@@ -80,7 +367,15 @@ int main()
 void RenderWindow::Run()
 {
     auto fun = [&]() {
-        this->showFrame();
+        if (this->usePlaylist) {
+            this->showPlaylistFrame();
+        }
+        else if (this->yuvSource.IsOpened()) {
+            this->showYuvFrame();
+        }
+        else {
+            this->showFrame();
+        }
     };
 
     std::thread(fun).detach();
@@ -94,6 +389,39 @@ bool RenderWindow::Init(int pos_x, int pos_y, int width, int height)
         return false;
     }
 
+    if (usePlaylist) {
+        // Ƶߴڵһ֡ʱ
+        if (!render.InitDevice(GetHandle(), width, height)) {
+            return false;
+        }
+
+        return playlist.Open(render.GetD3D11Device(), HARD_WARE_DECODER);
+    }
+
+    if (IsYuvFile(filePath)) {
+        // YUVļ
+        if (!yuvSource.Open(filePath, RAW_YUV_WIDTH, RAW_YUV_HEIGHT)) {
+            return false;
+        }
+        yuvSource.SetLoop(true);
+
+        return render.InitDevice(GetHandle(), yuvSource.GetWidth(), yuvSource.GetHeight());
+    }
+
+    if (AVElementarySource::IsElementaryStream(filePath)) {
+        // 
+        if (!esSource.Open(filePath)) {
+            return false;
+        }
+
+        const AVCodecParameters* codecpar = esSource.GetCodecParameters();
+        if (!render.InitDevice(GetHandle(), codecpar->width, codecpar->height)) {
+            return false;
+        }
+
+        return decoder.Init(codecpar, esSource.GetTimeBase(), render.GetD3D11Device(), HARD_WARE_DECODER);
+    }
+
     // Ƶļ
     if (!demuxer.Open(filePath)) {
         return false;
@@ -129,55 +457,158 @@ void RenderWindow::showFrame()
     AVDemuxer* demuxer = this->GetDemuxer();
     AVDecoder* decoder = this->GetDecoder();
 
-    AVStream* videoStream = demuxer->GetVideoStream();
+    // ֻһ·Ƶ
+    bool elementary = esSource.IsOpened();
+    int videoIndex = elementary ? 0 : demuxer->GetVideoStream()->index;
+
+    // ȡ֡ѭ˳֪ͨͰֹ߳ͣ
+    std::atomic<bool> stop{ false };
+
+    // Ͱ߳: ȡݰ, ʱȴȡ֡
+    std::thread feeder([&]() {
+        AVPacket* packet = av_packet_alloc();
+
+        while (!stop)
+        {
+            Sleep(10);
+
+            // ȡݰ
+            int ret = elementary ? esSource.Read(packet) : demuxer->Read(packet);
+            if (ret < 0) {
+                bool eof = elementary ? esSource.IsEOF() : demuxer->IsEOF();
+                if (!eof && ret == -1) {
+                    // ʱ, 
+                    continue;
+                }
+
+                // ļȡ: Ϳհ, ȡʣ֡
+                decoder->SendWait(nullptr);
+                break;
+            }
+
+            // Ƶݰ
+            if (packet->stream_index == videoIndex) {
+                // 
+                ret = decoder->SendWait(packet);
+            }
+
+            av_packet_unref(packet);
+
+            if (ret == AVERROR_EXIT) {
+                break;
+            }
+        }
+
+        av_packet_free(&packet);
+    });
 
-    AVPacket tmp_av_packet, * packet = &tmp_av_packet;
     AVFrame* frame = av_frame_alloc();
 
     int index = 0;
 
+    // ȡ֡: û֡ʱȴͰ߳, ѯ
     while (true)
     {
-        Sleep(10);
-        AVPacket* packet = av_packet_alloc();
-
-        // ȡݰ
-        int ret = demuxer->Read(packet);
+        // ȡ֡
+        int ret = decoder->RecvWait(frame);
         if (ret < 0) {
-            continue;
+            // Ž, ѹر/޷ָ
+            break;
         }
 
-
         index++;
         if (index % 100 == 0) {
             // תǶ
             render->Rotate(90 * (-index / 100));
         }
 
-        // Ƶݰ
-        if (packet->stream_index == videoStream->index)
-        {
-            // 
-            ret = decoder->Send(packet);
-            while (ret >= 0)
-            {
-                // ȡ֡
-                ret = decoder->Recv(frame);
-                if (ret >= 0)
-                {
-                    // Ⱦ
-                    render->UpdateScene(frame, HARD_WARE_DECODER);
-
-                    // ʾ
-                    render->Present();
-                }
+        if (index % 1000 == 0) {
+            PrintRenderStats(render);
+        }
 
+        // Ⱦ
+        // Ӳʧʱ˵
+        render->UpdateScene(frame, frame->format == AV_PIX_FMT_D3D11);
 
-                av_frame_unref(frame);
-            }
+        // ʾ
+        render->Present();
+
+        av_frame_unref(frame);
+    }
+
+    stop = true;
+    decoder->Abort();
+    feeder.join();
+
+    av_frame_free(&frame);
+}
+
+
+void RenderWindow::showYuvFrame()
+{
+    Render* render = this->GetRender();
+    AVYuvSource* source = this->GetYuvSource();
+
+    AVFrame* frame = av_frame_alloc();
+    int index = 0;
+
+    while (true)
+    {
+        // ֱָ֡ļӳ, 
+        int ret = source->Read(frame);
+        if (ret < 0) {
+            break;
+        }
+
+        if (++index % 1000 == 0) {
+            PrintRenderStats(render);
         }
 
+        // Ⱦ
+        render->UpdateScene(frame, false);
 
-        av_packet_unref(packet);
+        // ʾ
+        render->Present();
+
+        av_frame_unref(frame);
     }
+
+    av_frame_free(&frame);
 }
+
+
+void RenderWindow::showPlaylistFrame()
+{
+    Render* render = this->GetRender();
+
+    AVFrame* frame = av_frame_alloc();
+    int index = -1;
+    int64_t frames = 0;
+
+    while (playlist.Read(frame) >= 0)
+    {
+        if (++frames % 1000 == 0) {
+            PrintRenderStats(render);
+        }
+
+        if (index != playlist.GetCurrentIndex()) {
+            if (index >= 0) {
+                LOG("playlist switch %d -> %d, gap %.2f ms\n", index, playlist.GetCurrentIndex(), playlist.GetLastSwitchGap());
+            }
+            index = playlist.GetCurrentIndex();
+        }
+
+        // ķֱʿܲͬ
+        render->SetVideoSize(frame->width, frame->height);
+
+        // Ⱦ
+        render->UpdateScene(frame, frame->format == AV_PIX_FMT_D3D11);
+
+        // ʾ
+        render->Present();
+
+        av_frame_unref(frame);
+    }
+
+    av_frame_free(&frame);
+}
\ No newline at end of file
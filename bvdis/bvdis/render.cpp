@@ -4,6 +4,9 @@
 #include "VertexShader_vs.h"
 #include "PixelShader_vs.h"
 
+// ֲϴС ()
+static const int kDirtyTileSize = 64;
+
 
 extern "C"
 {
@@ -23,6 +26,16 @@ Render::Render()
     this->videoHeight = 0;
     this->m_angle = 0;
     this->isReset = false;
+    this->skipDuplicates = true;
+    this->skipPresent = false;
+    this->partialUpload = true;
+    this->uploadedFrame = av_frame_alloc();
+    this->stagingIndex = 0;
+}
+
+Render::~Render()
+{
+    av_frame_free(&uploadedFrame);
 }
 
 bool Render::InitDevice(HWND hwnd, int videoWidth, int videoHeight)
@@ -345,53 +358,8 @@ bool Render::InitDevice(HWND hwnd, int videoWidth, int videoHeight)
     }
 
 
-    D3D11_TEXTURE2D_DESC tdesc = {};
-    tdesc.Format = DXGI_FORMAT_NV12;
-    tdesc.Usage = D3D11_USAGE_DEFAULT;
-    tdesc.MiscFlags = D3D11_RESOURCE_MISC_SHARED;
-    tdesc.ArraySize = 1;
-    tdesc.MipLevels = 1;
-    tdesc.SampleDesc.Count = 1;
-    tdesc.Width = videoWidth;
-    tdesc.Height = videoHeight;
-    tdesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-
-    // 
-    hr = m_pd3dDevice->CreateTexture2D(&tdesc, nullptr, videoTexture.GetAddressOf());
-    if (LOG_CHECK_HR(FAILED(hr), "CreateTexture2D fail. %v\n", hr)) {
-        return false;
-    }
-
-
-    // Y
-    D3D11_SHADER_RESOURCE_VIEW_DESC luminancePlaneDesc = CD3D11_SHADER_RESOURCE_VIEW_DESC(
-        videoTexture.Get(),
-        D3D11_SRV_DIMENSION_TEXTURE2D,
-        DXGI_FORMAT_R8_UNORM
-    );
-
-    hr = m_pd3dDevice->CreateShaderResourceView(
-        videoTexture.Get(),
-        &luminancePlaneDesc,
-        m_luminanceView.GetAddressOf()
-    );
-    if (LOG_CHECK_HR(hr, "CreateShaderResourceView fail. %v\n", hr)) {
-        return false;
-    }
-
-    // UV
-    D3D11_SHADER_RESOURCE_VIEW_DESC chrominancePlaneDesc = CD3D11_SHADER_RESOURCE_VIEW_DESC(
-        videoTexture.Get(),
-        D3D11_SRV_DIMENSION_TEXTURE2D,
-        DXGI_FORMAT_R8G8_UNORM
-    );
-
-    hr = m_pd3dDevice->CreateShaderResourceView(
-        videoTexture.Get(),
-        &chrominancePlaneDesc,
-        m_chrominanceView.GetAddressOf()
-    );
-    if (LOG_CHECK_HR(hr, "CreateShaderResourceView fail. %v\n", hr)) {
+    // Ƶ
+    if (!CreateVideoTexture()) {
         return false;
     }
 
@@ -500,6 +468,73 @@ bool Render::InitDevice(HWND hwnd, int videoWidth, int videoHeight)
     }
 
 
+    SetViewport();
+
+    this->Reset();
+
+    return true;
+}
+
+
+bool Render::CreateVideoTexture()
+{
+    HRESULT hr = S_OK;
+
+    D3D11_TEXTURE2D_DESC tdesc = {};
+    tdesc.Format = DXGI_FORMAT_NV12;
+    tdesc.Usage = D3D11_USAGE_DEFAULT;
+    tdesc.MiscFlags = D3D11_RESOURCE_MISC_SHARED;
+    tdesc.ArraySize = 1;
+    tdesc.MipLevels = 1;
+    tdesc.SampleDesc.Count = 1;
+    tdesc.Width = videoWidth;
+    tdesc.Height = videoHeight;
+    tdesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+    // 
+    hr = m_pd3dDevice->CreateTexture2D(&tdesc, nullptr, videoTexture.GetAddressOf());
+    if (LOG_CHECK_HR(FAILED(hr), "CreateTexture2D fail. %v\n", hr)) {
+        return false;
+    }
+
+
+    // Y
+    D3D11_SHADER_RESOURCE_VIEW_DESC luminancePlaneDesc = CD3D11_SHADER_RESOURCE_VIEW_DESC(
+        videoTexture.Get(),
+        D3D11_SRV_DIMENSION_TEXTURE2D,
+        DXGI_FORMAT_R8_UNORM
+    );
+
+    hr = m_pd3dDevice->CreateShaderResourceView(
+        videoTexture.Get(),
+        &luminancePlaneDesc,
+        m_luminanceView.GetAddressOf()
+    );
+    if (LOG_CHECK_HR(hr, "CreateShaderResourceView fail. %v\n", hr)) {
+        return false;
+    }
+
+    // UV
+    D3D11_SHADER_RESOURCE_VIEW_DESC chrominancePlaneDesc = CD3D11_SHADER_RESOURCE_VIEW_DESC(
+        videoTexture.Get(),
+        D3D11_SRV_DIMENSION_TEXTURE2D,
+        DXGI_FORMAT_R8G8_UNORM
+    );
+
+    hr = m_pd3dDevice->CreateShaderResourceView(
+        videoTexture.Get(),
+        &chrominancePlaneDesc,
+        m_chrominanceView.GetAddressOf()
+    );
+    if (LOG_CHECK_HR(hr, "CreateShaderResourceView fail. %v\n", hr)) {
+        return false;
+    }
+
+    return true;
+}
+
+void Render::SetViewport()
+{
     D3D11_VIEWPORT viewPort = {};
     viewPort.TopLeftX = 0;
     viewPort.TopLeftY = 0;
@@ -508,7 +543,30 @@ bool Render::InitDevice(HWND hwnd, int videoWidth, int videoHeight)
     viewPort.MaxDepth = 1;
     viewPort.MinDepth = 0;
     m_pd3dImmediateContext->RSSetViewports(1, &viewPort);
+}
+
+bool Render::SetVideoSize(int videoWidth, int videoHeight)
+{
+    if (this->videoWidth == videoWidth && this->videoHeight == videoHeight) {
+        return true;
+    }
+
+    this->videoWidth = videoWidth;
+    this->videoHeight = videoHeight;
+
+    // ߴ仯, ؽ
+    m_luminanceView.Reset();
+    m_chrominanceView.Reset();
+    videoTexture.Reset();
+    stagingTextures[0].Reset();
+    stagingTextures[1].Reset();
+    av_frame_unref(uploadedFrame);
+
+    if (!CreateVideoTexture()) {
+        return false;
+    }
 
+    SetViewport();
     this->Reset();
 
     return true;
@@ -525,6 +583,7 @@ void Render::Rotate(int angel)
 void Render::Destroy()
 {
     m_pd3dImmediateContext->ClearState();
+    av_frame_unref(uploadedFrame);
 
     // Զͷ
     //m_d3dRenderTargetView->Release();
@@ -539,8 +598,33 @@ void Render::Reset()
     this->isReset = true;
 }
 
+void Render::SetPartialUpload(bool partial)
+{
+    partialUpload = partial;
+    av_frame_unref(uploadedFrame);
+}
+
+void Render::SetSkipDuplicates(bool skip)
+{
+    skipDuplicates = skip;
+    comparator.Reset();
+}
+
 void Render::UpdateScene(AVFrame* frame, bool HW)
 {
+    // ظ֡: ĻѾһ֡, ڱ仯תʱػ
+    skipPresent = false;
+    if (skipDuplicates && !HW) {
+        if (comparator.IsDuplicate(frame) && !this->isReset) {
+            skipPresent = true;
+            return;
+        }
+    }
+    else {
+        // Ӳ֡Ƚ, ֮֮֡ǰ֡Ƚ
+        comparator.Reset();
+    }
+
     if (this->isReset) {
         this->isReset = false;
 
@@ -605,11 +689,22 @@ void Render::Copy(AVFrame* frame, bool HW)
             pSrcResource,
             srcSubresource,
             &pSrcBox);
+
+        // Ѳϴ֡
+        av_frame_unref(uploadedFrame);
     }
     else
     {
         // 
 
+        // ֻв仯ʱ, ֻתϴЩ
+        if (partialUpload && uploadedFrame->data[0]) {
+            int64_t area = AVFrameComparator::DirtyRects(uploadedFrame, frame, kDirtyTileSize, &dirtyRects);
+            if (area >= 0 && area * 2 <= (int64_t)videoWidth * videoHeight && CopyDirtyRects(frame)) {
+                return;
+            }
+        }
+
         HRESULT hr = S_OK;
         int half_width = (videoWidth) / 2;
         int half_height = (videoHeight) / 2;
@@ -618,29 +713,7 @@ void Render::Copy(AVFrame* frame, bool HW)
         void* resource_data = NULL;
         int dst_pitch = frame->linesize[0]; // map.RowPitch;
 
-        size_t totalSize = videoWidth * videoHeight + videoWidth * videoHeight / 2;
-
-#if 0
-        // ȡһ֡YUV
-        static char* buffer = NULL;
-        if (!buffer) {
-            FILE* fp = fopen("out.yuv", "rb");
-            if (fp) {
-                buffer = (char*)malloc(totalSize + 10);
-                if (buffer) {
-                    memset(buffer, 0, totalSize + 10);
-                    size_t n = fread(buffer, 1, totalSize + 10, fp);
-                    if (n > 0) {
-                        resource_data = buffer;
-                        // memset((char*)resource_data + 1280 * 720, 0, totalSize - 1280 * 720);
-                    }
-                }
-            }
-        }
-        else {
-            resource_data = buffer;
-        }
-#else
+        size_t totalSize = dst_pitch * videoHeight + dst_pitch * videoHeight / 2;
 
         if (yuv_data.size() != totalSize) {
             yuv_data.resize(totalSize);
@@ -662,16 +735,16 @@ void Render::Copy(AVFrame* frame, bool HW)
 
         // YUV420PתNV12
         // YYYYUUVV -> YYYYUVUV
-        if (frame->format == AVPixelFormat::AV_PIX_FMT_YUV420P) {
+        if (frame->format == AVPixelFormat::AV_PIX_FMT_YUV420P || frame->format == AVPixelFormat::AV_PIX_FMT_YUVJ420P) {
             this->YUV420PToNV12(dst_data, videoWidth, videoHeight, dst_pitch, yuv, aiStrike);
         }
+        else if (frame->format == AVPixelFormat::AV_PIX_FMT_NV12) {
+            this->CopyNV12(dst_data, videoWidth, videoHeight, dst_pitch, yuv, aiStrike);
+        }
         else {
             LOG("un support AVPixelFormat, %d\n", frame->format);
         }
 
-
-#endif
-
         if (resource_data) {
             d3d11_context_->UpdateSubresource(
                 texture,
@@ -681,8 +754,114 @@ void Render::Copy(AVFrame* frame, bool HW)
                 dst_pitch,
                 0
             );
+
+            uploadStats.frames++;
+            uploadStats.bytes += totalSize;
+            uploadStats.lastBytes = totalSize;
+            uploadStats.frameBytes = totalSize;
+
+            av_frame_unref(uploadedFrame);
+            if (partialUpload && av_frame_ref(uploadedFrame, frame) < 0) {
+                av_frame_unref(uploadedFrame);
+            }
+        }
+    }
+}
+
+// ѱ仯ľתNV12дstaging, Ƶͬλ
+bool Render::CopyDirtyRects(AVFrame* frame)
+{
+    bool nv12 = frame->format == AVPixelFormat::AV_PIX_FMT_NV12;
+    if (!nv12 && frame->format != AVPixelFormat::AV_PIX_FMT_YUV420P && frame->format != AVPixelFormat::AV_PIX_FMT_YUVJ420P) {
+        return false;
+    }
+
+    ComPtr<ID3D11Texture2D>& staging = stagingTextures[stagingIndex];
+    if (!staging) {
+        D3D11_TEXTURE2D_DESC tdesc = {};
+        tdesc.Format = DXGI_FORMAT_NV12;
+        tdesc.Usage = D3D11_USAGE_STAGING;
+        tdesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        tdesc.ArraySize = 1;
+        tdesc.MipLevels = 1;
+        tdesc.SampleDesc.Count = 1;
+        tdesc.Width = videoWidth;
+        tdesc.Height = videoHeight;
+
+        HRESULT hr = m_pd3dDevice->CreateTexture2D(&tdesc, nullptr, staging.GetAddressOf());
+        if (LOG_CHECK_HR(FAILED(hr), "CreateTexture2D(staging) fail. %v\n", hr)) {
+            partialUpload = false;
+            return false;
+        }
+    }
+    stagingIndex ^= 1;
+
+    D3D11_MAPPED_SUBRESOURCE map;
+    HRESULT hr = m_pd3dImmediateContext->Map(staging.Get(), 0, D3D11_MAP_WRITE, 0, &map);
+    if (FAILED(hr)) {
+        LOG("staging Map fail. %d\n", hr);
+        return false;
+    }
+
+    // NV12: UVƽYƽ֮
+    uint8_t* dstY = (uint8_t*)map.pData;
+    uint8_t* dstUV = dstY + (size_t)map.RowPitch * videoHeight;
+    int64_t bytes = 0;
+
+    for (const AVDirtyRect& rect : dirtyRects) {
+        for (int i = 0; i < rect.height; i++) {
+            memcpy(dstY + (size_t)(rect.y + i) * map.RowPitch + rect.x,
+                frame->data[0] + (size_t)(rect.y + i) * frame->linesize[0] + rect.x,
+                rect.width);
+        }
+
+        // Ͻż, ɫȰ2x2
+        int uvRows = (rect.height + 1) / 2;
+        int uvWidth = (rect.width + 1) / 2;
+        for (int i = 0; i < uvRows; i++) {
+            int row = rect.y / 2 + i;
+            uint8_t* dst = dstUV + (size_t)row * map.RowPitch + rect.x;
+            if (nv12) {
+                memcpy(dst, frame->data[1] + (size_t)row * frame->linesize[1] + rect.x, uvWidth * 2);
+            }
+            else {
+                const uint8_t* U = frame->data[1] + (size_t)row * frame->linesize[1] + rect.x / 2;
+                const uint8_t* V = frame->data[2] + (size_t)row * frame->linesize[2] + rect.x / 2;
+                for (int j = 0; j < uvWidth; j++) {
+                    *dst++ = U[j];
+                    *dst++ = V[j];
+                }
+            }
         }
+
+        bytes += (int64_t)rect.width * rect.height + (int64_t)uvWidth * 2 * uvRows;
+    }
+
+    m_pd3dImmediateContext->Unmap(staging.Get(), 0);
+
+    for (const AVDirtyRect& rect : dirtyRects) {
+        D3D11_BOX box = {};
+        box.left = rect.x;
+        box.top = rect.y;
+        box.right = rect.x + rect.width;
+        box.bottom = rect.y + rect.height;
+        box.front = 0;
+        box.back = 1;
+
+        m_pd3dImmediateContext->CopySubresourceRegion(videoTexture.Get(), 0, rect.x, rect.y, 0, staging.Get(), 0, &box);
+    }
+
+    uploadStats.frames++;
+    uploadStats.partialFrames++;
+    uploadStats.bytes += bytes;
+    uploadStats.lastBytes = bytes;
+
+    av_frame_unref(uploadedFrame);
+    if (av_frame_ref(uploadedFrame, frame) < 0) {
+        av_frame_unref(uploadedFrame);
     }
+
+    return true;
 }
 
 void Render::Draw()
@@ -760,6 +939,19 @@ void Render::Draw()
 
 bool Render::Present()
 {
+    if (skipPresent) {
+        // 治䲻Present, Եһֱͬ, ԭĲŽ
+        ComPtr<IDXGIOutput> output;
+        if (SUCCEEDED(m_pSwapChain->GetContainingOutput(output.GetAddressOf())) &&
+            SUCCEEDED(output->WaitForVBlank())) {
+            return true;
+        }
+
+        // ȡʾʱе֡ػ (תģʽº̨ݲ)
+        Clean();
+        Draw();
+    }
+
     m_pSwapChain->Present(1, 0);
 
     return true;
@@ -876,5 +1068,39 @@ int Render::YUV420PToNV12(uint8_t* dst, int sourceWidth, int sourceHeight, int d
         V += aiStrike[2];
     }
 
+    return 0;
+}
+
+int Render::CopyNV12(uint8_t* dst, int sourceWidth, int sourceHeight, int dstPitch, uint8_t** data, const int* aiStrike)
+{
+    if (NULL == data) {
+        return 0;
+    }
+    const uint8_t* Y = data[0];
+    const uint8_t* UV = data[1];
+
+    if (NULL == Y || NULL == UV) {
+        return 0;
+    }
+
+    uint8_t* dst_data = dst;
+
+    // fill Y plane
+    int pitch_min = MinValue(aiStrike[0], dstPitch);
+    for (int i = 0; i < sourceHeight; i++) {
+        memcpy(dst_data, Y, pitch_min);
+        Y += aiStrike[0];
+        dst_data += dstPitch;
+    }
+
+    // fill UV plane, already interleaved
+    int halfHeight = (sourceHeight + 1) >> 1;
+    pitch_min = MinValue(aiStrike[1], dstPitch);
+    for (int i = 0; i < halfHeight; i++) {
+        memcpy(dst_data, UV, pitch_min);
+        UV += aiStrike[1];
+        dst_data += dstPitch;
+    }
+
     return 0;
 }
\ No newline at end of file
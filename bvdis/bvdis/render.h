@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <string>
+#include <vector>
 #include <Windows.h>
 #include <d3d11.h>
 #include <d3d11_1.h>
@@ -17,10 +18,21 @@ extern "C" {
 }
 
 #include "Camera.h"
+#include "av_frame_compare.h"
 
 using Microsoft::WRL::ComPtr;
 
 
+// ϴͳ (֡)
+struct RenderUploadStats
+{
+    int64_t frames = 0;        // ϴ֡
+    int64_t partialFrames = 0; // ֻϴ˱仯֡
+    int64_t bytes = 0;         // ϴNV12ֽ
+    int64_t lastBytes = 0;     // һ֡
+    int64_t frameBytes = 0;    // ֽ֡
+};
+
 class Render
 {
     struct Vertex {
@@ -33,6 +45,7 @@ class Render
 
 public:
     Render();
+    ~Render();
 
     bool InitDevice(HWND hwnd, int videoWidth, int videoHeight);
     void* GetD3D11Device() { return m_pd3dDevice.Get(); }
@@ -40,8 +53,18 @@ public:
     void UpdateScene(AVFrame* frame, bool HW);
     bool Present();
 
+    // һ֡ȫͬ֡ת, ϴPresent (ֻ֡), ĬϿ
+    // ֡Present()Եȴһֱͬ, ٶȲ
+    void SetSkipDuplicates(bool skip);
+    AVFrameCompareStats GetDuplicateStats() { return comparator.GetStats(); }
+
+    // ֻϴһ֡ȱ仯, ĬϿ
+    void SetPartialUpload(bool partial);
+    RenderUploadStats GetUploadStats() { return uploadStats; }
+
     void Reset();
     void Rotate(int angel);
+    bool SetVideoSize(int videoWidth, int videoHeight);
 
     void Destroy();
 
@@ -50,10 +73,14 @@ protected:
     void Copy(AVFrame* frame, bool HW);
     void Draw();
     void OnResize();
+    bool CreateVideoTexture();
+    bool CopyDirtyRects(AVFrame* frame);
+    void SetViewport();
 
     void MulTransformMatrix(const DirectX::XMMATRIX& matrix);
     void UpdateScaling(double videoW, double videoH, double winW, double winH, int angle);
     int YUV420PToNV12(uint8_t* dst, int sourceWidth, int sourceHeight, int dstPitch, uint8_t** data, const int* aiStrike);
+    int CopyNV12(uint8_t* dst, int sourceWidth, int sourceHeight, int dstPitch, uint8_t** data, const int* aiStrike);
 
 private:
     HWND window;
@@ -65,6 +92,18 @@ private:
     std::string yuv_data;
     nv::Camera camera;
 
+    AVFrameComparator comparator; // ظ֡
+    bool skipDuplicates;
+    bool skipPresent;
+
+    // ֲϴ: е֡Ƚ, 仯ľдstaging󿽱
+    bool partialUpload;
+    AVFrame* uploadedFrame; // ǰݶӦ֡
+    std::vector<AVDirtyRect> dirtyRects;
+    ComPtr<ID3D11Texture2D> stagingTextures[2]; // ʹ, ȴGPU
+    int stagingIndex;
+    RenderUploadStats uploadStats;
+
     // Direct3D 11
     ComPtr<ID3D11Device> m_pd3dDevice; // 豸
     ComPtr<ID3D11DeviceContext> m_pd3dImmediateContext; // 豸